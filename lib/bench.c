@@ -0,0 +1,554 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+/* Benchmarks of the library on simulated devices. The results are printed
+ * as JSON. All workloads are fixed, so runs on the same machine are
+ * comparable. */
+
+#include "libsds200a.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Samples decoded per round and rounds of the decode benchmark */
+#define DECODE_SAMPLES (1 << 20)
+#define DECODE_ROUNDS 20
+
+/* Frames read in the read path benchmark */
+#define READ_FRAMES 2000
+
+/* Segment size of the recording benchmark, small enough to switch the
+ * segments several times */
+#define RECORD_SEGMENT_SIZE (4 << 20)
+
+/* Iterations of the setter and startup benchmarks */
+#define SETTER_ITERATIONS 200
+#define STARTUP_ITERATIONS 20
+
+/* The decoder of the library built without SSE2 (decode_scalar.o, see the
+ * Makefile) */
+void decode_samples_scalar(const struct sds_samples *data, size_t count,
+			   uint16_t *advalues);
+
+static uint64_t now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Number of members of the result object printed so far */
+static int sections;
+
+/* Starts a member of the result object. Benchmarks call this only once they
+ * succeeded, so a failure leaves valid JSON behind. */
+static void begin_section(const char *name)
+{
+	printf("%s\"%s\": {", sections++ ? ", " : "", name);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+/* Prints mean, median, 99th percentile and maximum of durations (sorts
+ * them) */
+static void print_stats(const char *name, uint64_t *values, size_t count)
+{
+	uint64_t sum = 0;
+	size_t i;
+
+	qsort(values, count, sizeof(*values), compare_u64);
+	for (i = 0; i < count; ++i)
+		sum += values[i];
+	printf("\"%s\": {\"mean\": %.0f, \"p50\": %llu, \"p99\": %llu, \"max\": %llu}",
+	       name, (double) sum / count,
+	       (unsigned long long) values[count / 2],
+	       (unsigned long long) values[count * 99 / 100],
+	       (unsigned long long) values[count - 1]);
+}
+
+static int open_simulated(struct sds_device_list *devices, sds_context **context)
+{
+	if (sds_initialize(&devices->array[0], context)) {
+		fprintf(stderr, "Could not open the simulated device\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* Reads frames until one arrives */
+static struct sds_frame *next_frame(sds_context *context)
+{
+	struct sds_frame *frame = NULL;
+	while (!frame)
+		if (sds_get_frame(context, &frame))
+			return NULL;
+	return frame;
+}
+
+static int bench_decode(sds_context *context)
+{
+	struct sds_frame *frame = next_frame(context);
+	struct sds_samples *data;
+	uint16_t *scalar;
+	uint16_t *vector;
+	uint64_t start;
+	uint64_t scalar_ns;
+	uint64_t vector_ns;
+	size_t i;
+	int round;
+	int mismatches = 0;
+	int ret = 1;
+
+	if (!frame)
+		return 1;
+	data = malloc(sizeof(*data) + DECODE_SAMPLES * sizeof(data->samples[0]));
+	scalar = malloc(DECODE_SAMPLES * sizeof(*scalar));
+	vector = malloc(DECODE_SAMPLES * sizeof(*vector));
+	if (!data || !scalar || !vector) {
+		sds_free_frame(frame);
+		goto out;
+	}
+	/* Repeat the samples of a simulated frame */
+	for (i = 0; i < DECODE_SAMPLES; ++i)
+		data->samples[i] = frame->data->samples[i % frame->count];
+	sds_free_frame(frame);
+
+	/* Both decode the same buffer with the same loop, only the SIMD path
+	 * differs */
+	start = now_ns();
+	for (round = 0; round < DECODE_ROUNDS; ++round)
+		decode_samples_scalar(data, DECODE_SAMPLES, scalar);
+	scalar_ns = now_ns() - start;
+
+	start = now_ns();
+	for (round = 0; round < DECODE_ROUNDS; ++round)
+		sds_decode_samples(context, data, DECODE_SAMPLES, vector);
+	vector_ns = now_ns() - start;
+
+	/* Both have to agree */
+	for (i = 0; i < DECODE_SAMPLES; ++i)
+		if (scalar[i] != vector[i])
+			mismatches++;
+
+	begin_section("decode");
+	printf("\"samples\": %d, \"rounds\": %d, "
+	       "\"scalar_msps\": %.1f, \"vector_msps\": %.1f, "
+	       "\"speedup\": %.2f, \"mismatches\": %d}",
+	       DECODE_SAMPLES, DECODE_ROUNDS,
+	       (double) DECODE_SAMPLES * DECODE_ROUNDS * 1000 / scalar_ns,
+	       (double) DECODE_SAMPLES * DECODE_ROUNDS * 1000 / vector_ns,
+	       (double) scalar_ns / vector_ns, mismatches);
+	ret = mismatches != 0;
+
+out:
+	free(data);
+	free(scalar);
+	free(vector);
+	return ret;
+}
+
+/* Packs and unpacks the samples of a simulated frame, both results have to
+ * decode like the original samples */
+static int bench_packed(sds_context *context)
+{
+	struct sds_frame *frame = next_frame(context);
+	struct sds_samples *data;
+	struct sds_samples *raw;
+	uint8_t *packed;
+	uint16_t *expected;
+	uint16_t *values;
+	uint64_t start;
+	uint64_t pack_ns;
+	uint64_t unpack_ns;
+	uint64_t raw_ns;
+	size_t length;
+	size_t i;
+	int round;
+	int mismatches = 0;
+	int ret = 1;
+
+	if (!frame)
+		return 1;
+	data = malloc(sizeof(*data) + DECODE_SAMPLES * sizeof(data->samples[0]));
+	raw = malloc(sizeof(*raw) + DECODE_SAMPLES * sizeof(raw->samples[0]));
+	packed = malloc(SDS_PACKED_MAX_SIZE(DECODE_SAMPLES));
+	expected = malloc(DECODE_SAMPLES * sizeof(*expected));
+	values = malloc(DECODE_SAMPLES * sizeof(*values));
+	if (!data || !raw || !packed || !expected || !values) {
+		sds_free_frame(frame);
+		goto out;
+	}
+	for (i = 0; i < DECODE_SAMPLES; ++i)
+		data->samples[i] = frame->data->samples[i % frame->count];
+	/* Some missing samples to exercise the bitmap */
+	for (i = 0; i < DECODE_SAMPLES; i += 4099)
+		data->samples[i] = 0xffff;
+	sds_free_frame(frame);
+	sds_decode_samples(context, data, DECODE_SAMPLES, expected);
+
+	start = now_ns();
+	for (round = 0; round < DECODE_ROUNDS; ++round)
+		sds_pack_samples(data, DECODE_SAMPLES, packed, &length);
+	pack_ns = now_ns() - start;
+
+	start = now_ns();
+	for (round = 0; round < DECODE_ROUNDS; ++round)
+		sds_unpack_samples(packed, length, DECODE_SAMPLES, values);
+	unpack_ns = now_ns() - start;
+	for (i = 0; i < DECODE_SAMPLES; ++i)
+		if (values[i] != expected[i])
+			mismatches++;
+
+	start = now_ns();
+	for (round = 0; round < DECODE_ROUNDS; ++round)
+		sds_unpack_to_raw(packed, length, DECODE_SAMPLES, raw);
+	raw_ns = now_ns() - start;
+	sds_decode_samples(context, raw, DECODE_SAMPLES, values);
+	for (i = 0; i < DECODE_SAMPLES; ++i)
+		if (values[i] != expected[i])
+			mismatches++;
+
+	/* Throughput in bytes of raw samples */
+	begin_section("packed");
+	printf("\"samples\": %d, \"rounds\": %d, \"ratio\": %.3f, "
+	       "\"pack_gb_s\": %.2f, \"unpack_gb_s\": %.2f, "
+	       "\"unpack_raw_gb_s\": %.2f, \"mismatches\": %d}",
+	       DECODE_SAMPLES, DECODE_ROUNDS,
+	       (double) length / (DECODE_SAMPLES * sizeof(data->samples[0])),
+	       (double) DECODE_SAMPLES * DECODE_ROUNDS * 2 / pack_ns,
+	       (double) DECODE_SAMPLES * DECODE_ROUNDS * 2 / unpack_ns,
+	       (double) DECODE_SAMPLES * DECODE_ROUNDS * 2 / raw_ns,
+	       mismatches);
+	ret = mismatches != 0;
+
+out:
+	free(data);
+	free(raw);
+	free(packed);
+	free(expected);
+	free(values);
+	return ret;
+}
+
+/* Compresses the samples of a simulated frame and a slow signal, the
+ * decompressed values have to match the decoded ones */
+static int bench_compress(sds_context *context)
+{
+	struct sds_frame *frame = next_frame(context);
+	struct sds_samples *data;
+	uint8_t *compressed;
+	uint16_t *expected;
+	uint16_t *values;
+	uint64_t start;
+	uint64_t compress_ns;
+	uint64_t decompress_ns;
+	size_t length;
+	size_t slow_length;
+	size_t i;
+	int value;
+	int round;
+	int mismatches = 0;
+	int ret = 1;
+
+	if (!frame)
+		return 1;
+	data = malloc(sizeof(*data) + DECODE_SAMPLES * sizeof(data->samples[0]));
+	compressed = malloc(SDS_COMPRESSED_MAX_SIZE(DECODE_SAMPLES));
+	expected = malloc(DECODE_SAMPLES * sizeof(*expected));
+	values = malloc(DECODE_SAMPLES * sizeof(*values));
+	if (!data || !compressed || !expected || !values) {
+		sds_free_frame(frame);
+		goto out;
+	}
+
+	/* A sine with one period per 2^18 samples of each channel */
+	for (i = 0; i < DECODE_SAMPLES; ++i) {
+		value = 512 + 400 * sin(i / 2 * 2 * M_PI / (1 << 18));
+		data->samples[i] = 0x8000 | ((value & 0x3c0) << 2) | (value & 0x3f);
+	}
+	sds_compress_samples(data, DECODE_SAMPLES, compressed, &slow_length);
+
+	for (i = 0; i < DECODE_SAMPLES; ++i)
+		data->samples[i] = frame->data->samples[i % frame->count];
+	sds_free_frame(frame);
+	sds_decode_samples(context, data, DECODE_SAMPLES, expected);
+
+	start = now_ns();
+	for (round = 0; round < DECODE_ROUNDS; ++round)
+		sds_compress_samples(data, DECODE_SAMPLES, compressed, &length);
+	compress_ns = now_ns() - start;
+
+	start = now_ns();
+	for (round = 0; round < DECODE_ROUNDS; ++round)
+		sds_decompress_samples(compressed, length, DECODE_SAMPLES, values);
+	decompress_ns = now_ns() - start;
+	for (i = 0; i < DECODE_SAMPLES; ++i)
+		if (values[i] != expected[i])
+			mismatches++;
+
+	/* Sizes relative to and throughput in bytes of raw samples */
+	begin_section("compress");
+	printf("\"samples\": %d, \"rounds\": %d, "
+	       "\"ratio\": %.3f, \"slow_ratio\": %.3f, "
+	       "\"compress_gb_s\": %.2f, \"decompress_gb_s\": %.2f, "
+	       "\"mismatches\": %d}",
+	       DECODE_SAMPLES, DECODE_ROUNDS,
+	       (double) length / (DECODE_SAMPLES * sizeof(data->samples[0])),
+	       (double) slow_length / (DECODE_SAMPLES * sizeof(data->samples[0])),
+	       (double) DECODE_SAMPLES * DECODE_ROUNDS * 2 / compress_ns,
+	       (double) DECODE_SAMPLES * DECODE_ROUNDS * 2 / decompress_ns,
+	       mismatches);
+	ret = mismatches != 0;
+
+out:
+	free(data);
+	free(compressed);
+	free(expected);
+	free(values);
+	return ret;
+}
+
+static int bench_read(sds_context *context)
+{
+	uint64_t latency[READ_FRAMES];
+	struct sds_frame *frame;
+	uint64_t start;
+	uint64_t last;
+	uint64_t now;
+	int i;
+
+	start = last = now_ns();
+	for (i = 0; i < READ_FRAMES; ++i) {
+		if (!(frame = next_frame(context)))
+			return 1;
+		sds_free_frame(frame);
+		now = now_ns();
+		latency[i] = now - last;
+		last = now;
+	}
+
+	begin_section("read");
+	printf("\"frames\": %d, \"fps\": %.1f, ",
+	       READ_FRAMES, READ_FRAMES * 1e9 / (last - start));
+	print_stats("frame_ns", latency, READ_FRAMES);
+	printf("}");
+	return 0;
+}
+
+/* Reads frames while they are recorded, then decodes all frames of the
+ * recording. Frames the recorder had to leave out show up as recorded <
+ * frames. */
+static int bench_record(sds_context *context, const char *name,
+			enum sds_record_format format)
+{
+	uint64_t latency[READ_FRAMES];
+	char directory[] = "/tmp/sds-bench-XXXXXX";
+	char path[sizeof(directory) + 16];
+	struct sds_recorded_frame recorded;
+	struct sds_frame *frame;
+	sds_recording *recording;
+	uint16_t *values = NULL;
+	uint16_t *grown;
+	size_t size = 0;
+	uint64_t count;
+	uint64_t bytes = 0;
+	uint64_t stored = 0;
+	uint64_t sum = 0;
+	uint64_t start;
+	uint64_t last;
+	uint64_t scan_start;
+	uint64_t now;
+	uint64_t i;
+	size_t k;
+	int ret = 1;
+
+	if (!mkdtemp(directory))
+		return 1;
+	snprintf(path, sizeof(path), "%s/frames", directory);
+	if (sds_start_recording(context, path, RECORD_SEGMENT_SIZE, format))
+		goto remove;
+	start = last = now_ns();
+	for (i = 0; i < READ_FRAMES; ++i) {
+		if (!(frame = next_frame(context))) {
+			sds_stop_recording(context);
+			goto remove;
+		}
+		sds_free_frame(frame);
+		now = now_ns();
+		latency[i] = now - last;
+		last = now;
+	}
+	sds_stop_recording(context);
+
+	if (sds_recording_open(path, &recording))
+		goto remove;
+	sds_recording_get_count(recording, &count);
+	scan_start = now_ns();
+	for (i = 0; i < count; ++i) {
+		if (sds_recording_get_frame(recording, i, &recorded))
+			goto close;
+		if (recorded.count > size) {
+			if (!(grown = realloc(values, recorded.count * sizeof(*values))))
+				goto close;
+			values = grown;
+			size = recorded.count;
+		}
+		if (sds_recorded_frame_decode(&recorded, values))
+			goto close;
+		for (k = 0; k < recorded.count; ++k)
+			sum += values[k];
+		bytes += recorded.count * sizeof(*values);
+		stored += recorded.encoded_size;
+	}
+	now = now_ns();
+
+	begin_section(name);
+	printf("\"frames\": %d, \"fps\": %.1f, ",
+	       READ_FRAMES, READ_FRAMES * 1e9 / (last - start));
+	print_stats("frame_ns", latency, READ_FRAMES);
+	/* Scan throughput in bytes of decoded samples */
+	printf(", \"recorded\": %llu, \"stored_mb\": %.1f, "
+	       "\"scan_mb_s\": %.1f, \"checksum\": %llu}",
+	       (unsigned long long) count, stored / 1e6,
+	       bytes * 1e3 / (now - scan_start), (unsigned long long) sum);
+	ret = 0;
+
+close:
+	sds_recording_close(recording);
+	free(values);
+remove:
+	/* Remove the segments */
+	for (i = 0;; ++i) {
+		snprintf(path, sizeof(path), "%s/frames.%04u", directory,
+			 (unsigned int) i);
+		if (unlink(path))
+			break;
+	}
+	rmdir(directory);
+	return ret;
+}
+
+/* Measures how long a setter takes and how long it takes until a frame was
+ * captured with the new configuration */
+static int bench_setter(sds_context *context)
+{
+	uint64_t call[SETTER_ITERATIONS];
+	uint64_t applied[SETTER_ITERATIONS];
+	struct sds_frame *frame;
+	uint64_t version;
+	uint64_t frame_version;
+	uint64_t start;
+	int i;
+
+	for (i = 0; i < SETTER_ITERATIONS; ++i) {
+		start = now_ns();
+		if (sds_set_trigger_slope(context,
+					  (i & 1) ? SDS_FALLING : SDS_RISING))
+			return 1;
+		call[i] = now_ns() - start;
+		sds_get_config_version(context, &version);
+		do {
+			if (!(frame = next_frame(context)))
+				return 1;
+			frame_version = frame->config_version;
+			sds_free_frame(frame);
+		} while (frame_version < version);
+		applied[i] = now_ns() - start;
+	}
+
+	begin_section("setter");
+	printf("\"iterations\": %d, ", SETTER_ITERATIONS);
+	print_stats("call_ns", call, SETTER_ITERATIONS);
+	printf(", ");
+	print_stats("applied_ns", applied, SETTER_ITERATIONS);
+	printf("}");
+	return 0;
+}
+
+static int bench_startup(struct sds_device_list *devices)
+{
+	uint64_t startup[STARTUP_ITERATIONS];
+	sds_context *context;
+	uint64_t start;
+	int i;
+
+	for (i = 0; i < STARTUP_ITERATIONS; ++i) {
+		start = now_ns();
+		if (open_simulated(devices, &context))
+			return 1;
+		startup[i] = now_ns() - start;
+		sds_destroy(context);
+	}
+
+	begin_section("startup");
+	printf("\"iterations\": %d, ", STARTUP_ITERATIONS);
+	print_stats("ns", startup, STARTUP_ITERATIONS);
+	printf("}");
+	return 0;
+}
+
+int main(void)
+{
+	/* Frames are produced as fast as possible, which leaves the library
+	 * as the bottleneck */
+	struct sds_simulation simulation = {
+		{ SDS_SINE, SDS_NOISE }, { 1e6, 0 }, { 0.05, 0.05 }, 0
+	};
+	struct sds_device_list *devices;
+	sds_context *context;
+	int err = 0;
+
+	if (sds_get_simulated_devices(&simulation, 1, &devices)) {
+		fprintf(stderr, "Could not create a simulated device\n");
+		return EXIT_FAILURE;
+	}
+	if (open_simulated(devices, &context)) {
+		sds_free_devices(devices);
+		return EXIT_FAILURE;
+	}
+
+	printf("{");
+	/* Stops at the first failure */
+	err = bench_decode(context);
+	err = err || bench_packed(context);
+	err = err || bench_compress(context);
+	err = err || bench_read(context);
+	err = err || bench_record(context, "record", SDS_RECORD_RAW);
+	err = err || bench_record(context, "record_packed", SDS_RECORD_PACKED);
+	err = err || bench_record(context, "record_compressed",
+				  SDS_RECORD_COMPRESSED);
+	err = err || bench_setter(context);
+	sds_destroy(context);
+	err = err || bench_startup(devices);
+	printf("}\n");
+
+	sds_free_devices(devices);
+	if (err) {
+		fprintf(stderr, "Benchmark failed\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,458 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+/* Records the transfers of a context into a pcap file in the USBPcap format
+ * (as written by USBPcap on Windows), so the traces can be read by the tools
+ * and replayed by the replay backend.
+ *
+ * Every transfer is recorded when it finished, as a submission packet and a
+ * completion packet (and a data stage packet for control transfers with
+ * data to the device). The packets are appended to one of two buffers. A
+ * background thread writes the other buffer to the file, so the transfers
+ * never wait for the disk. If both buffers are full, the packets are
+ * dropped instead. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "internal.h"
+#include "pcap_types.h"
+
+/* pcap_types.h leaves the packing of structures on */
+#pragma pack()
+
+/* Size of each of the two buffers */
+#define CAPTURE_BUFFER_SIZE (1 << 20)
+
+/* Time (in ms) after which buffered packets are written at the latest */
+#define CAPTURE_FLUSH_INTERVAL 200
+
+/* Header of a pcap file and of its records (in host byte order) */
+#define CAPTURE_MAGIC 0xa1b2c3d4
+#define CAPTURE_LINKTYPE_USBPCAP 249
+#define CAPTURE_SNAPLEN 0x40000
+#define CAPTURE_RECORD_HEADER_SIZE 16
+
+/* URB functions and status codes of USBPcap */
+#define CAPTURE_URB_CONTROL 0x0008
+#define CAPTURE_URB_BULK 0x0009
+#define CAPTURE_STATUS_STALL 0xc0000004
+#define CAPTURE_STATUS_ERROR 0xc0000011
+#define CAPTURE_STATUS_CANCELED 0xc0010000
+
+struct capture
+{
+	int fd;
+	pthread_t thread;
+	uint64_t clock_offset; /* realtime minus monotonic clock in ns */
+	uint64_t next_irp; /* the id of the next transfer */
+
+	pthread_mutex_t lock; /* protects the members below */
+	pthread_cond_t changed; /* signalled when a buffer is handed over */
+	unsigned char *buffers[2];
+	int active; /* index of the buffer packets are appended to */
+	size_t fill; /* bytes in the active buffer */
+	size_t pending; /* bytes in the other buffer (0 -> writer is idle) */
+	int stop; /* true -> the thread writes what is left and exits */
+};
+
+/* Writes a whole buffer to fd */
+static int write_all(int fd, const unsigned char *data, size_t length)
+{
+	ssize_t written;
+
+	while (length) {
+		written = write(fd, data, length);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += written;
+		length -= written;
+	}
+	return 0;
+}
+
+/* Hands the active buffer over to the writer. Requires the lock and an idle
+ * writer. */
+static void swap_buffers(struct capture *capture)
+{
+	capture->pending = capture->fill;
+	capture->active ^= 1;
+	capture->fill = 0;
+	pthread_cond_signal(&capture->changed);
+}
+
+static void *capture_thread(void *arg)
+{
+	sds_context *context = arg;
+	struct capture *capture = context->capture;
+	struct timespec deadline;
+	unsigned char *buffer;
+	size_t length;
+	int failed = 0;
+
+	pthread_mutex_lock(&capture->lock);
+	while (!capture->stop || capture->fill || capture->pending) {
+		if (!capture->pending) {
+			if (!capture->fill) {
+				pthread_cond_wait(&capture->changed,
+						  &capture->lock);
+				continue;
+			}
+			/* Write a partially filled buffer after a while */
+			if (!capture->stop) {
+				clock_gettime(CLOCK_MONOTONIC, &deadline);
+				deadline.tv_nsec += CAPTURE_FLUSH_INTERVAL * 1000000;
+				deadline.tv_sec += deadline.tv_nsec / 1000000000;
+				deadline.tv_nsec %= 1000000000;
+				if (pthread_cond_timedwait(&capture->changed,
+							   &capture->lock,
+							   &deadline) != ETIMEDOUT)
+					continue;
+			}
+			if (!capture->pending)
+				swap_buffers(capture);
+		}
+
+		/* The buffer belongs to this thread until pending is reset */
+		buffer = capture->buffers[capture->active ^ 1];
+		length = capture->pending;
+		pthread_mutex_unlock(&capture->lock);
+
+		if (!failed && write_all(capture->fd, buffer, length)) {
+			log_write(context, LOG_CAPTURE_FAILED, errno, 0);
+			failed = 1;
+		}
+
+		pthread_mutex_lock(&capture->lock);
+		capture->pending = 0;
+	}
+	pthread_mutex_unlock(&capture->lock);
+	return NULL;
+}
+
+/* Writes a record header and a USBPcap packet header. Returns the position
+ * behind them. */
+static unsigned char *put_header(unsigned char *out, uint64_t time,
+				 const USBPCAP_BUFFER_PACKET_HEADER *packet,
+				 int stage)
+{
+	uint32_t record[4];
+	size_t header_size = packet->headerLen;
+	uint32_t length = header_size + packet->dataLength;
+	USBPCAP_BUFFER_CONTROL_HEADER control;
+
+	record[0] = time / 1000000000;
+	record[1] = time % 1000000000 / 1000;
+	record[2] = length;
+	record[3] = length;
+	memcpy(out, record, sizeof(record));
+	out += sizeof(record);
+
+	if (stage >= 0) {
+		control.header = *packet;
+		control.stage = stage;
+		memcpy(out, &control, sizeof(control));
+	} else {
+		memcpy(out, packet, sizeof(*packet));
+	}
+	return out + header_size;
+}
+
+/* Returns the size of a packet in the file */
+static size_t packet_size(int control, uint32_t data_length)
+{
+	return CAPTURE_RECORD_HEADER_SIZE + data_length
+	       + (control ? sizeof(USBPCAP_BUFFER_CONTROL_HEADER)
+			  : sizeof(USBPCAP_BUFFER_PACKET_HEADER));
+}
+
+/* Converts a result (transferred bytes or a negative sds_error) to a
+ * USBD status */
+static uint32_t usbd_status(int result)
+{
+	switch (result) {
+		case SDS_ERROR_PIPE:
+			return CAPTURE_STATUS_STALL;
+		case SDS_ERROR_TIMEOUT:
+			return CAPTURE_STATUS_CANCELED;
+		default:
+			return result < 0 ? CAPTURE_STATUS_ERROR : 0;
+	}
+}
+
+/* Reserves space for a transaction in the active buffer and returns it or
+ * NULL if there is no space. Requires the lock. */
+static unsigned char *reserve(sds_context *context, struct capture *capture,
+			      size_t size)
+{
+	unsigned char *out;
+
+	if (capture->fill + size > CAPTURE_BUFFER_SIZE) {
+		if (capture->pending || size > CAPTURE_BUFFER_SIZE) {
+			/* The disk does not keep up */
+			log_write(context, LOG_CAPTURE_OVERFLOW, size, 0);
+			return NULL;
+		}
+		swap_buffers(capture);
+	}
+	out = capture->buffers[capture->active] + capture->fill;
+	capture->fill += size;
+	return out;
+}
+
+/* Initializes the packet header shared by all packets of a transfer */
+static void init_packet(sds_context *context, struct capture *capture,
+			USBPCAP_BUFFER_PACKET_HEADER *packet, int control,
+			uint8_t endpoint)
+{
+	memset(packet, 0, sizeof(*packet));
+	packet->headerLen = control ? sizeof(USBPCAP_BUFFER_CONTROL_HEADER)
+				    : sizeof(USBPCAP_BUFFER_PACKET_HEADER);
+	packet->irpId = capture->next_irp++;
+	packet->function = control ? CAPTURE_URB_CONTROL : CAPTURE_URB_BULK;
+	packet->bus = context->bus_no;
+	/* The address is not known for all backends */
+	packet->device = context->port_no;
+	packet->endpoint = endpoint;
+	packet->transfer = control ? USBPCAP_TRANSFER_CONTROL
+				   : USBPCAP_TRANSFER_BULK;
+}
+
+void capture_control(sds_context *context, uint64_t submitted,
+		     uint64_t completed, uint8_t bmRequestType,
+		     uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+		     const unsigned char *data, uint16_t wLength, int result)
+{
+	struct capture *capture;
+	USBPCAP_BUFFER_PACKET_HEADER packet;
+	USB_SETUP setup;
+	int in = bmRequestType & LIBUSB_ENDPOINT_IN;
+	uint32_t out_length = in ? 0 : wLength;
+	uint32_t in_length = (in && result > 0) ? result : 0;
+	unsigned char *out;
+
+	pthread_rwlock_rdlock(&context->capture_lock);
+	if (!(capture = context->capture))
+		goto unlock;
+	submitted += capture->clock_offset;
+	completed += capture->clock_offset;
+
+	setup.bmRequestType = bmRequestType;
+	setup.bRequest = bRequest;
+	setup.wValue = wValue;
+	setup.wIndex = wIndex;
+	setup.wLength = wLength;
+
+	pthread_mutex_lock(&capture->lock);
+	if (!(out = reserve(context, capture,
+			    packet_size(1, sizeof(setup))
+			    + (out_length ? packet_size(1, out_length) : 0)
+			    + packet_size(1, in_length))))
+		goto unlock_capture;
+	init_packet(context, capture, &packet, 1, in ? LIBUSB_ENDPOINT_IN : 0);
+
+	/* Submission: setup stage and data to the device */
+	packet.dataLength = sizeof(setup);
+	out = put_header(out, submitted, &packet,
+			 USBPCAP_CONTROL_STAGE_SETUP);
+	memcpy(out, &setup, sizeof(setup));
+	out += sizeof(setup);
+	if (out_length) {
+		packet.dataLength = out_length;
+		out = put_header(out, submitted, &packet,
+				 USBPCAP_CONTROL_STAGE_DATA);
+		memcpy(out, data, out_length);
+		out += out_length;
+	}
+
+	/* Completion: data from the device or the status */
+	packet.info = USBPCAP_INFO_PDO_TO_FDO;
+	packet.status = usbd_status(result);
+	packet.dataLength = in_length;
+	out = put_header(out, completed, &packet,
+			 in ? USBPCAP_CONTROL_STAGE_DATA
+			    : USBPCAP_CONTROL_STAGE_STATUS);
+	memcpy(out, data, in_length);
+
+unlock_capture:
+	pthread_mutex_unlock(&capture->lock);
+unlock:
+	pthread_rwlock_unlock(&context->capture_lock);
+}
+
+void capture_bulk(sds_context *context, uint64_t submitted,
+		  uint64_t completed, uint8_t endpoint,
+		  const unsigned char *data, int result)
+{
+	struct capture *capture;
+	USBPCAP_BUFFER_PACKET_HEADER packet;
+	uint32_t length = result > 0 ? result : 0;
+	unsigned char *out;
+
+	pthread_rwlock_rdlock(&context->capture_lock);
+	if (!(capture = context->capture))
+		goto unlock;
+	submitted += capture->clock_offset;
+	completed += capture->clock_offset;
+
+	pthread_mutex_lock(&capture->lock);
+	if (!(out = reserve(context, capture,
+			    packet_size(0, 0) + packet_size(0, length))))
+		goto unlock_capture;
+	init_packet(context, capture, &packet, 0, endpoint);
+
+	out = put_header(out, submitted, &packet, -1);
+
+	packet.info = USBPCAP_INFO_PDO_TO_FDO;
+	packet.status = usbd_status(result);
+	packet.dataLength = length;
+	out = put_header(out, completed, &packet, -1);
+	memcpy(out, data, length);
+
+unlock_capture:
+	pthread_mutex_unlock(&capture->lock);
+unlock:
+	pthread_rwlock_unlock(&context->capture_lock);
+}
+
+/* Writes the remaining packets, stops the thread and frees the capture.
+ * Requires the write lock. */
+static sds_error capture_free(sds_context *context)
+{
+	struct capture *capture = context->capture;
+	sds_error err = SDS_ERROR_SUCCESS;
+
+	atomic_store(&context->capturing, 0);
+	pthread_mutex_lock(&capture->lock);
+	capture->stop = 1;
+	pthread_cond_signal(&capture->changed);
+	pthread_mutex_unlock(&capture->lock);
+	pthread_join(capture->thread, NULL);
+
+	if (close(capture->fd))
+		err = SDS_ERROR_IO;
+	pthread_cond_destroy(&capture->changed);
+	pthread_mutex_destroy(&capture->lock);
+	free(capture->buffers[0]);
+	free(capture->buffers[1]);
+	free(capture);
+	context->capture = NULL;
+	return err;
+}
+
+sds_error sds_start_capture(sds_context *context, const char *path)
+{
+	struct capture *capture;
+	pthread_condattr_t attr;
+	struct timespec realtime;
+	uint32_t header[6];
+	sds_error err = SDS_ERROR_SUCCESS;
+
+	if (!context || !path)
+		return SDS_ERROR_INVALID_PARAM;
+
+	/* Transfers wait until the capture is set up */
+	pthread_rwlock_wrlock(&context->capture_lock);
+	if (context->capture) {
+		err = SDS_ERROR_BUSY;
+		goto unlock;
+	}
+	capture = calloc(1, sizeof(*capture));
+	if (!capture) {
+		err = SDS_ERROR_NO_MEM;
+		goto unlock;
+	}
+	capture->buffers[0] = malloc(CAPTURE_BUFFER_SIZE);
+	capture->buffers[1] = malloc(CAPTURE_BUFFER_SIZE);
+	if (!capture->buffers[0] || !capture->buffers[1]) {
+		err = SDS_ERROR_NO_MEM;
+		goto capture_remove;
+	}
+	capture->next_irp = 1;
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	capture->clock_offset = (uint64_t) realtime.tv_sec * 1000000000
+				+ realtime.tv_nsec - get_time_ns();
+
+	capture->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (capture->fd < 0) {
+		err = (errno == EACCES) ? SDS_ERROR_ACCESS : SDS_ERROR_IO;
+		goto capture_remove;
+	}
+	header[0] = CAPTURE_MAGIC;
+	header[1] = 2 | 4 << 16; /* version 2.4 */
+	header[2] = 0; /* timezone */
+	header[3] = 0; /* accuracy of the timestamps */
+	header[4] = CAPTURE_SNAPLEN;
+	header[5] = CAPTURE_LINKTYPE_USBPCAP;
+	if (write_all(capture->fd, (unsigned char *) header, sizeof(header))) {
+		err = SDS_ERROR_IO;
+		goto file_remove;
+	}
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&capture->changed, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&capture->lock, NULL);
+
+	context->capture = capture;
+	if (pthread_create(&capture->thread, NULL, capture_thread, context)) {
+		err = SDS_ERROR_NO_MEM;
+		goto sync_remove;
+	}
+	atomic_store(&context->capturing, 1);
+	pthread_rwlock_unlock(&context->capture_lock);
+	return err;
+
+sync_remove:
+	context->capture = NULL;
+	pthread_cond_destroy(&capture->changed);
+	pthread_mutex_destroy(&capture->lock);
+
+file_remove:
+	close(capture->fd);
+	unlink(path);
+
+capture_remove:
+	free(capture->buffers[0]);
+	free(capture->buffers[1]);
+	free(capture);
+
+unlock:
+	pthread_rwlock_unlock(&context->capture_lock);
+	return err;
+}
+
+sds_error sds_stop_capture(sds_context *context)
+{
+	sds_error err = SDS_ERROR_SUCCESS;
+
+	if (!context)
+		return SDS_ERROR_INVALID_PARAM;
+	pthread_rwlock_wrlock(&context->capture_lock);
+	if (context->capture)
+		err = capture_free(context);
+	pthread_rwlock_unlock(&context->capture_lock);
+	return err;
+}
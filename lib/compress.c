@@ -0,0 +1,339 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+/* The lossless codec of the decoded samples. Every sample is replaced by
+ * its difference to the previous sample of the same channel (two samples
+ * before, as the channels are interleaved), starting from the middle of the
+ * range. The differences are zigzag coded (0, -1, 1, -2, ... become 0, 1,
+ * 2, 3, ...) and bit-packed in blocks of COMPRESS_BLOCK samples. A block
+ * consists of one byte with the width w of its largest value followed by w
+ * words of eight 16 bit lanes (little endian), 16 * w bytes in total.
+ *
+ * The values are packed vertically: value i of a block goes to lane i % 8.
+ * The values of a lane are concatenated from the lowest bit on and word k
+ * holds the bits 16 * k ... 16 * k + 15 of the lane. That way all eight
+ * lanes are packed and unpacked with the same shifts at once. Missing
+ * samples are coded like a value of SDS_SAMPLE_MISSING, which limits w
+ * to 12.
+ *
+ * A compressed frame starts with its amount of samples and its size (32
+ * bits each, little endian), so frames can be streamed without further
+ * framing. The last block is filled up with differences of 0. */
+
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "internal.h"
+
+#define COMPRESS_BLOCK 128
+#define COMPRESS_LANES 8
+#define COMPRESS_MAX_WIDTH 12
+
+/* The value the differences of the first samples refer to */
+#define COMPRESS_START 512
+
+static void write32(uint8_t *out, uint32_t value)
+{
+	int i;
+
+	for (i = 0; i < 4; ++i)
+		out[i] = value >> (8 * i);
+}
+
+static uint32_t read32(const uint8_t *in)
+{
+	return in[0] | in[1] << 8 | in[2] << 16 | (uint32_t) in[3] << 24;
+}
+
+/* Returns the bits needed for all values of a block */
+static unsigned int block_width(const uint16_t *values)
+{
+	unsigned int all = 0;
+	size_t i = 0;
+
+#ifdef __SSE2__
+	{
+		__m128i bits = _mm_setzero_si128();
+		uint16_t lanes[COMPRESS_LANES];
+
+		for (; i < COMPRESS_BLOCK; i += COMPRESS_LANES)
+			bits = _mm_or_si128(bits, _mm_loadu_si128(
+				(const __m128i *) &values[i]));
+		_mm_storeu_si128((__m128i *) lanes, bits);
+		for (i = 0; i < COMPRESS_LANES; ++i)
+			all |= lanes[i];
+	}
+#else
+	for (; i < COMPRESS_BLOCK; ++i)
+		all |= values[i];
+#endif
+	return all ? 32 - __builtin_clz(all) : 0;
+}
+
+/* Stores the zigzag coded differences of a block (values[-2] and
+ * values[-1] are the samples before it) */
+static void block_encode(const uint16_t *values, uint16_t *zigzag)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	for (; i < COMPRESS_BLOCK; i += COMPRESS_LANES) {
+		__m128i delta = _mm_sub_epi16(
+			_mm_loadu_si128((const __m128i *) &values[i]),
+			_mm_loadu_si128((const __m128i *) &values[i - 2]));
+		_mm_storeu_si128((__m128i *) &zigzag[i], _mm_xor_si128(
+			_mm_slli_epi16(delta, 1), _mm_srai_epi16(delta, 15)));
+	}
+#endif
+	for (; i < COMPRESS_BLOCK; ++i) {
+		uint16_t delta = values[i] - values[i - 2];
+		zigzag[i] = delta << 1 ^ -(delta >> 15);
+	}
+}
+
+/* Restores the values of a block from the zigzag coded differences
+ * (values[-2] and values[-1] are the samples before it) */
+static void block_decode(const uint16_t *zigzag, uint16_t *values)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	{
+		const __m128i one = _mm_set1_epi16(1);
+		/* The last sample of both channels in every pair of lanes */
+		__m128i last = _mm_set1_epi32(values[-2] | (uint32_t) values[-1] << 16);
+
+		for (; i < COMPRESS_BLOCK; i += COMPRESS_LANES) {
+			__m128i code = _mm_loadu_si128((const __m128i *) &zigzag[i]);
+			__m128i delta = _mm_xor_si128(_mm_srli_epi16(code, 1),
+				_mm_sub_epi16(_mm_setzero_si128(),
+					      _mm_and_si128(code, one)));
+
+			/* Prefix sums of both channels */
+			delta = _mm_add_epi16(delta, _mm_slli_si128(delta, 4));
+			delta = _mm_add_epi16(delta, _mm_slli_si128(delta, 8));
+			delta = _mm_add_epi16(delta, last);
+			_mm_storeu_si128((__m128i *) &values[i], delta);
+			last = _mm_shuffle_epi32(delta, 0xff);
+		}
+	}
+#endif
+	for (; i < COMPRESS_BLOCK; ++i)
+		values[i] = values[i - 2] + ((zigzag[i] >> 1) ^ -(zigzag[i] & 1));
+}
+
+/* Packs the values of a block with width bits each into width * 16
+ * bytes */
+static void block_pack(const uint16_t *values, unsigned int width, uint8_t *out)
+{
+	unsigned int bits = 0;
+	size_t k;
+
+#ifdef __SSE2__
+	{
+		__m128i word = _mm_setzero_si128();
+
+		for (k = 0; k < COMPRESS_BLOCK; k += COMPRESS_LANES) {
+			__m128i value = _mm_loadu_si128((const __m128i *) &values[k]);
+
+			word = _mm_or_si128(word, _mm_sll_epi16(value,
+						_mm_cvtsi32_si128(bits)));
+			bits += width;
+			if (bits >= 16) {
+				_mm_storeu_si128((__m128i *) out, word);
+				out += sizeof(word);
+				bits -= 16;
+				/* The bits that did not fit */
+				word = bits ? _mm_srl_epi16(value,
+					      _mm_cvtsi32_si128(width - bits))
+					    : _mm_setzero_si128();
+			}
+		}
+	}
+#else
+	{
+		uint16_t word[COMPRESS_LANES] = { 0 };
+		size_t lane;
+
+		for (k = 0; k < COMPRESS_BLOCK; k += COMPRESS_LANES) {
+			for (lane = 0; lane < COMPRESS_LANES; ++lane)
+				word[lane] |= values[k + lane] << bits;
+			bits += width;
+			if (bits < 16)
+				continue;
+			bits -= 16;
+			for (lane = 0; lane < COMPRESS_LANES; ++lane) {
+				*out++ = word[lane];
+				*out++ = word[lane] >> 8;
+				word[lane] = bits ? values[k + lane] >> (width - bits) : 0;
+			}
+		}
+	}
+#endif
+}
+
+/* Unpacks the values of a block with width (> 0) bits each */
+static void block_unpack(const uint8_t *in, unsigned int width, uint16_t *values)
+{
+	unsigned int bits = 0;
+	size_t k;
+
+#ifdef __SSE2__
+	{
+		const __m128i mask = _mm_set1_epi16((1 << width) - 1);
+		__m128i word = _mm_loadu_si128((const __m128i *) in);
+		__m128i value;
+
+		for (k = 0; k < COMPRESS_BLOCK; k += COMPRESS_LANES) {
+			value = _mm_srl_epi16(word, _mm_cvtsi32_si128(bits));
+			bits += width;
+			if (bits >= 16) {
+				bits -= 16;
+				in += sizeof(word);
+				/* The last word ends with the last value */
+				if (k + COMPRESS_LANES < COMPRESS_BLOCK)
+					word = _mm_loadu_si128((const __m128i *) in);
+				if (bits)
+					value = _mm_or_si128(value, _mm_sll_epi16(word,
+						_mm_cvtsi32_si128(width - bits)));
+			}
+			_mm_storeu_si128((__m128i *) &values[k],
+					 _mm_and_si128(value, mask));
+		}
+	}
+#else
+	{
+		const uint16_t mask = (1 << width) - 1;
+		uint16_t word[COMPRESS_LANES];
+		uint16_t value[COMPRESS_LANES];
+		size_t lane;
+
+		for (lane = 0; lane < COMPRESS_LANES; ++lane)
+			word[lane] = in[2 * lane] | in[2 * lane + 1] << 8;
+		for (k = 0; k < COMPRESS_BLOCK; k += COMPRESS_LANES) {
+			for (lane = 0; lane < COMPRESS_LANES; ++lane)
+				value[lane] = word[lane] >> bits;
+			bits += width;
+			if (bits >= 16) {
+				bits -= 16;
+				in += 2 * COMPRESS_LANES;
+				for (lane = 0; lane < COMPRESS_LANES; ++lane) {
+					if (k + COMPRESS_LANES < COMPRESS_BLOCK)
+						word[lane] = in[2 * lane] | in[2 * lane + 1] << 8;
+					if (bits)
+						value[lane] |= word[lane] << (width - bits);
+				}
+			}
+			for (lane = 0; lane < COMPRESS_LANES; ++lane)
+				values[k + lane] = value[lane] & mask;
+		}
+	}
+#endif
+}
+
+sds_error sds_compress_samples(const struct sds_samples *data, size_t count, uint8_t *compressed, size_t *length)
+{
+	/* The two samples before the block and the block */
+	uint16_t values[2 + COMPRESS_BLOCK];
+	uint16_t zigzag[COMPRESS_BLOCK];
+	uint8_t *out;
+	unsigned int width;
+	size_t block;
+	size_t i;
+
+	if (data == NULL || compressed == NULL || length == NULL ||
+	    count > UINT32_MAX || SDS_COMPRESSED_MAX_SIZE(count) > UINT32_MAX) {
+		return SDS_ERROR_INVALID_PARAM;
+	}
+	out = compressed + SDS_COMPRESSED_HEADER_SIZE;
+	values[0] = values[1] = COMPRESS_START;
+
+	for (block = 0; block < count; block += COMPRESS_BLOCK) {
+		i = count - block < COMPRESS_BLOCK ? count - block : COMPRESS_BLOCK;
+		/* Samples block ... of data, the padding stays in front */
+		decode_samples((const struct sds_samples *) ((const uint8_t *) data
+				+ block * sizeof(data->samples[0])), i, values + 2);
+		/* The last block is filled up without changes */
+		for (; i < COMPRESS_BLOCK; ++i)
+			values[2 + i] = values[i];
+
+		block_encode(values + 2, zigzag);
+		width = block_width(zigzag);
+		*out++ = width;
+		if (width)
+			block_pack(zigzag, width, out);
+		out += width * 2 * COMPRESS_LANES;
+		values[0] = values[COMPRESS_BLOCK];
+		values[1] = values[COMPRESS_BLOCK + 1];
+	}
+
+	*length = out - compressed;
+	write32(compressed, count);
+	write32(compressed + 4, *length);
+	return SDS_ERROR_SUCCESS;
+}
+
+sds_error sds_compressed_info(const uint8_t *compressed, size_t available, size_t *count, size_t *length)
+{
+	if (compressed == NULL || count == NULL || length == NULL ||
+	    available < SDS_COMPRESSED_HEADER_SIZE) {
+		return SDS_ERROR_INVALID_PARAM;
+	}
+	*count = read32(compressed);
+	*length = read32(compressed + 4);
+	return SDS_ERROR_SUCCESS;
+}
+
+sds_error sds_decompress_samples(const uint8_t *compressed, size_t length, size_t count, uint16_t *advalues)
+{
+	uint16_t values[2 + COMPRESS_BLOCK];
+	uint16_t zigzag[COMPRESS_BLOCK];
+	const uint8_t *in;
+	const uint8_t *end = compressed + length;
+	unsigned int width;
+	size_t block;
+	size_t n;
+
+	if (compressed == NULL || advalues == NULL ||
+	    length < SDS_COMPRESSED_HEADER_SIZE ||
+	    read32(compressed) != count || read32(compressed + 4) != length) {
+		return SDS_ERROR_INVALID_PARAM;
+	}
+	in = compressed + SDS_COMPRESSED_HEADER_SIZE;
+	values[0] = values[1] = COMPRESS_START;
+
+	for (block = 0; block < count; block += COMPRESS_BLOCK) {
+		if (in == end || (width = *in++) > COMPRESS_MAX_WIDTH ||
+		    (size_t) (end - in) < width * 2 * COMPRESS_LANES)
+			return SDS_ERROR_INVALID_PARAM;
+		if (width)
+			block_unpack(in, width, zigzag);
+		else
+			memset(zigzag, 0, sizeof(zigzag));
+		in += width * 2 * COMPRESS_LANES;
+
+		block_decode(zigzag, values + 2);
+		n = count - block < COMPRESS_BLOCK ? count - block : COMPRESS_BLOCK;
+		memcpy(advalues + block, values + 2, n * sizeof(*advalues));
+		values[0] = values[COMPRESS_BLOCK];
+		values[1] = values[COMPRESS_BLOCK + 1];
+	}
+	return in == end ? SDS_ERROR_SUCCESS : SDS_ERROR_INVALID_PARAM;
+}
@@ -0,0 +1,113 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+/* The configuration of a context is published as immutable snapshots. A
+ * setter copies the current snapshot, changes the copy while holding the
+ * config_lock and publishes it with one atomic store. Readers (above all the
+ * acquisition path) only announce themselves in the readers counter and load
+ * the pointer, so they never wait for a setter.
+ *
+ * A replaced snapshot is put on the retired list. Since readers increment
+ * the counter before they load the pointer, a counter of zero observed after
+ * the store proves that nobody holds a retired snapshot any more. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+sds_error config_init(sds_context *context)
+{
+	struct config *config = calloc(1, sizeof(*config));
+	if (!config)
+		return SDS_ERROR_NO_MEM;
+	config->version = 1;
+	atomic_init(&context->config, config);
+	atomic_init(&context->readers, 0);
+	context->retired = NULL;
+	pthread_mutex_init(&context->config_lock, NULL);
+	return SDS_ERROR_SUCCESS;
+}
+
+/* Frees the retired snapshots. Requires the config_lock. */
+static void free_retired(sds_context *context)
+{
+	struct config *next;
+	for (; context->retired; context->retired = next) {
+		next = context->retired->retired_next;
+		free(context->retired);
+	}
+}
+
+void config_destroy(sds_context *context)
+{
+	free_retired(context);
+	free(atomic_load(&context->config));
+	pthread_mutex_destroy(&context->config_lock);
+}
+
+const struct config *config_read(sds_context *context)
+{
+	atomic_fetch_add(&context->readers, 1);
+	return atomic_load(&context->config);
+}
+
+void config_release(sds_context *context)
+{
+	atomic_fetch_sub(&context->readers, 1);
+}
+
+struct config *config_edit(sds_context *context)
+{
+	struct config *config = malloc(sizeof(*config));
+	if (!config)
+		return NULL;
+	pthread_mutex_lock(&context->config_lock);
+	/* Writers are serialized, so the current snapshot stays valid */
+	memcpy(config, atomic_load(&context->config), sizeof(*config));
+	return config;
+}
+
+void config_commit(sds_context *context, struct config *config)
+{
+	struct config *old = atomic_load(&context->config);
+
+	config->version = old->version + 1;
+	atomic_store(&context->config, config);
+
+	old->retired_next = context->retired;
+	context->retired = old;
+	if (!atomic_load(&context->readers))
+		free_retired(context);
+	pthread_mutex_unlock(&context->config_lock);
+}
+
+void config_abort(sds_context *context, struct config *config)
+{
+	pthread_mutex_unlock(&context->config_lock);
+	free(config);
+}
+
+sds_error sds_get_config_version(sds_context *context, uint64_t *version)
+{
+	if (!context || !version)
+		return SDS_ERROR_INVALID_PARAM;
+	*version = config_read(context)->version;
+	config_release(context);
+	return SDS_ERROR_SUCCESS;
+}
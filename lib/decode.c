@@ -0,0 +1,61 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+/* The decoder of the samples of a frame. It is kept apart, so the benchmark
+ * can build it a second time without SSE2 as the scalar baseline (see the
+ * Makefile). */
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "internal.h"
+
+void decode_samples(const struct sds_samples *data, size_t count, uint16_t *advalues)
+{
+	/* The samples are aligned within the packed struct */
+	const uint16_t *samples = (const uint16_t *) ((const uint8_t *) data
+						      + sizeof(data->unknown_padding));
+	size_t i = 0;
+
+	/* TODO: big endian */
+#ifdef __SSE2__
+	{
+		const __m128i low = _mm_set1_epi16(0x3f);
+		const __m128i high = _mm_set1_epi16(0x3c0);
+		const __m128i flags = _mm_set1_epi16((short) 0xb000);
+		const __m128i valid = _mm_set1_epi16((short) 0x8000);
+		const __m128i missing = _mm_set1_epi16(SDS_SAMPLE_MISSING);
+
+		/* Same as decode_sample, eight samples at once */
+		for (; i + 8 <= count; i += 8) {
+			__m128i sample = _mm_loadu_si128((const __m128i *) &samples[i]);
+			__m128i value = _mm_or_si128(
+				_mm_and_si128(sample, low),
+				_mm_and_si128(_mm_srli_epi16(sample, 2), high));
+			__m128i ok = _mm_cmpeq_epi16(_mm_and_si128(sample, flags),
+						     valid);
+			value = _mm_or_si128(_mm_and_si128(ok, value),
+					     _mm_andnot_si128(ok, missing));
+			_mm_storeu_si128((__m128i *) &advalues[i], value);
+		}
+	}
+#endif
+	for (; i < count; ++i)
+		advalues[i] = decode_sample(samples[i]);
+}
@@ -0,0 +1,166 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+/* Asynchronous transfers of the backends that answer requests in software
+ * (sim.c, replay.c). Submitted transfers wait in a list until they are due
+ * and are completed by the thread that handles the events, just like libusb
+ * does it. */
+
+#include <stdlib.h>
+
+#include "internal.h"
+
+/* An asynchronous transfer that waits for its completion */
+struct emulated_transfer
+{
+	struct libusb_transfer *transfer;
+	sds_context *context;
+	uint64_t due; /* when the transfer completes */
+	int cancelled;
+	struct emulated_transfer *next;
+};
+
+void emulated_init(struct emulated_backend *backend,
+		   const struct backend_ops *ops,
+		   emulated_complete complete)
+{
+	pthread_condattr_t attr;
+
+	backend->backend.ops = ops;
+	backend->complete = complete;
+	backend->pending = NULL;
+	pthread_mutex_init(&backend->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&backend->changed, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+void emulated_release(struct emulated_backend *backend)
+{
+	struct emulated_transfer *next;
+
+	for (; backend->pending; backend->pending = next) {
+		next = backend->pending->next;
+		free(backend->pending);
+	}
+	pthread_cond_destroy(&backend->changed);
+	pthread_mutex_destroy(&backend->lock);
+}
+
+int emulated_submit(sds_context *context, struct libusb_transfer *transfer,
+		    uint64_t due)
+{
+	struct emulated_backend *backend =
+		(struct emulated_backend *) context->backend;
+	struct emulated_transfer *pending = malloc(sizeof(*pending));
+	struct emulated_transfer **tail;
+
+	if (!pending)
+		return LIBUSB_ERROR_NO_MEM;
+	pending->transfer = transfer;
+	pending->context = context;
+	pending->due = due;
+	pending->cancelled = 0;
+	pending->next = NULL;
+
+	pthread_mutex_lock(&backend->lock);
+	for (tail = &backend->pending; *tail; tail = &(*tail)->next)
+		;
+	*tail = pending;
+	pthread_cond_signal(&backend->changed);
+	pthread_mutex_unlock(&backend->lock);
+	return LIBUSB_SUCCESS;
+}
+
+int emulated_cancel(sds_context *context, struct libusb_transfer *transfer)
+{
+	struct emulated_backend *backend =
+		(struct emulated_backend *) context->backend;
+	struct emulated_transfer *pending;
+	int err = LIBUSB_ERROR_NOT_FOUND;
+
+	pthread_mutex_lock(&backend->lock);
+	for (pending = backend->pending; pending; pending = pending->next) {
+		if (pending->transfer == transfer && !pending->cancelled) {
+			pending->cancelled = 1;
+			pending->due = 0;
+			err = LIBUSB_SUCCESS;
+		}
+	}
+	pthread_cond_signal(&backend->changed);
+	pthread_mutex_unlock(&backend->lock);
+	return err;
+}
+
+int emulated_handle_events(struct backend *backend, struct timeval *timeout)
+{
+	struct emulated_backend *emulated = (struct emulated_backend *) backend;
+	struct emulated_transfer *due = NULL;
+	struct emulated_transfer **due_tail = &due;
+	struct emulated_transfer **entry;
+	struct emulated_transfer *next;
+	struct libusb_transfer *transfer;
+	struct timespec wake;
+	uint64_t deadline;
+	uint64_t earliest;
+	uint64_t now = get_time_ns();
+
+	deadline = now + (uint64_t) timeout->tv_sec * 1000000000
+		   + (uint64_t) timeout->tv_usec * 1000;
+
+	pthread_mutex_lock(&emulated->lock);
+	for (;;) {
+		/* Collect the due transfers in the order of submission */
+		earliest = deadline;
+		for (entry = &emulated->pending; *entry;) {
+			if ((*entry)->due <= now) {
+				*due_tail = *entry;
+				due_tail = &(*entry)->next;
+				*entry = (*entry)->next;
+				*due_tail = NULL;
+			} else {
+				if ((*entry)->due < earliest)
+					earliest = (*entry)->due;
+				entry = &(*entry)->next;
+			}
+		}
+		if (due || now >= deadline)
+			break;
+		wake.tv_sec = earliest / 1000000000;
+		wake.tv_nsec = earliest % 1000000000;
+		pthread_cond_timedwait(&emulated->changed, &emulated->lock,
+				       &wake);
+		now = get_time_ns();
+	}
+	pthread_mutex_unlock(&emulated->lock);
+
+	/* The callbacks submit the next transfers */
+	for (; due; due = next) {
+		next = due->next;
+		transfer = due->transfer;
+		transfer->actual_length = 0;
+		if (due->cancelled)
+			transfer->status = LIBUSB_TRANSFER_CANCELLED;
+		else
+			emulated->complete(due->context, transfer);
+		free(due);
+		transfer->callback(transfer);
+	}
+	return LIBUSB_SUCCESS;
+}
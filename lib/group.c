@@ -0,0 +1,875 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "internal.h"
+#include "trace.h"
+
+/* How many frames a queue holds before the oldest one is dropped */
+#define GROUP_QUEUE_DEPTH 16
+
+/* Weight of a new measurement in the latency estimation of synchronized
+ * groups (1/n). The first sets after the start are weighted more, so the
+ * estimate starts from the first set. */
+#define GROUP_OFFSET_WEIGHT 8
+
+/* Time (in ms) one iteration of the event loop waits at most. This bounds the
+ * time sds_group_stop() needs to notice that all transfers are cancelled. */
+#define GROUP_EVENT_TIMEOUT 100
+
+/* A ring of frames that were not yet obtained by the user */
+struct frame_queue
+{
+	struct sds_frame *frames[GROUP_QUEUE_DEPTH];
+	unsigned int head; /* index of the oldest frame */
+	unsigned int count;
+	unsigned int stalls; /* stalls of the devices that fill the queue */
+	pthread_cond_t available; /* signalled when a frame is added */
+};
+
+/* The acquisition state of one device of a group. Every device has exactly
+ * one transfer in flight: either the 0xc0 poll or the bulk read following a
+ * successful poll. */
+struct group_member
+{
+	sds_group *group;
+	unsigned int index;
+	sds_context *context;
+	struct libusb_transfer *poll;
+	unsigned char poll_buffer[LIBUSB_CONTROL_SETUP_SIZE + 1];
+	struct libusb_transfer *bulk;
+	unsigned int bulk_size; /* size of the buffer of the bulk transfer */
+	struct frame_settings settings; /* configuration the bulk transfer was set up for */
+	uint64_t submitted; /* submission time of the transfer in flight */
+	int busy; /* true -> a transfer of this member is submitted */
+	int failed; /* true -> device is not available any more */
+};
+
+struct sds_group
+{
+	struct backend *backend; /* shared by all devices of the group */
+	int flags;
+	unsigned int count;
+	struct group_member *members;
+	struct frame_queue *queues; /* one queue per device or one merged queue */
+	unsigned int queue_count;
+
+	pthread_mutex_t lock; /* protects the queues and the members below */
+	pthread_t thread;
+	int running; /* true -> the event thread was started */
+	int stopping; /* true -> no transfers are submitted any more */
+
+	/* Alignment of synchronized groups. The latency offsets are part of
+	 * the report. */
+	struct sds_skew_report skew;
+	double skew_sum; /* sum of the skews of all delivered sets */
+	double raw_skew_sum; /* sum of the uncorrected skews */
+	unsigned int estimates; /* sets the offsets learned from since the start */
+};
+
+static struct frame_queue *member_queue(struct group_member *member)
+{
+	sds_group *group = member->group;
+	if (group->flags & SDS_GROUP_MERGED)
+		return &group->queues[0];
+	return &group->queues[member->index];
+}
+
+/* Adds a frame to the queue of the member. Requires the group lock. */
+static void queue_push(struct group_member *member, struct sds_frame *frame)
+{
+	struct frame_queue *queue = member_queue(member);
+	if (queue->count == GROUP_QUEUE_DEPTH) {
+		/* Nobody is interested in old data, throw it away */
+		sds_free_frame(queue->frames[queue->head]);
+		stats_add(&member->context->stats.dropped_frames, 1);
+		log_write(member->context, LOG_FRAME_DROPPED, member->index, 0);
+		queue->head = (queue->head + 1) % GROUP_QUEUE_DEPTH;
+		queue->count--;
+	}
+	queue->frames[(queue->head + queue->count) % GROUP_QUEUE_DEPTH] = frame;
+	queue->count++;
+	pthread_cond_signal(&queue->available);
+}
+
+/* Removes all frames from a queue. Requires the group lock. */
+static void queue_clear(struct frame_queue *queue)
+{
+	for (; queue->count; queue->count--) {
+		sds_free_frame(queue->frames[queue->head]);
+		queue->head = (queue->head + 1) % GROUP_QUEUE_DEPTH;
+	}
+}
+
+/* Removes the oldest frame from a queue. Requires the group lock and a
+ * frame in the queue. */
+static struct sds_frame *queue_pop(struct frame_queue *queue)
+{
+	struct sds_frame *frame = queue->frames[queue->head];
+	queue->head = (queue->head + 1) % GROUP_QUEUE_DEPTH;
+	queue->count--;
+	return frame;
+}
+
+/* Marks a member as failed and wakes up everybody who waits for frames. A
+ * waiter for a frame set might wait on the queue of any member. Requires the
+ * group lock. */
+static void member_fail(struct group_member *member)
+{
+	sds_group *group = member->group;
+	unsigned int i;
+
+	member->failed = 1;
+	member->busy = 0;
+	for (i = 0; i < group->queue_count; ++i)
+		pthread_cond_broadcast(&group->queues[i].available);
+}
+
+/* Submits the transfer of a member unless the group is stopping. Marks the
+ * member as idle if nothing was submitted. */
+static void member_submit(struct group_member *member,
+			  struct libusb_transfer *transfer)
+{
+	sds_group *group = member->group;
+	int err;
+
+	pthread_mutex_lock(&group->lock);
+	if (group->stopping || member->failed) {
+		member->busy = 0;
+	} else {
+		if (transfer == member->poll)
+			TRACE(control__start, SDS_BM_REQUEST_TYPE_IN,
+			      SDS_REQUEST_DATA_AVAILABLE, 0, 0, 1);
+		else
+			TRACE(bulk__start, transfer->endpoint,
+			      transfer->length);
+		member->submitted = get_time_ns();
+		err = member->context->backend->ops->submit(member->context,
+							    transfer);
+		if (err) {
+			member_fail(member);
+			log_write(member->context, LOG_MEMBER_FAILED,
+				  member->index, convert_error(err));
+		}
+	}
+	pthread_mutex_unlock(&group->lock);
+}
+
+/* Converts the status of a transfer to an error value */
+static sds_error transfer_error(enum libusb_transfer_status status)
+{
+	switch (status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			return SDS_ERROR_SUCCESS;
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			return SDS_ERROR_TIMEOUT;
+		case LIBUSB_TRANSFER_OVERFLOW:
+			return SDS_ERROR_OVERFLOW;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			return SDS_ERROR_NO_DEVICE;
+		case LIBUSB_TRANSFER_STALL:
+			return SDS_ERROR_PIPE;
+		default:
+			return SDS_ERROR_IO;
+	}
+}
+
+/* Returns the bytes transferred or the error of a finished transfer (the
+ * result passed to the tracepoints) */
+static int transfer_result(struct libusb_transfer *transfer)
+{
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		return transfer_error(transfer->status);
+	return transfer->actual_length;
+}
+
+/* Marks a member as idle after a transfer has failed. Requests that timed
+ * out or failed sporadically are just issued again. */
+static int member_check_status(struct group_member *member,
+			       enum libusb_transfer_status status)
+{
+	sds_group *group = member->group;
+
+	switch (status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			return 0;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			stats_error(member->context, transfer_error(status));
+			log_write(member->context, LOG_MEMBER_FAILED,
+				  member->index, transfer_error(status));
+			pthread_mutex_lock(&group->lock);
+			member_fail(member);
+			pthread_mutex_unlock(&group->lock);
+			return 1;
+		case LIBUSB_TRANSFER_CANCELLED:
+			pthread_mutex_lock(&group->lock);
+			member->busy = 0;
+			pthread_mutex_unlock(&group->lock);
+			return 1;
+		default:
+			stats_error(member->context, transfer_error(status));
+			break;
+	}
+	member_submit(member, member->poll);
+	return 1;
+}
+
+static void bulk_done(struct libusb_transfer *transfer);
+
+/* Called by libusb when the 0xc0 request finished */
+static void poll_done(struct libusb_transfer *transfer)
+{
+	struct group_member *member = transfer->user_data;
+	sds_group *group = member->group;
+	const struct config *config;
+	unsigned int size;
+	unsigned char *buffer;
+	uint64_t stalled;
+	int available;
+
+	TRACE(control__done, SDS_REQUEST_DATA_AVAILABLE,
+	      transfer_result(transfer), get_time_ns() - member->submitted);
+	if (capture_enabled(member->context))
+		capture_control(member->context, member->submitted,
+				get_time_ns(), SDS_BM_REQUEST_TYPE_IN,
+				SDS_REQUEST_DATA_AVAILABLE, 0, 0,
+				libusb_control_transfer_get_data(transfer), 1,
+				transfer_result(transfer));
+	stats_add(&member->context->stats.control_transfers, 1);
+	if (member_check_status(member, transfer->status))
+		return;
+
+	/* Nothing available yet: poll again */
+	available = transfer->actual_length >= 1 &&
+		    libusb_control_transfer_get_data(transfer)[0];
+	stats_poll(member->context, member->submitted, available);
+	if (!available) {
+		/* A device that does not announce frames any more is polled
+		 * further, but the waiters for its frames time out */
+		config = config_read(member->context);
+		stalled = timing_stalled(member->context, config->time,
+					 get_time_ns());
+		config_release(member->context);
+		if (stalled) {
+			stats_error(member->context, SDS_ERROR_TIMEOUT);
+			log_write(member->context, LOG_STALLED, member->index,
+				  stalled / 1000000);
+			pthread_mutex_lock(&group->lock);
+			member_queue(member)->stalls++;
+			pthread_cond_broadcast(&member_queue(member)->available);
+			pthread_mutex_unlock(&group->lock);
+		}
+		member_submit(member, member->poll);
+		return;
+	}
+
+	/* The time/div setting might have changed since the last frame */
+	config = config_read(member->context);
+	size = get_frame_size(config->time);
+	record_settings(config, &member->settings);
+	config_release(member->context);
+	if (size != member->bulk_size) {
+		buffer = realloc(member->bulk->buffer, size);
+		if (!buffer) {
+			member_submit(member, member->poll);
+			return;
+		}
+		member->bulk_size = size;
+		member->bulk->buffer = buffer;
+	}
+	libusb_fill_bulk_transfer(member->bulk,
+				  NULL, /* set by the backend */
+				  SDS_ENDPOINT_BULK_IN,
+				  member->bulk->buffer,
+				  member->bulk_size,
+				  bulk_done,
+				  member,
+				  SDS_DEFAULT_TIMEOUT);
+	member_submit(member, member->bulk);
+}
+
+/* Called by libusb when the bulk transfer finished */
+static void bulk_done(struct libusb_transfer *transfer)
+{
+	struct group_member *member = transfer->user_data;
+	sds_group *group = member->group;
+	struct sds_frame *frame;
+	unsigned char *buffer;
+	uint64_t timestamp = get_time_ns();
+
+	TRACE(bulk__done, transfer->endpoint, transfer_result(transfer),
+	      timestamp - member->submitted);
+	if (capture_enabled(member->context))
+		capture_bulk(member->context, member->submitted, timestamp,
+			     transfer->endpoint, transfer->buffer,
+			     transfer_result(transfer));
+	if (member_check_status(member, transfer->status))
+		return;
+	timing_frame(member->context, timestamp);
+	stats_frame(member->context, member->submitted, timestamp,
+		    transfer->actual_length);
+
+	/* Hand the buffer over to the frame and replace it by a new one. If
+	 * that fails the data is lost, but the acquisition goes on. */
+	if (transfer->actual_length >= (int) sizeof(frame->data->unknown_padding) &&
+	    (frame = malloc(sizeof(*frame)))) {
+		buffer = malloc(member->bulk_size);
+		if (buffer) {
+			frame->device = member->index;
+			frame->timestamp = timestamp;
+			frame->config_version = member->settings.version;
+			frame->count = (transfer->actual_length
+					- sizeof(frame->data->unknown_padding))
+				       / sizeof(frame->data->samples[0]);
+			frame->data = (struct sds_samples *) transfer->buffer;
+			transfer->buffer = buffer;
+			if (recording_enabled(member->context))
+				record_frame(member->context, &member->settings,
+					     member->index, timestamp,
+					     frame->data, frame->count);
+
+			pthread_mutex_lock(&group->lock);
+			queue_push(member, frame);
+			pthread_mutex_unlock(&group->lock);
+		} else {
+			free(frame);
+			stats_add(&member->context->stats.dropped_frames, 1);
+		}
+	} else {
+		stats_add(&member->context->stats.dropped_frames, 1);
+		if (transfer->actual_length < (int) sizeof(frame->data->unknown_padding))
+			log_write(member->context, LOG_SHORT_FRAME,
+				  transfer->actual_length, 0);
+	}
+
+	member_submit(member, member->poll);
+}
+
+/* Returns true if all transfers of a stopping group are finished. */
+static int group_idle(sds_group *group)
+{
+	unsigned int i;
+	int idle;
+
+	pthread_mutex_lock(&group->lock);
+	idle = group->stopping;
+	for (i = 0; idle && i < group->count; ++i)
+		if (group->members[i].busy)
+			idle = 0;
+	pthread_mutex_unlock(&group->lock);
+	return idle;
+}
+
+/* The thread that drives the transfers of all devices */
+static void *event_thread(void *arg)
+{
+	sds_group *group = arg;
+	struct timeval timeout = { 0, GROUP_EVENT_TIMEOUT * 1000 };
+
+	while (!group_idle(group))
+		group->backend->ops->handle_events(group->backend, &timeout);
+	return NULL;
+}
+
+/* Frees all resources of the members that were set up so far */
+static void free_members(sds_group *group)
+{
+	unsigned int i;
+	for (i = 0; i < group->count; ++i) {
+		struct group_member *member = &group->members[i];
+		if (member->bulk) {
+			free(member->bulk->buffer);
+			libusb_free_transfer(member->bulk);
+		}
+		if (member->poll)
+			libusb_free_transfer(member->poll);
+		sds_destroy(member->context);
+	}
+	free(group->members);
+}
+
+static sds_error init_member(sds_group *group, unsigned int index,
+			     struct sds_device *device)
+{
+	struct group_member *member = &group->members[index];
+	sds_error err;
+
+	member->group = group;
+	member->index = index;
+	if ((err = open_context(group->backend, device, &member->context)))
+		return err;
+
+	member->poll = libusb_alloc_transfer(0);
+	member->bulk = libusb_alloc_transfer(0);
+	if (!member->poll || !member->bulk)
+		return SDS_ERROR_NO_MEM;
+	member->bulk_size = get_frame_size(config_read(member->context)->time);
+	config_release(member->context);
+	member->bulk->buffer = malloc(member->bulk_size);
+	if (!member->bulk->buffer)
+		return SDS_ERROR_NO_MEM;
+
+	libusb_fill_control_setup(member->poll_buffer,
+				  SDS_BM_REQUEST_TYPE_IN,
+				  SDS_REQUEST_DATA_AVAILABLE,
+				  0,
+				  0,
+				  1);
+	libusb_fill_control_transfer(member->poll,
+				     NULL, /* set by the backend */
+				     member->poll_buffer,
+				     poll_done,
+				     member,
+				     SDS_DEFAULT_TIMEOUT);
+	return SDS_ERROR_SUCCESS;
+}
+
+sds_error sds_group_create(struct sds_device *devices, unsigned int count, int flags, sds_group **group)
+{
+	pthread_condattr_t attr;
+	unsigned int i;
+	sds_error err = SDS_ERROR_SUCCESS;
+
+	if (!devices || !count || !group)
+		return SDS_ERROR_INVALID_PARAM;
+	/* Aligning requires the frames of every device separately */
+	if ((flags & SDS_GROUP_SYNCHRONIZED) &&
+	    ((flags & SDS_GROUP_MERGED) || count > SDS_GROUP_MAX_DEVICES))
+		return SDS_ERROR_INVALID_PARAM;
+	*group = calloc(1, sizeof(**group));
+	if (!*group)
+		return SDS_ERROR_NO_MEM;
+	(*group)->flags = flags;
+	(*group)->count = count;
+	(*group)->queue_count = (flags & SDS_GROUP_MERGED) ? 1 : count;
+	(*group)->skew.devices = count;
+
+	(*group)->members = calloc(count, sizeof(*(*group)->members));
+	(*group)->queues = calloc((*group)->queue_count,
+				  sizeof(*(*group)->queues));
+	if (!(*group)->members || !(*group)->queues) {
+		err = SDS_ERROR_NO_MEM;
+		goto group_remove;
+	}
+
+	/* Timeouts are measured with the monotonic clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	for (i = 0; i < (*group)->queue_count; ++i)
+		pthread_cond_init(&(*group)->queues[i].available, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&(*group)->lock, NULL);
+
+	/* All devices have to be driven by the same backend */
+	for (i = 1; i < count; ++i) {
+		if (get_device_kind(&devices[i]) !=
+		    get_device_kind(&devices[0])) {
+			err = SDS_ERROR_INVALID_PARAM;
+			goto sync_remove;
+		}
+	}
+	if ((err = create_backend(&devices[0], &(*group)->backend)))
+		goto sync_remove;
+	for (i = 0; i < count; ++i)
+		if ((err = init_member(*group, i, &devices[i])))
+			goto members_remove;
+	return err;
+
+members_remove:
+	free_members(*group);
+	(*group)->members = NULL;
+	(*group)->backend->ops->destroy((*group)->backend);
+
+sync_remove:
+	for (i = 0; i < (*group)->queue_count; ++i)
+		pthread_cond_destroy(&(*group)->queues[i].available);
+	pthread_mutex_destroy(&(*group)->lock);
+
+group_remove:
+	free((*group)->members);
+	free((*group)->queues);
+	free(*group);
+	*group = NULL;
+	return err;
+}
+
+void sds_group_destroy(sds_group *group)
+{
+	unsigned int i;
+
+	if (!group)
+		return;
+	sds_group_stop(group);
+	free_members(group);
+	group->backend->ops->destroy(group->backend);
+
+	for (i = 0; i < group->queue_count; ++i) {
+		queue_clear(&group->queues[i]);
+		pthread_cond_destroy(&group->queues[i].available);
+	}
+	pthread_mutex_destroy(&group->lock);
+	free(group->queues);
+	free(group);
+}
+
+sds_error sds_group_get_context(sds_group *group, unsigned int device, sds_context **context)
+{
+	if (!group || !context || device >= group->count)
+		return SDS_ERROR_INVALID_PARAM;
+	*context = group->members[device].context;
+	return SDS_ERROR_SUCCESS;
+}
+
+sds_error sds_group_start(sds_group *group)
+{
+	struct timeval timeout = { 0, GROUP_EVENT_TIMEOUT * 1000 };
+	unsigned int i;
+	uint64_t armed;
+	sds_error err = SDS_ERROR_SUCCESS;
+
+	if (!group)
+		return SDS_ERROR_INVALID_PARAM;
+	if (group->running)
+		return SDS_ERROR_BUSY;
+
+	/* Frames of an earlier run would never find partners. The latencies
+	 * are estimated anew. */
+	if (group->flags & SDS_GROUP_SYNCHRONIZED) {
+		for (i = 0; i < group->queue_count; ++i)
+			queue_clear(&group->queues[i]);
+		group->estimates = 0;
+	}
+
+	/* No callback can run before the event thread exists, so the members
+	 * can be armed without holding the lock. The transfers are prepared
+	 * already, so they are submitted with minimal skew. */
+	group->stopping = 0;
+	/* The stall detection starts with the first poll */
+	for (i = 0; i < group->count; ++i)
+		timing_reset(group->members[i].context);
+	armed = get_time_ns();
+	for (i = 0; i < group->count && !err; ++i) {
+		struct group_member *member = &group->members[i];
+		if (member->failed)
+			continue;
+		member->submitted = get_time_ns();
+		if (!(err = convert_error(group->backend->ops->submit(
+						member->context, member->poll))))
+			member->busy = 1;
+	}
+	group->skew.arm_skew = get_time_ns() - armed;
+	if (!err && pthread_create(&group->thread, NULL, event_thread, group))
+		err = SDS_ERROR_NO_MEM;
+	if (!err) {
+		group->running = 1;
+		return err;
+	}
+
+	/* Do not leave transfers behind that nobody handles */
+	group->stopping = 1;
+	for (i = 0; i < group->count; ++i)
+		if (group->members[i].busy)
+			group->backend->ops->cancel(group->members[i].context,
+						    group->members[i].poll);
+	while (!group_idle(group))
+		group->backend->ops->handle_events(group->backend, &timeout);
+	return err;
+}
+
+sds_error sds_group_stop(sds_group *group)
+{
+	unsigned int i;
+
+	if (!group)
+		return SDS_ERROR_INVALID_PARAM;
+	if (!group->running)
+		return SDS_ERROR_SUCCESS;
+
+	pthread_mutex_lock(&group->lock);
+	group->stopping = 1;
+	for (i = 0; i < group->count; ++i) {
+		struct group_member *member = &group->members[i];
+		if (!member->busy)
+			continue;
+		/* Only one of them is submitted, the other call fails */
+		group->backend->ops->cancel(member->context, member->poll);
+		group->backend->ops->cancel(member->context, member->bulk);
+	}
+	pthread_mutex_unlock(&group->lock);
+
+	pthread_join(group->thread, NULL);
+
+	/* Wake up everybody who waits for frames that will never come */
+	pthread_mutex_lock(&group->lock);
+	group->running = 0;
+	for (i = 0; i < group->queue_count; ++i)
+		pthread_cond_broadcast(&group->queues[i].available);
+	pthread_mutex_unlock(&group->lock);
+	return SDS_ERROR_SUCCESS;
+}
+
+/* Computes the absolute time after timeout milliseconds */
+static void get_deadline(struct timespec *deadline, unsigned int timeout)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += timeout / 1000;
+	deadline->tv_nsec += (timeout % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+/* Returns true if a member that fills the queue has not failed. Requires
+ * the group lock. */
+static int queue_alive(sds_group *group, struct frame_queue *queue)
+{
+	unsigned int i;
+
+	for (i = 0; i < group->count; ++i)
+		if (!group->members[i].failed &&
+		    member_queue(&group->members[i]) == queue)
+			return 1;
+	return 0;
+}
+
+/* Returns true if a member of the group has failed. Requires the group
+ * lock. */
+static int group_failed(sds_group *group)
+{
+	unsigned int i;
+
+	for (i = 0; i < group->count; ++i)
+		if (group->members[i].failed)
+			return 1;
+	return 0;
+}
+
+/* Waits until a frame is added to the queue. A device of the queue that
+ * stalls meanwhile ends the wait as well. Requires the group lock. */
+static sds_error queue_wait(sds_group *group, struct frame_queue *queue,
+			    struct timespec *deadline, unsigned int timeout)
+{
+	unsigned int stalls = queue->stalls;
+
+	if (!group->running)
+		return SDS_ERROR_NOT_FOUND;
+	if (!queue_alive(group, queue))
+		return SDS_ERROR_NO_DEVICE;
+	if (!timeout)
+		pthread_cond_wait(&queue->available, &group->lock);
+	else if (pthread_cond_timedwait(&queue->available, &group->lock,
+					deadline) == ETIMEDOUT)
+		return SDS_ERROR_TIMEOUT;
+	if (queue->stalls != stalls && !queue->count)
+		return SDS_ERROR_TIMEOUT;
+	return SDS_ERROR_SUCCESS;
+}
+
+sds_error sds_group_get_frame(sds_group *group, unsigned int device, struct sds_frame **frame, unsigned int timeout)
+{
+	struct frame_queue *queue;
+	struct timespec deadline;
+	sds_error err = SDS_ERROR_SUCCESS;
+
+	if (!group || !frame)
+		return SDS_ERROR_INVALID_PARAM;
+	if (group->flags & SDS_GROUP_MERGED) {
+		if (device != SDS_GROUP_ANY)
+			return SDS_ERROR_INVALID_PARAM;
+		queue = &group->queues[0];
+	} else {
+		if (device >= group->count)
+			return SDS_ERROR_INVALID_PARAM;
+		queue = &group->queues[device];
+	}
+
+	get_deadline(&deadline, timeout);
+	pthread_mutex_lock(&group->lock);
+	while (!queue->count && !err)
+		err = queue_wait(group, queue, &deadline, timeout);
+	if (queue->count) {
+		err = SDS_ERROR_SUCCESS;
+		*frame = queue_pop(queue);
+	} else {
+		*frame = NULL;
+	}
+	pthread_mutex_unlock(&group->lock);
+	return err;
+}
+
+/* Stores the largest and the smallest of count values */
+static void get_range(const double *values, unsigned int count,
+		      double *newest, double *oldest)
+{
+	unsigned int i;
+
+	*newest = *oldest = values[0];
+	for (i = 1; i < count; ++i) {
+		if (values[i] > *newest)
+			*newest = values[i];
+		if (values[i] < *oldest)
+			*oldest = values[i];
+	}
+}
+
+/* Tries to take one aligned set from the heads of all queues. Heads that can
+ * not be aligned any more are discarded. Returns 1 if the set was built, 0 if
+ * there are not enough frames. Requires the group lock. */
+static int take_frame_set(sds_group *group, uint64_t window,
+			  struct sds_frame_set *set)
+{
+	double raw[SDS_GROUP_MAX_DEVICES];
+	double corrected[SDS_GROUP_MAX_DEVICES];
+	double newest, oldest, raw_newest, raw_oldest;
+	double mean = 0, corrected_mean = 0;
+	unsigned int weight;
+	unsigned int i;
+
+	for (i = 0; i < group->count; ++i) {
+		if (!group->queues[i].count)
+			return 0;
+		raw[i] = group->queues[i].frames[group->queues[i].head]->timestamp;
+		mean += raw[i] / group->count;
+	}
+
+	/* Calibration: the latencies can exceed the window, so the first set
+	 * is not checked but seeds the offsets. It pairs the oldest head with
+	 * the heads of the other devices, which are their nearest frames. */
+	if (!group->estimates)
+		for (i = 0; i < group->count; ++i)
+			group->skew.offset[i] = raw[i] - mean;
+
+	for (i = 0; i < group->count; ++i)
+		corrected[i] = raw[i] - group->skew.offset[i];
+	get_range(corrected, group->count, &newest, &oldest);
+	get_range(raw, group->count, &raw_newest, &raw_oldest);
+
+	/* Frames that are too old lost their partners (e.g. because a queue
+	 * overflowed or a transfer failed) */
+	if (newest - oldest > window) {
+		for (i = 0; i < group->count; ++i) {
+			if (newest - corrected[i] > window) {
+				sds_free_frame(queue_pop(&group->queues[i]));
+				group->skew.discarded++;
+				stats_add(&group->members[i].context->
+					  stats.dropped_frames, 1);
+			}
+		}
+		return 0;
+	}
+
+	for (i = 0; i < group->count; ++i) {
+		set->frames[i] = queue_pop(&group->queues[i]);
+		corrected_mean += corrected[i] / group->count;
+	}
+
+	/* Every device has a constant latency (USB scheduling, event
+	 * handling). It is estimated as the moving average of the distance to
+	 * the mean of the set. */
+	if (group->estimates < GROUP_OFFSET_WEIGHT)
+		group->estimates++;
+	weight = group->estimates;
+	for (i = 0; i < group->count; ++i)
+		group->skew.offset[i] += ((raw[i] - mean)
+					  - group->skew.offset[i]) / weight;
+
+	set->count = group->count;
+	set->skew = newest - oldest;
+	set->raw_skew = raw_newest - raw_oldest;
+	set->timestamp = corrected_mean;
+	group->skew.sets++;
+	group->skew_sum += set->skew;
+	group->raw_skew_sum += set->raw_skew;
+	group->skew.mean_skew = group->skew_sum / group->skew.sets;
+	group->skew.mean_raw_skew = group->raw_skew_sum / group->skew.sets;
+	if (set->skew > group->skew.max_skew)
+		group->skew.max_skew = set->skew;
+	if (set->raw_skew > group->skew.max_raw_skew)
+		group->skew.max_raw_skew = set->raw_skew;
+	return 1;
+}
+
+sds_error sds_group_get_frame_set(sds_group *group, uint64_t window, struct sds_frame_set **set, unsigned int timeout)
+{
+	struct timespec deadline;
+	unsigned int i;
+	sds_error err = SDS_ERROR_SUCCESS;
+
+	if (!group || !set || !(group->flags & SDS_GROUP_SYNCHRONIZED))
+		return SDS_ERROR_INVALID_PARAM;
+	*set = malloc(sizeof(**set) + group->count * sizeof((*set)->frames[0]));
+	if (!*set)
+		return SDS_ERROR_NO_MEM;
+
+	get_deadline(&deadline, timeout);
+	pthread_mutex_lock(&group->lock);
+	while (!take_frame_set(group, window, *set) && !err) {
+		/* A set needs a frame of every device */
+		if (group_failed(group)) {
+			err = SDS_ERROR_NO_DEVICE;
+			break;
+		}
+		/* Wait for the first queue that is empty (if any is left after
+		 * discarding) */
+		for (i = 0; i < group->count && group->queues[i].count; ++i)
+			;
+		if (i < group->count)
+			err = queue_wait(group, &group->queues[i], &deadline,
+					 timeout);
+	}
+	pthread_mutex_unlock(&group->lock);
+
+	if (err) {
+		free(*set);
+		*set = NULL;
+	}
+	return err;
+}
+
+void sds_free_frame_set(struct sds_frame_set *set)
+{
+	unsigned int i;
+	if (!set)
+		return;
+	for (i = 0; i < set->count; ++i)
+		sds_free_frame(set->frames[i]);
+	free(set);
+}
+
+sds_error sds_group_get_skew_report(sds_group *group, struct sds_skew_report *report)
+{
+	if (!group || !report || !(group->flags & SDS_GROUP_SYNCHRONIZED))
+		return SDS_ERROR_INVALID_PARAM;
+	pthread_mutex_lock(&group->lock);
+	*report = group->skew;
+	pthread_mutex_unlock(&group->lock);
+	return SDS_ERROR_SUCCESS;
+}
+
+void sds_free_frame(struct sds_frame *frame)
+{
+	if (!frame)
+		return;
+	free(frame->data);
+	free(frame);
+}
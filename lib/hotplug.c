@@ -0,0 +1,224 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+#include <stdlib.h>
+
+#include "internal.h"
+
+/* Time (in ms) the hotplug thread waits for events at most. This bounds the
+ * time disable_hotplug() needs to stop the thread. */
+#define HOTPLUG_EVENT_TIMEOUT 100
+
+/* The hotplug state of one context. libusb calls the hotplug callback while
+ * handling events, where no synchronous transfers are allowed. Therefore the
+ * callback only remembers what happened and the thread does the work. */
+struct hotplug
+{
+	libusb_hotplug_callback_handle handle;
+	pthread_t thread;
+	pthread_mutex_t lock; /* protects the members below */
+	int stop; /* true -> the thread should terminate */
+	int left; /* true -> the device of the context was detached */
+	libusb_device *arrived; /* a matching device that was attached */
+};
+
+static void send_event(sds_context *context, enum sds_event event)
+{
+	if (context->event_callback)
+		context->event_callback(context, event,
+					context->event_user_data);
+}
+
+static int hotplug_callback(libusb_context *usb_context,
+			    libusb_device *device,
+			    libusb_hotplug_event event,
+			    void *user_data)
+{
+	sds_context *context = user_data;
+	struct hotplug *hotplug = context->hotplug;
+
+	/* device_handle is only replaced by the hotplug thread, which is the
+	 * one calling this function */
+	pthread_mutex_lock(&hotplug->lock);
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+		if (context->device_handle &&
+		    libusb_get_device(context->device_handle) == device)
+			hotplug->left = 1;
+	} else if (libusb_get_bus_number(device) == context->bus_no &&
+		   libusb_get_port_number(device) == context->port_no) {
+		if (hotplug->arrived)
+			libusb_unref_device(hotplug->arrived);
+		hotplug->arrived = libusb_ref_device(device);
+	}
+	pthread_mutex_unlock(&hotplug->lock);
+
+	/* Stay registered */
+	return 0;
+}
+
+/* Closes the handle of a detached device */
+static void disconnect(sds_context *context)
+{
+	pthread_rwlock_wrlock(&context->handle_lock);
+	libusb_close(context->device_handle);
+	context->device_handle = NULL;
+	pthread_rwlock_unlock(&context->handle_lock);
+	log_write(context, LOG_DISCONNECTED, 0, 0);
+	send_event(context, SDS_EVENT_DISCONNECTED);
+}
+
+/* Opens a device that was attached again and restores its state */
+static void reconnect(sds_context *context, libusb_device *device)
+{
+	libusb_device_handle *handle;
+	sds_error err;
+
+	/* The detach event might have been missed */
+	if (context->device_handle)
+		disconnect(context);
+
+	if (libusb_open(device, &handle)) {
+		log_write(context, LOG_RECONNECT_FAILED, 0, 0);
+		send_event(context, SDS_EVENT_RECONNECT_FAILED);
+		return;
+	}
+	pthread_rwlock_wrlock(&context->handle_lock);
+	context->device_handle = handle;
+	pthread_rwlock_unlock(&context->handle_lock);
+
+	err = restore_device(context);
+	/* The device could not announce frames while it was detached */
+	timing_reset(context);
+	if (err) {
+		log_write(context, LOG_RECONNECT_FAILED, 0, 0);
+		send_event(context, SDS_EVENT_RECONNECT_FAILED);
+	} else {
+		log_write(context, LOG_RECONNECTED, 0, 0);
+		send_event(context, SDS_EVENT_RECONNECTED);
+	}
+}
+
+static void *hotplug_thread(void *arg)
+{
+	sds_context *context = arg;
+	struct hotplug *hotplug = context->hotplug;
+	struct timeval timeout = { 0, HOTPLUG_EVENT_TIMEOUT * 1000 };
+	libusb_device *arrived;
+	int left;
+	int stop = 0;
+
+	while (!stop) {
+		libusb_handle_events_timeout_completed(context->usb_context,
+						       &timeout, NULL);
+		pthread_mutex_lock(&hotplug->lock);
+		stop = hotplug->stop;
+		left = hotplug->left;
+		arrived = hotplug->arrived;
+		hotplug->left = 0;
+		hotplug->arrived = NULL;
+		pthread_mutex_unlock(&hotplug->lock);
+
+		if (left)
+			disconnect(context);
+		if (arrived) {
+			reconnect(context, arrived);
+			libusb_unref_device(arrived);
+		}
+	}
+	return NULL;
+}
+
+sds_error sds_set_event_callback(sds_context *context, sds_event_callback callback, void *user_data)
+{
+	if (!context)
+		return SDS_ERROR_INVALID_PARAM;
+	context->event_callback = callback;
+	context->event_user_data = user_data;
+	return SDS_ERROR_SUCCESS;
+}
+
+sds_error sds_enable_hotplug(sds_context *context)
+{
+	struct hotplug *hotplug;
+	sds_error err = SDS_ERROR_SUCCESS;
+
+	if (!context)
+		return SDS_ERROR_INVALID_PARAM;
+	if (context->hotplug)
+		return SDS_ERROR_SUCCESS;
+	/* The event thread of a group would have to rearm the transfers and
+	 * only the libusb backend sees devices come and go */
+	if (!context->owns_backend || !context->usb_context ||
+	    !libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return SDS_ERROR_NOT_SUPPORTED;
+
+	hotplug = calloc(1, sizeof(*hotplug));
+	if (!hotplug)
+		return SDS_ERROR_NO_MEM;
+	pthread_mutex_init(&hotplug->lock, NULL);
+	context->hotplug = hotplug;
+
+	if ((err = convert_error(libusb_hotplug_register_callback(
+					context->usb_context,
+					LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+					LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+					LIBUSB_HOTPLUG_NO_FLAGS,
+					SDS_VENDOR_ID,
+					SDS_PRODUCT_ID,
+					LIBUSB_HOTPLUG_MATCH_ANY,
+					hotplug_callback,
+					context,
+					&hotplug->handle))))
+		goto hotplug_remove;
+	if (pthread_create(&hotplug->thread, NULL, hotplug_thread, context)) {
+		err = SDS_ERROR_NO_MEM;
+		goto callback_remove;
+	}
+	return err;
+
+callback_remove:
+	libusb_hotplug_deregister_callback(context->usb_context,
+					   hotplug->handle);
+
+hotplug_remove:
+	context->hotplug = NULL;
+	pthread_mutex_destroy(&hotplug->lock);
+	free(hotplug);
+	return err;
+}
+
+void disable_hotplug(sds_context *context)
+{
+	struct hotplug *hotplug = context->hotplug;
+
+	if (!hotplug)
+		return;
+	pthread_mutex_lock(&hotplug->lock);
+	hotplug->stop = 1;
+	pthread_mutex_unlock(&hotplug->lock);
+	/* Deregistering also wakes up the thread if it waits for events */
+	libusb_hotplug_deregister_callback(context->usb_context,
+					   hotplug->handle);
+	pthread_join(hotplug->thread, NULL);
+
+	if (hotplug->arrived)
+		libusb_unref_device(hotplug->arrived);
+	pthread_mutex_destroy(&hotplug->lock);
+	free(hotplug);
+	context->hotplug = NULL;
+}
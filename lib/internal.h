@@ -0,0 +1,430 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+/* Definitions that are shared between the translation units of the library
+ * but are not part of the public interface. */
+
+#ifndef SDS_INTERNAL_H
+#define SDS_INTERNAL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <libusb.h>
+
+#include "libsds200a.h"
+
+#define SDS_VENDOR_ID 0x0da8
+#define SDS_PRODUCT_ID 0x0001
+
+#define SDS_DEFAULT_TIMEOUT 250
+#define SDS_RELAY_WAIT 500000
+
+#define SDS_ENDPOINT_BULK_IN 0x82
+
+/* Control out, Recipient = device */
+#define SDS_BM_REQUEST_TYPE_OUT 0x40
+/* Control in, Recipient = device */
+#define SDS_BM_REQUEST_TYPE_IN  0xc0
+#define SDS_REQUEST_RESET 0xd0
+#define SDS_REQUEST_RELAY 0xb5
+#define SDS_REQUEST_STATE2 0xb3
+#define SDS_REQUEST_STATE1 0xb1
+#define SDS_REQUEST_OFFSET 0xb2
+#define SDS_REQUEST_DATA_AVAILABLE 0xc0
+
+/* Request size of a 0xb1 and 0xb3 request */
+#define SDS_STATE_SIZE 21
+
+/* The relay bits for 0xb5 requests. Coupling relays are correct, 10/100
+ * relays probably must be switched (?). (XXX) */
+enum relay
+{
+	ch1_10_relay = 1,
+	ch1_100_relay = 2,
+	ch1_coupling_relay = 0,
+	ch2_10_relay = 4,
+	ch2_100_relay = 5,
+	ch2_coupling_relay = 3,
+};
+
+struct backend;
+
+/* The operations of a transport backend. The libusb backend (usb.c) talks to
+ * real devices, the simulator (sim.c) models them in software. All
+ * operations return libusb error codes, the synchronous transfers return the
+ * amount of transferred bytes on success. */
+struct backend_ops
+{
+	/* Opens the device for the context and sets up its transport members */
+	int (*open)(struct backend *backend, struct sds_device *device,
+		    sds_context *context);
+	void (*close)(sds_context *context);
+
+	int (*control)(sds_context *context,
+		       uint8_t bmRequestType,
+		       uint8_t bRequest,
+		       uint16_t wValue,
+		       uint16_t wIndex,
+		       unsigned char *data,
+		       uint16_t wLength,
+		       unsigned int timeout);
+	int (*bulk_in)(sds_context *context,
+		       unsigned char endpoint,
+		       unsigned char *data,
+		       int length,
+		       int *transferred,
+		       unsigned int timeout);
+
+	/* Asynchronous transfers (prepared by the libusb_fill_* functions).
+	 * Their callbacks are called from within handle_events. */
+	int (*submit)(sds_context *context, struct libusb_transfer *transfer);
+	int (*cancel)(sds_context *context, struct libusb_transfer *transfer);
+	int (*handle_events)(struct backend *backend, struct timeval *timeout);
+
+	void (*destroy)(struct backend *backend);
+};
+
+/* A backend instance, which may be shared by several contexts (see device
+ * groups). The backends embed it as their first member. */
+struct backend
+{
+	const struct backend_ops *ops;
+};
+
+/* Carries out an asynchronous transfer of an emulated backend. Sets the
+ * status and the actual_length of the transfer. */
+typedef void (*emulated_complete)(sds_context *context,
+				  struct libusb_transfer *transfer);
+
+/* The base of the backends that answer requests in software (see
+ * emulated.c) */
+struct emulated_backend
+{
+	struct backend backend;
+	emulated_complete complete;
+	pthread_mutex_t lock; /* protects pending */
+	pthread_cond_t changed; /* signalled when pending changes */
+	struct emulated_transfer *pending; /* in the order of submission */
+};
+
+void emulated_init(struct emulated_backend *backend,
+		   const struct backend_ops *ops,
+		   emulated_complete complete);
+void emulated_release(struct emulated_backend *backend);
+
+/* Queues a transfer that completes at the given time (see get_time_ns()) */
+int emulated_submit(sds_context *context, struct libusb_transfer *transfer,
+		    uint64_t due);
+int emulated_cancel(sds_context *context, struct libusb_transfer *transfer);
+int emulated_handle_events(struct backend *backend, struct timeval *timeout);
+
+/* The kinds of devices in a sds_device_list */
+enum device_kind
+{
+	DEVICE_USB = 0,
+	DEVICE_SIMULATED,
+	DEVICE_REPLAYED,
+};
+
+/* The data behind sds_device.device_ptr. A NULL device_ptr denotes an USB
+ * device as well. */
+struct device_info
+{
+	enum device_kind kind;
+	struct sds_simulation simulation; /* DEVICE_SIMULATED only */
+	struct sds_replay replay; /* DEVICE_REPLAYED only */
+};
+
+/* The configuration of a device as remembered in software. A published
+ * snapshot is never modified (see config.c). */
+struct config
+{
+	uint64_t version; /* incremented with every published snapshot */
+	int channel_active[2]; /* both channels: true -> active, false -> inactive */
+	int coupling[2]; /* both channels: true -> coupling active, false -> coupling inactive */
+	double offset[2]; /* both channels: voltage offset */
+	enum sds_voltage voltage[2]; /* both channels: voltage/div */
+	enum sds_time time;
+	enum sds_trigger_slope trigger_slope;
+	enum sds_trigger_mode trigger_mode;
+	enum sds_channel trigger; /* on which channel is triggered */
+	char tt_state[SDS_STATE_SIZE]; /* content of last 0xb1/0xb3 request of the device */
+	struct config *retired_next; /* next entry in the list of retired snapshots */
+};
+
+/* The counters behind struct sds_stats (see stats.c). They are updated with
+ * relaxed atomic operations, which cost about as much as plain increments. */
+struct stats
+{
+	_Atomic uint64_t control_transfers;
+	_Atomic uint64_t bulk_transfers;
+	_Atomic uint64_t bulk_bytes;
+	_Atomic uint64_t empty_polls;
+	_Atomic uint64_t timeouts;
+	_Atomic uint64_t overflows;
+	_Atomic uint64_t errors;
+	_Atomic uint64_t dropped_frames;
+	_Atomic uint64_t poll_latency[SDS_STATS_BUCKETS];
+	_Atomic uint64_t transfer_latency[SDS_STATS_BUCKETS];
+	_Atomic uint64_t poll_start; /* first poll for the next frame in ns or 0 */
+};
+
+/* The events of the log of a context (see logring.c). The comments list
+ * the arguments. */
+enum log_event
+{
+	LOG_CONTROL_FAILED = 1, /* bRequest, error */
+	LOG_BULK_FAILED, /* error, result of the poll */
+	LOG_SHORT_FRAME, /* bytes */
+	LOG_FRAME_DROPPED, /* device index */
+	LOG_MEMBER_FAILED, /* device index, error */
+	LOG_DISCONNECTED,
+	LOG_RECONNECTED,
+	LOG_RECONNECT_FAILED,
+	LOG_CAPTURE_OVERFLOW, /* bytes */
+	LOG_CAPTURE_FAILED, /* errno */
+	LOG_RECORD_OVERFLOW, /* bytes */
+	LOG_RECORD_FAILED, /* segment, error */
+	LOG_STALLED, /* device index, ms without a frame */
+};
+
+/* The amount of arguments of a log entry */
+#define LOG_ARGS 2
+
+struct log_ring;
+struct capture;
+struct recorder;
+
+/* This struct contains the state of the driver for one device */
+struct sds_context
+{
+	struct backend *backend;
+	int owns_backend; /* true -> backend is destroyed on destruction */
+	void *device; /* data of the backend for this device */
+	unsigned int relay_wait; /* time (in us) a relay needs to settle */
+
+	/* libusb backend only */
+	libusb_context *usb_context;
+	libusb_device_handle *device_handle; /* NULL while the device is detached */
+	pthread_rwlock_t handle_lock; /* write locked while device_handle changes */
+	int bus_no; /* bus of the device (to find it again after reattaching) */
+	int port_no; /* port of the device (to find it again after reattaching) */
+
+	/* Hotplug handling (see hotplug.c) */
+	struct hotplug *hotplug; /* NULL if hotplug handling is disabled */
+	sds_event_callback event_callback;
+	void *event_user_data;
+
+	/* Device data: Remember the state of the device in software */
+	_Atomic(struct config *) config; /* the current snapshot */
+	atomic_uint readers; /* threads that might hold a snapshot */
+	pthread_mutex_t config_lock; /* serializes the setters */
+	struct config *retired; /* replaced snapshots that are not freed yet */
+
+	/* Frame interval estimation (see timing.c) */
+	_Atomic uint64_t last_frame; /* arrival of the last frame in ns or 0 */
+	_Atomic uint64_t frame_interval; /* observed interval in ns or 0 */
+	_Atomic uint64_t waiting_since; /* last frame or first empty poll or 0 */
+
+	struct stats stats;
+	struct log_ring *log;
+
+	/* Capture of the transfers (see capture.c) */
+	struct capture *capture; /* NULL if the transfers are not captured */
+	pthread_rwlock_t capture_lock; /* write locked while capture changes */
+	atomic_int capturing; /* true -> capture is set (checked unlocked) */
+
+	/* Recording of the frames (see recorder.c) */
+	struct recorder *recorder; /* NULL if the frames are not recorded */
+	pthread_rwlock_t recorder_lock; /* write locked while recorder changes */
+	atomic_int recording; /* true -> recorder is set (checked unlocked) */
+
+	/* Calibration data */
+	double zero[2]; /* default offset of 0V (add to user defined offset) */
+	double uv_per_tick[2]; /* how many micro volts per tick (TODO) */
+};
+
+/* Converts libusb-error values to the internal ones */
+sds_error convert_error(int libusbError);
+
+/* Opens the given device with the backend (which is not owned by the
+ * resulting context) and brings it into the known initial state. */
+sds_error open_context(struct backend *backend, struct sds_device *device,
+		       sds_context **context);
+
+/* Creates a backend that is able to open the given device */
+sds_error create_backend(struct sds_device *device, struct backend **backend);
+
+/* Returns the kind of the given device */
+enum device_kind get_device_kind(struct sds_device *device);
+
+/* Creates the backends */
+sds_error usb_create(struct backend **backend);
+sds_error sim_create(struct backend **backend);
+sds_error replay_create(struct backend **backend);
+
+/* Returns 0 if the dev is a SDS200A or 1 if it is not. */
+int probe_usb_device(libusb_device *dev);
+
+/* Converts a time to the 0xb3 word that selects it or NULL if the time is
+ * invalid */
+char *get_time_command(enum sds_time time);
+
+/* Allocates the initial configuration of a context */
+sds_error config_init(sds_context *context);
+
+/* Frees all configuration snapshots of a context */
+void config_destroy(sds_context *context);
+
+/* Returns the current configuration. It stays valid until config_release()
+ * is called. Never blocks. */
+const struct config *config_read(sds_context *context);
+void config_release(sds_context *context);
+
+/* Returns a private copy of the current configuration and locks out other
+ * writers until the copy is published by config_commit() or dropped by
+ * config_abort(). Returns NULL if no memory is left. */
+struct config *config_edit(sds_context *context);
+void config_commit(sds_context *context, struct config *config);
+void config_abort(sds_context *context, struct config *config);
+
+/* Restores the state stored in software on a device that was attached
+ * again, using as few transfers as possible. On success the configuration
+ * is committed again under a new version. */
+sds_error restore_device(sds_context *context);
+
+/* Stops the hotplug handling of a context (if it was enabled). */
+void disable_hotplug(sds_context *context);
+
+/* Returns the size of a bulk transfer for a time/div setting. */
+unsigned int get_frame_size(enum sds_time time);
+
+/* Returns the duration of one division in nanoseconds or 0 if time is
+ * invalid. */
+uint64_t get_time_per_div(enum sds_time time);
+
+/* Forgets the observed frame interval (e.g. after the time/div changed) and
+ * restarts the stall detection */
+void timing_reset(sds_context *context);
+
+/* Adds the arrival of a frame to the frame interval estimation */
+void timing_frame(sds_context *context, uint64_t timestamp);
+
+/* Returns the expected interval between two frames in nanoseconds */
+uint64_t get_frame_interval(sds_context *context, enum sds_time time);
+
+/* Returns how long (in ns) the device announced no frame if that is too
+ * many frame intervals, otherwise 0. Called with the time of every poll that
+ * found no data. */
+uint64_t timing_stalled(sds_context *context, enum sds_time time,
+			uint64_t now);
+
+/* Adds n to a counter */
+static inline void stats_add(_Atomic uint64_t *counter, uint64_t n)
+{
+	atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+/* Counts a failed transfer in the matching counter */
+void stats_error(sds_context *context, sds_error err);
+
+/* Adds a duration (in ns) to a latency histogram */
+void stats_latency(_Atomic uint64_t *histogram, uint64_t duration);
+
+/* Counts a poll of the sync or async path. A poll that finds data ends the
+ * wait for the next frame, which started with the first empty poll. */
+void stats_poll(sds_context *context, uint64_t now, int available);
+
+/* Counts the bulk transfer of a frame that started at the given time */
+void stats_frame(sds_context *context, uint64_t start, uint64_t now,
+		 unsigned int bytes);
+
+/* Allocates and frees the log of a context */
+sds_error log_init(sds_context *context);
+void log_destroy(sds_context *context);
+
+/* Appends an entry to the log of a context. Never blocks. */
+void log_write(sds_context *context, enum log_event event,
+	       int64_t arg0, int64_t arg1);
+
+/* Record a finished transfer if the context captures its transfers. The
+ * result is the amount of transferred bytes or a (negative) sds_error.
+ * The times are monotonic timestamps in ns. */
+void capture_control(sds_context *context, uint64_t submitted,
+		     uint64_t completed, uint8_t bmRequestType,
+		     uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+		     const unsigned char *data, uint16_t wLength, int result);
+void capture_bulk(sds_context *context, uint64_t submitted,
+		  uint64_t completed, uint8_t endpoint,
+		  const unsigned char *data, int result);
+
+/* Returns true if the transfers of the context are captured */
+static inline int capture_enabled(sds_context *context)
+{
+	return atomic_load_explicit(&context->capturing, memory_order_relaxed);
+}
+
+/* The part of a configuration that is stored with every recorded frame */
+struct frame_settings
+{
+	uint64_t version;
+	enum sds_time time;
+	enum sds_voltage voltage[2];
+	double offset[2];
+};
+
+/* Copies the settings a frame is acquired with out of a configuration */
+void record_settings(const struct config *config,
+		     struct frame_settings *settings);
+
+/* Adds a frame to the recording of the context (if it is recorded). Never
+ * waits for the disk. */
+void record_frame(sds_context *context, const struct frame_settings *settings,
+		  unsigned int device, uint64_t timestamp,
+		  const struct sds_samples *data, size_t count);
+
+/* Returns true if the frames of the context are recorded */
+static inline int recording_enabled(sds_context *context)
+{
+	return atomic_load_explicit(&context->recording, memory_order_relaxed);
+}
+
+/* Decodes one sample of a frame. Samples that are not marked valid or that
+ * carry set 0x30 bits in the high byte are missing (see dataformat.md). */
+static inline uint16_t decode_sample(uint16_t sample)
+{
+	if ((sample & 0xb000) != 0x8000)
+		return SDS_SAMPLE_MISSING;
+	return ((sample >> 2) & 0x3c0) | (sample & 0x3f);
+}
+
+/* Decodes the samples of a frame like sds_decode_samples() */
+void decode_samples(const struct sds_samples *data, size_t count, uint16_t *advalues);
+
+/* Returns the time of the monotonic clock in nanoseconds. All timestamps of
+ * the library are taken from this clock. */
+static inline uint64_t get_time_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#endif /* SDS_INTERNAL_H */
@@ -19,31 +19,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <libusb.h>
 
-#include "libsds200a.h"
-
-#define SDS_VENDOR_ID 0x0da8
-#define SDS_PRODUCT_ID 0x0001
-
-#define SDS_DEFAULT_TIMEOUT 250
-#define SDS_RELAY_WAIT 500000
-
-#define SDS_ENDPOINT_BULK_IN 0x82
-
-/* Control out, Recipient = device */
-#define SDS_BM_REQUEST_TYPE_OUT 0x40
-/* Control in, Recipient = device */
-#define SDS_BM_REQUEST_TYPE_IN  0xc0
-#define SDS_REQUEST_RESET 0xd0
-#define SDS_REQUEST_RELAY 0xb5
-#define SDS_REQUEST_STATE2 0xb3
-#define SDS_REQUEST_STATE1 0xb1
-#define SDS_REQUEST_OFFSET 0xb2
-#define SDS_REQUEST_DATA_AVAILABLE 0xc0
-
-/* Request size of a 0xb1 and 0xb3 request */
-#define SDS_STATE_SIZE 21
+#include "internal.h"
+#include "trace.h"
 
 /* Since the format of 0xb3 was not understood, here are complete words that
  * were sent to change to the specific time scales. There might be a lot of
@@ -79,45 +57,8 @@
 #define SDS_TIME_4S    "\x2e\x01\x00\x00" "\x00\x00\x10\x00" "\x00\x00\x05\x00" "\x00\x00\x00\x00" "\x00\x00\x00\x9f" "\x01"
 #define SDS_TIME_10S   "\x2e\x01\x00\x00" "\x00\x00\x10\x00" "\x00\x00\x05\x00" "\x00\x00\x00\x00" "\x00\x00\x00\xa0" "\x01" 
 
-/* XXX: DEBUG */
-#include <stdio.h>
-
-/* This struct contains the state of the driver for one device */
-struct sds_context
-{
-	libusb_context *usb_context;
-	libusb_device_handle *device_handle;
-
-	/* Device data: Remember the state of the device in software */
-	int channel_active[2]; /* both channels: true -> active, false -> inactive */
-	int coupling[2]; /* both channels: true -> coupling active, false -> coupling inactive */
-	double offset[2]; /* both channels: voltage offset */
-	enum sds_voltage voltage[2]; /* both channels: voltage/div */
-	enum sds_time time;
-	enum sds_trigger_slope trigger_slope;
-	enum sds_trigger_mode trigger_mode;
-	enum sds_channel trigger; /* on which channel is triggered */
-	char tt_state[SDS_STATE_SIZE]; /* content of last 0xb1/0xb3 request of the device */
-
-	/* Calibration data */
-	double zero[2]; /* default offset of 0V (add to user defined offset) */
-	double uv_per_tick[2]; /* how many micro volts per tick (TODO) */
-};
-
-/* The relay bits for 0xb5 requests. Coupling relays are correct, 10/100
- * relays probably must be switched (?). (XXX) */
-enum relay
-{
-	ch1_10_relay = 1,
-	ch1_100_relay = 2,
-	ch1_coupling_relay = 0,
-	ch2_10_relay = 4,
-	ch2_100_relay = 5,
-	ch2_coupling_relay = 3,
-};
-
 /* Converts libusb-error values to the internal ones */
-static sds_error convert_error(int libusbError)
+sds_error convert_error(int libusbError)
 {
 	switch (libusbError) {
 		case LIBUSB_SUCCESS:
@@ -161,7 +102,7 @@ static sds_error convert_error(int libusbError)
 }
 
 /* Simple wrapper for usb control transfers */
-static sds_error control_transfer(libusb_device_handle *usbhandle,
+static sds_error control_transfer(sds_context *context,
 				  uint8_t bmRequestType,
 				  uint8_t bRequest,
 				  uint16_t wValue,
@@ -172,15 +113,18 @@ static sds_error control_transfer(libusb_device_handle *usbhandle,
 {
 	int written;
 	sds_error err;
-
-	written = libusb_control_transfer(usbhandle,
-					  bmRequestType,
-					  bRequest,
-					  wValue,
-					  wIndex,
-					  data,
-					  wLength,
-					  timeout);
+	uint64_t start = get_time_ns();
+
+	TRACE(control__start, bmRequestType, bRequest, wValue, wIndex,
+	      wLength);
+	written = context->backend->ops->control(context,
+						 bmRequestType,
+						 bRequest,
+						 wValue,
+						 wIndex,
+						 data,
+						 wLength,
+						 timeout);
 
 	/* Wrap the errors */
 	if (written < 0) {
@@ -191,36 +135,43 @@ static sds_error control_transfer(libusb_device_handle *usbhandle,
 					   : SDS_ERROR_SUCCESS;
 	}
 
+	stats_add(&context->stats.control_transfers, 1);
+	stats_error(context, err);
+	if (err)
+		log_write(context, LOG_CONTROL_FAILED, bRequest, err);
+	if (capture_enabled(context))
+		capture_control(context, start, get_time_ns(), bmRequestType,
+				bRequest, wValue, wIndex, data, wLength,
+				err ? err : written);
+	TRACE(control__done, bRequest, err ? err : written,
+	      get_time_ns() - start);
 	return err;
 }
 
-/* Sets a relay and returns 0 on success. */
-static sds_error relay_set(sds_context *context, enum relay which, int set)
+/* Sends the request that switches a relay. The relay has to settle before
+ * relay_flush() is called. */
+static sds_error relay_send(sds_context *context, enum relay which, int set)
 {
 	unsigned char status = 1 << which;
-	sds_error err = SDS_ERROR_SUCCESS;
-	int written;
 	if (!set)
 		status = ~status;
 
-	err = control_transfer(context->device_handle,
-			       SDS_BM_REQUEST_TYPE_OUT,
-			       SDS_REQUEST_RELAY,
-			       0,
-			       0,
-			       &status,
-			       sizeof(status),
-			       SDS_DEFAULT_TIMEOUT);
-
-	/* The relays seem to require some sleep time to be in the correct
-	 * position. A signal might interrupt this call, but since this is
-	 * a dirty fix anyways, we just ignore it. */
-	usleep(SDS_RELAY_WAIT);
+	return control_transfer(context,
+				SDS_BM_REQUEST_TYPE_OUT,
+				SDS_REQUEST_RELAY,
+				0,
+				0,
+				&status,
+				sizeof(status),
+				SDS_DEFAULT_TIMEOUT);
+}
 
-	/* Seems to flush - we just send it, since the original driver also
-	 * does it. Don't care if it fails. */
-	status = 0;
-	control_transfer(context->device_handle,
+/* Seems to flush - we just send it, since the original driver also
+ * does it. Don't care if it fails. */
+static void relay_flush(sds_context *context)
+{
+	unsigned char status = 0;
+	control_transfer(context,
 			 SDS_BM_REQUEST_TYPE_OUT,
 			 SDS_REQUEST_RELAY,
 			 0,
@@ -228,6 +179,24 @@ static sds_error relay_set(sds_context *context, enum relay which, int set)
 			 &status,
 			 sizeof(status),
 			 SDS_DEFAULT_TIMEOUT);
+}
+
+/* Sets a relay and returns 0 on success. */
+static sds_error relay_set(sds_context *context, enum relay which, int set)
+{
+	uint64_t start = TRACE_START(relay__done);
+	sds_error err;
+
+	TRACE(relay__start, which, set);
+	err = relay_send(context, which, set);
+
+	/* The relays seem to require some sleep time to be in the correct
+	 * position. A signal might interrupt this call, but since this is
+	 * a dirty fix anyways, we just ignore it. */
+	usleep(context->relay_wait);
+
+	relay_flush(context);
+	TRACE(relay__done, which, set, err, get_time_ns() - start);
 	return err;
 }
 
@@ -245,31 +214,33 @@ static sds_error set_voltage_relays(sds_context *context,
 	return err;
 }
 
-/* Sends the context->tt_state as 0xb1 and 0xb3 requests. If they are not
+/* Sends the tt_state as 0xb1 and 0xb3 requests. If they are not
  * completely equivalent, this function is obsolete (XXX) */
-static sds_error send_state_word(sds_context *context)
+static sds_error send_state_word(sds_context *context, const char *tt_state)
 {
+	uint64_t start = TRACE_START(state__done);
 	sds_error err;
-	err = control_transfer(context->device_handle,
+
+	TRACE(state__start, tt_state);
+	err = control_transfer(context,
 			       SDS_BM_REQUEST_TYPE_OUT,
 			       SDS_REQUEST_STATE1,
 			       0,
 			       0,
-			       (unsigned char *) context->tt_state,
-			       sizeof(context->tt_state),
+			       (unsigned char *) tt_state,
+			       SDS_STATE_SIZE,
 			       SDS_DEFAULT_TIMEOUT);
 
-	if (err)
-		return err;
-
-	err = control_transfer(context->device_handle,
-			       SDS_BM_REQUEST_TYPE_OUT,
-			       SDS_REQUEST_STATE2,
-			       0,
-			       0,
-			       (unsigned char *) context->tt_state,
-			       sizeof(context->tt_state),
-			       SDS_DEFAULT_TIMEOUT);
+	if (!err)
+		err = control_transfer(context,
+				       SDS_BM_REQUEST_TYPE_OUT,
+				       SDS_REQUEST_STATE2,
+				       0,
+				       0,
+				       (unsigned char *) tt_state,
+				       SDS_STATE_SIZE,
+				       SDS_DEFAULT_TIMEOUT);
+	TRACE(state__done, err, get_time_ns() - start);
 	return err;
 }
 
@@ -338,26 +309,33 @@ char *get_time_command(enum sds_time time)
 			return SDS_TIME_4S;
 		case SDS_10s:
 			return SDS_TIME_10S;
+		default:
+			/* e.g. before the first time was set */
+			return NULL;
 	}
 }
 
 /* Bitwise xors the status word. Requires the state to be 21 chars. */
-static void xor_on_state(sds_context *context, char *state)
+static void xor_on_state(char *tt_state, char *state)
 {
 	int i = 0;
 	for (; i < SDS_STATE_SIZE; ++i)
-		context->tt_state[i] ^= state[i];
+		tt_state[i] ^= state[i];
 }
 
-/* Changes the time state to the new time */
-static sds_error change_time(sds_context *context, enum sds_time time)
+/* Changes the time state of the (unpublished) config to the new time */
+static sds_error change_time(sds_context *context, struct config *config,
+			     enum sds_time time)
 {
 	char *ntime = get_time_command(time);
-	char *otime = get_time_command(context->time);
-	xor_on_state(context, otime);
-	xor_on_state(context, ntime);
-	memcpy(context->tt_state, ntime, SDS_STATE_SIZE);
-	return send_state_word(context);
+	char *otime = get_time_command(config->time);
+	if (!ntime)
+		return SDS_ERROR_INVALID_PARAM;
+	if (otime)
+		xor_on_state(config->tt_state, otime);
+	xor_on_state(config->tt_state, ntime);
+	memcpy(config->tt_state, ntime, SDS_STATE_SIZE);
+	return send_state_word(context, config->tt_state);
 }
 
 /* Unused function that sets all relays and then unsets all relays
@@ -376,21 +354,25 @@ static void fun_with_relays(sds_context *context)
  * given context. Returns 0 on success. */
 static sds_error initialize_device(sds_context *context)
 {
+	struct config *config;
 	sds_error err = SDS_ERROR_SUCCESS;
 
-	context->channel_active[0] = 0;
-	context->channel_active[1] = 0;
-	context->coupling[0] = 0;
-	context->coupling[1] = 0;
-	context->offset[0] = 0.0;
-	context->offset[1] = 0.0;
-	context->voltage[0] = SDS_10mV;
-	context->voltage[1] = SDS_10mV;
-	context->time = 0;
-	context->trigger_slope = 0;
-	context->trigger_mode = 0;
-
-	if ((err = control_transfer(context->device_handle,
+	if (!(config = config_edit(context)))
+		return SDS_ERROR_NO_MEM;
+	config->channel_active[0] = 0;
+	config->channel_active[1] = 0;
+	config->coupling[0] = 0;
+	config->coupling[1] = 0;
+	config->offset[0] = 0.0;
+	config->offset[1] = 0.0;
+	config->voltage[0] = SDS_10mV;
+	config->voltage[1] = SDS_10mV;
+	config->time = 0;
+	config->trigger_slope = 0;
+	config->trigger_mode = 0;
+	config_commit(context, config);
+
+	if ((err = control_transfer(context,
 				    SDS_BM_REQUEST_TYPE_OUT,
 				    SDS_REQUEST_RESET,
 				    0,
@@ -412,7 +394,7 @@ static sds_error initialize_device(sds_context *context)
 	if ((err = relay_set(context, ch2_coupling_relay, 0)))
 		return err;
 	/* Probably: Read config data here! */
-	if ((err = control_transfer(context->device_handle,
+	if ((err = control_transfer(context,
 				    SDS_BM_REQUEST_TYPE_OUT,
 				    SDS_REQUEST_RESET,
 				    0,
@@ -437,40 +419,174 @@ static sds_error initialize_device(sds_context *context)
 	return err;
 }
 
-/* Returns 0 if the dev is a SDS200A or 1 if it is not. */
-static int probe_usb_device(libusb_device *dev)
+/* Sends the offset of a channel to the device */
+static sds_error send_offset(sds_context *context, enum sds_channel channel, double offset)
 {
-	struct libusb_device_descriptor desc;
-	if (libusb_get_device_descriptor(dev, &desc) < 0)
-		return 1;
-	if (desc.idVendor == SDS_VENDOR_ID &&
-	    desc.idProduct == SDS_PRODUCT_ID)
-		return 0;
-	return 1;
+	unsigned char data[3];
+
+	/* This calculation might be horribly broken, but for now it seems to work. */
+	/* TODO */
+	unsigned int calc = ((1 << 11) / 2) + (unsigned int) (offset * ((1 << 11) / 2));
+	unsigned char *cdata = (unsigned char *) &calc;
+
+	switch (channel) {
+		/* TODO CH1 vs CH2 */
+		case SDS_CH1:
+			data[2] = 1;
+		case SDS_CH2:
+			data[2] = 0;
+	}
+
+	data[0] = cdata[0];
+	data[1] = cdata[1] & 0x0f;
+
+	/* XXX: Correct format? */
+	return control_transfer(context,
+				SDS_BM_REQUEST_TYPE_OUT,
+				SDS_REQUEST_OFFSET,
+				0x0,
+				0x0,
+				data,
+				sizeof(data),
+				SDS_DEFAULT_TIMEOUT);
 }
 
-sds_error sds_initialize(struct sds_device *device, sds_context **context)
+sds_error restore_device(sds_context *context)
 {
+	struct config *config;
+	int relays[6];
+	int switched = 0;
+	int i;
 	sds_error err = SDS_ERROR_SUCCESS;
-	if (!device || !context)
-		return SDS_ERROR_INVALID_PARAM;
-	*context = calloc(1, sizeof(*context));
+
+	/* The copy keeps setters out while restoring and is committed
+	 * unchanged afterwards, so frames read in between keep the older
+	 * version */
+	if (!(config = config_edit(context)))
+		return SDS_ERROR_NO_MEM;
+
+	/* Same mapping as in sds_set_voltage and sds_set_coupling */
+	relays[ch1_10_relay] = config->voltage[0] > SDS_100mV;
+	relays[ch1_100_relay] = config->voltage[0] > SDS_1V;
+	relays[ch1_coupling_relay] = config->coupling[0];
+	relays[ch2_10_relay] = config->voltage[1] > SDS_100mV;
+	relays[ch2_100_relay] = config->voltage[1] > SDS_1V;
+	relays[ch2_coupling_relay] = config->coupling[1];
+
+	if ((err = control_transfer(context,
+				    SDS_BM_REQUEST_TYPE_OUT,
+				    SDS_REQUEST_RESET,
+				    0,
+				    0,
+				    NULL,
+				    0,
+				    SDS_DEFAULT_TIMEOUT)))
+		goto restore_exit;
+
+	/* A freshly attached device has all relays released (which is what
+	 * initialize_device sets up the hard way). Only the deviating relays
+	 * are switched and they settle together. */
+	for (i = 0; i < 6; ++i) {
+		if (!relays[i])
+			continue;
+		if ((err = relay_send(context, i, 1)))
+			goto restore_exit;
+		switched = 1;
+	}
+	if (switched) {
+		usleep(context->relay_wait);
+		relay_flush(context);
+	}
+
+	if ((err = send_offset(context, SDS_CH1, config->offset[0])))
+		goto restore_exit;
+	if ((err = send_offset(context, SDS_CH2, config->offset[1])))
+		goto restore_exit;
+	if ((err = send_state_word(context, config->tt_state)))
+		goto restore_exit;
+
+	config_commit(context, config);
+	return SDS_ERROR_SUCCESS;
+
+restore_exit:
+	config_abort(context, config);
+	return err;
+}
+
+sds_error open_context(struct backend *backend, struct sds_device *device,
+		       sds_context **context)
+{
+	sds_error err = SDS_ERROR_SUCCESS;
+
+	*context = calloc(1, sizeof(**context));
 	if (!*context)
 		return SDS_ERROR_NO_MEM;
-	if ((err = convert_error(libusb_init(&(*context)->usb_context))))
+	(*context)->backend = backend;
+	(*context)->bus_no = device->bus_no;
+	(*context)->port_no = device->port_no;
+	if ((err = config_init(*context))) {
+		free(*context);
+		*context = NULL;
+		return err;
+	}
+	if ((err = log_init(*context)))
+		goto config_remove;
+	pthread_rwlock_init(&(*context)->handle_lock, NULL);
+	pthread_rwlock_init(&(*context)->capture_lock, NULL);
+	pthread_rwlock_init(&(*context)->recorder_lock, NULL);
+	if ((err = convert_error(backend->ops->open(backend, device, *context))))
 		goto context_remove;
-	if ((err = convert_error(libusb_open((libusb_device *) device->device_ptr,
-				 &(*context)->device_handle))))
-		goto libusb_deinit;
 	if ((err = initialize_device(*context)))
-		goto libusb_deinit;
+		goto device_close;
 	return err;
 
-libusb_deinit:
-	libusb_exit((*context)->usb_context);
+device_close:
+	backend->ops->close(*context);
 
 context_remove:
+	pthread_rwlock_destroy(&(*context)->handle_lock);
+	pthread_rwlock_destroy(&(*context)->capture_lock);
+	pthread_rwlock_destroy(&(*context)->recorder_lock);
+	log_destroy(*context);
+
+config_remove:
+	config_destroy(*context);
 	free(*context);
+	*context = NULL;
+	return err;
+}
+
+enum device_kind get_device_kind(struct sds_device *device)
+{
+	struct device_info *info = device->device_ptr;
+	return info ? info->kind : DEVICE_USB;
+}
+
+sds_error create_backend(struct sds_device *device, struct backend **backend)
+{
+	switch (get_device_kind(device)) {
+		case DEVICE_SIMULATED:
+			return sim_create(backend);
+		case DEVICE_REPLAYED:
+			return replay_create(backend);
+		default:
+			return usb_create(backend);
+	}
+}
+
+sds_error sds_initialize(struct sds_device *device, sds_context **context)
+{
+	struct backend *backend;
+	sds_error err = SDS_ERROR_SUCCESS;
+	if (!device || !context)
+		return SDS_ERROR_INVALID_PARAM;
+	if ((err = create_backend(device, &backend)))
+		return err;
+	if ((err = open_context(backend, device, context))) {
+		backend->ops->destroy(backend);
+		return err;
+	}
+	(*context)->owns_backend = 1;
 	return err;
 }
 
@@ -511,6 +627,7 @@ sds_error sds_get_devices(struct sds_device_list **ulist)
 		if (!probe_usb_device(list[i])) {
 			struct sds_device *more_devices;
 			struct sds_device *current;
+			struct device_info *info;
 			unsigned int new_size = dev_count + 1;
 			more_devices = realloc(devices,
 					       new_size * sizeof(*devices));
@@ -519,10 +636,16 @@ sds_error sds_get_devices(struct sds_device_list **ulist)
 				goto error_handling;
 			}
 			devices = more_devices;
+			info = calloc(1, sizeof(*info));
+			if (!info) {
+				err = SDS_ERROR_NO_MEM;
+				goto error_handling;
+			}
+			info->kind = DEVICE_USB;
 			current = &devices[dev_count];
 			current->bus_no = libusb_get_bus_number(list[i]);
 			current->port_no = libusb_get_port_number(list[i]);
-			current->device_ptr = list[i];
+			current->device_ptr = info;
 			dev_count = new_size;
 		}
 	}
@@ -543,7 +666,7 @@ sds_error sds_get_devices(struct sds_device_list **ulist)
 	err = SDS_ERROR_NO_DEVICE;
 
 error_handling:
-	free(devices);
+	free_device_array(devices, dev_count);
 	libusb_free_device_list(list, 1);
 
 function_exit:
@@ -556,10 +679,12 @@ void sds_free_devices(struct sds_device_list *device_list)
 {
 	if (!device_list)
 		return;
-	libusb_free_device_list(
-		(libusb_device **) device_list->devices_ptr,
-		1);
-	free(device_list->array);
+	/* Lists of simulated devices have no libusb list */
+	if (device_list->devices_ptr)
+		libusb_free_device_list(
+			(libusb_device **) device_list->devices_ptr,
+			1);
+	free_device_array(device_list->array, device_list->size);
 	free(device_list);
 }
 
@@ -567,51 +692,72 @@ void sds_destroy(sds_context *c)
 {
 	if (!c)
 		return;
-	libusb_close(c->device_handle);
-	libusb_exit(c->usb_context);
+	disable_hotplug(c);
+	sds_stop_capture(c);
+	sds_stop_recording(c);
+	c->backend->ops->close(c);
+	if (c->owns_backend)
+		c->backend->ops->destroy(c->backend);
+	pthread_rwlock_destroy(&c->handle_lock);
+	pthread_rwlock_destroy(&c->capture_lock);
+	pthread_rwlock_destroy(&c->recorder_lock);
+	log_destroy(c);
+	config_destroy(c);
 	free(c);
 }
 
 sds_error sds_set_channel(sds_context *context, enum sds_channel channel, int on)
 {
+	struct config *config;
+
 	if (!context)
 		return SDS_ERROR_INVALID_PARAM;
+	if (!(config = config_edit(context)))
+		return SDS_ERROR_NO_MEM;
 
 	/* We currently do not know if the hardware supports channel activation
 	 * and deactivation. Therefore we just remember the user's choice.
 	 * XXX: Adjust? */
 	switch(channel) {
 		case SDS_CH1:
-			context->channel_active[0] = on;
+			config->channel_active[0] = on;
 			break;
 		case SDS_CH2:
-			context->channel_active[1] = on;
+			config->channel_active[1] = on;
 			break;
 	}
+	config_commit(context, config);
 	return SDS_ERROR_SUCCESS;
 }
 
 sds_error sds_get_channel(sds_context *context, enum sds_channel channel, int *on)
 {
+	const struct config *config;
+
 	if (!context || !on)
 		return SDS_ERROR_INVALID_PARAM;
 
+	config = config_read(context);
 	switch(channel) {
 		case SDS_CH1:
-			*on = context->channel_active[0];
+			*on = config->channel_active[0];
 			break;
 		case SDS_CH2:
-			*on = context->channel_active[1];
+			*on = config->channel_active[1];
 			break;
 	}
+	config_release(context);
 	return SDS_ERROR_SUCCESS;
 }
 
 sds_error sds_set_voltage(sds_context *context, enum sds_channel channel, enum sds_voltage voltage)
 {
+	struct config *config;
 	sds_error err = SDS_ERROR_SUCCESS;
 	if (!context)
 		return SDS_ERROR_INVALID_PARAM;
+	if (!(config = config_edit(context)))
+		return SDS_ERROR_NO_MEM;
 
 	/* We currently do not know if it is possible to adjust the voltage scale
 	 * other than setting the relays. Therefore we just set them.
@@ -627,7 +773,7 @@ sds_error sds_set_voltage(sds_context *context, enum sds_channel channel, enum s
 						       ch1_10_relay,
 						       (voltage <= SDS_1V) ? 0 : 1,
 						       ch1_100_relay)))
-				context->voltage[0] = voltage;
+				config->voltage[0] = voltage;
 			break;
 		case SDS_CH2:
 			if (!(err = set_voltage_relays(context,
@@ -635,139 +781,165 @@ sds_error sds_set_voltage(sds_context *context, enum sds_channel channel, enum s
 						       ch2_10_relay,
 						       (voltage <= SDS_1V) ? 0 : 1,
 						       ch2_100_relay)))
-				context->voltage[1] = voltage;
+				config->voltage[1] = voltage;
 			break;
 	}
+
+	if (err)
+		config_abort(context, config);
+	else
+		config_commit(context, config);
 	return err;
 }
 
 sds_error sds_get_voltage(sds_context *context, enum sds_channel channel, enum sds_voltage *voltage)
 {
+	const struct config *config;
+
 	if (!context || !voltage)
 		return SDS_ERROR_INVALID_PARAM;
 
+	config = config_read(context);
 	switch(channel) {
 		case SDS_CH1:
-			*voltage = context->voltage[0];
+			*voltage = config->voltage[0];
 			break;
 		case SDS_CH2:
-			*voltage = context->voltage[1];
+			*voltage = config->voltage[1];
 			break;
 	}
+	config_release(context);
 	return SDS_ERROR_SUCCESS;
 }
 
 sds_error sds_set_coupling(sds_context *context, enum sds_channel channel, int on)
 {
+	struct config *config;
 	sds_error err = SDS_ERROR_SUCCESS;
 	if (!context)
 		return SDS_ERROR_INVALID_PARAM;
+	if (!(config = config_edit(context)))
+		return SDS_ERROR_NO_MEM;
 
 	switch(channel) {
 		case SDS_CH1:
 			if ((err = relay_set(context, ch1_coupling_relay, on)))
-				return err;
-			context->coupling[0] = on;
+				break;
+			config->coupling[0] = on;
 			break;
 		case SDS_CH2:
 			if ((err = relay_set(context, ch2_coupling_relay, on)))
-				return err;
-			context->coupling[1] = on;
+				break;
+			config->coupling[1] = on;
 			break;
 	}
+
+	if (err)
+		config_abort(context, config);
+	else
+		config_commit(context, config);
 	return err;
 }
 
 sds_error sds_get_coupling(sds_context *context, enum sds_channel channel, int *on)
 {
+	const struct config *config;
+
 	if (!context || !on)
 		return SDS_ERROR_INVALID_PARAM;
 
+	config = config_read(context);
 	switch(channel) {
 		case SDS_CH1:
-			*on = context->coupling[0];
+			*on = config->coupling[0];
 			break;
 		case SDS_CH2:
 			break;
-			*on = context->coupling[0];
+			*on = config->coupling[0];
 	}
+	config_release(context);
 	return SDS_ERROR_SUCCESS;
 }
 
 sds_error sds_set_time(sds_context *context, enum sds_time time)
 {
+	struct config *config;
+	sds_error err;
+
 	if (!context)
 		return SDS_ERROR_INVALID_PARAM;
-	return change_time(context, time);
+	if (!(config = config_edit(context)))
+		return SDS_ERROR_NO_MEM;
+
+	if ((err = change_time(context, config, time))) {
+		config_abort(context, config);
+		return err;
+	}
+	config->time = time;
+	config_commit(context, config);
+	/* Frames of the old setting tell nothing about the new one */
+	timing_reset(context);
+	return SDS_ERROR_SUCCESS;
 }
 
 sds_error sds_get_time(sds_context *context, enum sds_time *time)
 {
 	if (!context || !time)
 		return SDS_ERROR_INVALID_PARAM;
-	*time = context->time;
+	*time = config_read(context)->time;
+	config_release(context);
 	return SDS_ERROR_SUCCESS;
 }
 
 sds_error sds_set_offset(sds_context *context, enum sds_channel channel, double offset)
 {
-	unsigned char data[3];
+	struct config *config;
 	sds_error error;
 
-	/* This calculation might be horribly broken, but for now it seems to work. */
-	/* TODO */
-	unsigned int calc = ((1 << 11) / 2) + (unsigned int) (offset * ((1 << 11) / 2));
-	unsigned char *cdata = (unsigned char *) &calc;
-
 	if (!context)
 		return SDS_ERROR_INVALID_PARAM;
+	if (!(config = config_edit(context)))
+		return SDS_ERROR_NO_MEM;
 
-	switch (channel) {
-		/* TODO CH1 vs CH2 */
-		case SDS_CH1:
-			data[2] = 1;
-		case SDS_CH2:
-			data[2] = 0;
+	/* Remember it for sds_get_offset and for restoring the device */
+	if ((error = send_offset(context, channel, offset))) {
+		config_abort(context, config);
+		return error;
 	}
-
-	data[0] = cdata[0];
-	data[1] = cdata[1] & 0x0f;
-
-	/* XXX: Correct format? */
-	error = control_transfer(context->device_handle,
-				 SDS_BM_REQUEST_TYPE_OUT,
-				 SDS_REQUEST_OFFSET,
-				 0x0,
-				 0x0,
-				 data,
-				 sizeof(data),
-				 SDS_DEFAULT_TIMEOUT);
-
+	config->offset[(channel == SDS_CH1) ? 0 : 1] = offset;
+	config_commit(context, config);
 	return error;
 }
 
 sds_error sds_get_offset(sds_context *context, enum sds_channel channel, double *offset)
 {
+	const struct config *config;
+
 	if (!context || !offset)
 		return SDS_ERROR_INVALID_PARAM;
 
+	config = config_read(context);
 	switch(channel) {
 		case SDS_CH1:
-			*offset = context->offset[0];
+			*offset = config->offset[0];
 			break;
 		case SDS_CH2:
-			*offset = context->offset[1];
+			*offset = config->offset[1];
 			break;
 	}
+	config_release(context);
 	return SDS_ERROR_SUCCESS;
 }
 
 sds_error sds_set_trigger_source(sds_context *context, enum sds_channel channel)
 {
+	struct config *config;
 	sds_error err;
 
 	if (!context || !channel)
 		return SDS_ERROR_INVALID_PARAM;
+	if (!(config = config_edit(context)))
+		return SDS_ERROR_NO_MEM;
 
 	/* in the 16th byte, the second bit from the right endcodes the channel */
 	switch (channel) {
@@ -775,22 +947,24 @@ sds_error sds_set_trigger_source(sds_context *context, enum sds_channel channel)
 		case SDS_CH1:
 			/* Mask: 11111101 = 0xfd */
 			/* == 0 : ch1 */
-			context->tt_state[15] &= 0xfd;
+			config->tt_state[15] &= 0xfd;
 			break;
 		case SDS_CH2:
 			/* Mask: 00000010 = 0x2 */
 			/* == 1 : ch2 */
-			context->tt_state[15] |= 0x2;
+			config->tt_state[15] |= 0x2;
 			break;
 	}
 
-	err = send_state_word(context);
+	err = send_state_word(context, config->tt_state);
 
 	if (err != SDS_ERROR_SUCCESS) {
+		config_abort(context, config);
 		return err;
 	}
 
-	context->trigger = channel;
+	config->trigger = channel;
+	config_commit(context, config);
 	return SDS_ERROR_SUCCESS;
 }
 
@@ -798,16 +972,20 @@ sds_error sds_get_trigger_source(sds_context *context, enum sds_channel *channel
 {
 	if (!context || !channel)
 		return SDS_ERROR_INVALID_PARAM;
-	*channel = context->trigger;
+	*channel = config_read(context)->trigger;
+	config_release(context);
 	return SDS_ERROR_SUCCESS;
 }
 
 sds_error sds_set_trigger_slope(sds_context *context, enum sds_trigger_slope slope)
 {
+	struct config *config;
 	sds_error err;
 
 	if (!context)
 		return SDS_ERROR_INVALID_PARAM;
+	if (!(config = config_edit(context)))
+		return SDS_ERROR_NO_MEM;
 
 	/* in the 16th byte, the first bit from the right endcode the slope:
 	 * Mask: 00000001 = 0x1 */
@@ -816,22 +994,24 @@ sds_error sds_set_trigger_slope(sds_context *context, enum sds_trigger_slope slo
 		case SDS_RISING:
 			/* at the 16th byte, the first bit from the right should be 0
 			 * Mask: 11111110 = 0xfe */
-			context->tt_state[15] &= 0xfe;
+			config->tt_state[15] &= 0xfe;
 			break;
 		case SDS_FALLING:
 			/* at the 16th byte, the first bit from the right should be 1
 			 * Mask: 00000001 = 0x01 */
-			context->tt_state[15] |= 0x01;
+			config->tt_state[15] |= 0x01;
 			break;
 	}
 
-	err = send_state_word(context);
+	err = send_state_word(context, config->tt_state);
 
 	if (err != SDS_ERROR_SUCCESS) {
+		config_abort(context, config);
 		return err;
 	}
 
-	context->trigger_slope = slope;
+	config->trigger_slope = slope;
+	config_commit(context, config);
 	return SDS_ERROR_SUCCESS;
 }
 
@@ -839,38 +1019,44 @@ sds_error sds_get_trigger_slope(sds_context *context, enum sds_trigger_slope *sl
 {
 	if (!context || !slope)
 		return SDS_ERROR_INVALID_PARAM;
-	*slope = context->trigger_slope;
+	*slope = config_read(context)->trigger_slope;
+	config_release(context);
 	return SDS_ERROR_SUCCESS;
 }
 
 sds_error sds_set_trigger_mode(sds_context *context, enum sds_trigger_mode mode)
 {
+	struct config *config;
 	sds_error err;
 
 	if (!context)
 		return SDS_ERROR_INVALID_PARAM;
+	if (!(config = config_edit(context)))
+		return SDS_ERROR_NO_MEM;
 
 	switch (mode) {
 		/* TODO: Check CH1 vs CH2 */
 		case SDS_NORMAL:
 			/* at the 20th byte, the most significant bit should be 1
 			 * Mask: 10000000 = 0x8 */
-			context->tt_state[19] |= 0x8;
+			config->tt_state[19] |= 0x8;
 			break;
 		case SDS_AUTOMATIC:
 			/* at the 20th byte, the most significant bit should be 0
 			 * Mask: 01111111 = 0x7f */
-			context->tt_state[19] &= 0x7f;
+			config->tt_state[19] &= 0x7f;
 			break;
 	}
 
-	err = send_state_word(context);
+	err = send_state_word(context, config->tt_state);
 
 	if (err != SDS_ERROR_SUCCESS) {
+		config_abort(context, config);
 		return err;
 	}
 
-	context->trigger_mode = mode;
+	config->trigger_mode = mode;
+	config_commit(context, config);
 	return SDS_ERROR_SUCCESS;
 }
 
@@ -878,7 +1064,8 @@ sds_error sds_get_trigger_mode(sds_context *context, enum sds_trigger_mode *mode
 {
 	if (!context || !mode)
 		return SDS_ERROR_INVALID_PARAM;
-	*mode = context->trigger_mode;
+	*mode = config_read(context)->trigger_mode;
+	config_release(context);
 	return SDS_ERROR_SUCCESS;
 }
 
@@ -1006,7 +1193,6 @@ sds_error sds_get_calibration(sds_context *context, struct sds_calibration *cali
 	if (!context || !calibration)
 		return SDS_ERROR_INVALID_PARAM;
 	calibration->zero1 = context->zero[0];
-	printf("%f\n", calibration->zero1);
 	calibration->zero2 = context->zero[1];
 	calibration->uv_per_tick1 = context->uv_per_tick[0];
 	calibration->uv_per_tick2 = context->uv_per_tick[1];
@@ -1041,7 +1227,7 @@ static sds_error data_available(struct sds_context *context, unsigned char *data
 	/* This request returns an number > 0 in data if the next bulk read will
 	 * not block (as data is available)
 	 */
-	return control_transfer(context->device_handle,
+	return control_transfer(context,
 			        SDS_BM_REQUEST_TYPE_IN,
 			        SDS_REQUEST_DATA_AVAILABLE,
 			        0,
@@ -1057,31 +1243,44 @@ static sds_error read_data(struct sds_context *context, unsigned char *data, uns
 	sds_error err = SDS_ERROR_SUCCESS;
 	int libusb_error;
 	int transferred; /* TODO: autoadjust */
+	uint64_t start = get_time_ns();
 
 	err = data_available(context, &dataavail);
 	if (err)
 		return err;
+	stats_poll(context, start, dataavail);
 
-	/* printf(" %d", dataavail); */
 	if (dataavail) {
-		libusb_error = libusb_bulk_transfer(context->device_handle,
-						    SDS_ENDPOINT_BULK_IN,
-						    data,
-						    *length,
-						    &transferred,
-						    SDS_DEFAULT_TIMEOUT);
+		start = get_time_ns();
+		TRACE(bulk__start, SDS_ENDPOINT_BULK_IN, *length);
+		libusb_error = context->backend->ops->bulk_in(context,
+							     SDS_ENDPOINT_BULK_IN,
+							     data,
+							     *length,
+							     &transferred,
+							     SDS_DEFAULT_TIMEOUT);
 
 		if (libusb_error) {
-			printf("USB error: %s, %d\n", libusb_strerror(libusb_error), dataavail);
+			stats_error(context, convert_error(libusb_error));
+			if (capture_enabled(context))
+				capture_bulk(context, start, get_time_ns(),
+					     SDS_ENDPOINT_BULK_IN, data,
+					     convert_error(libusb_error));
+			TRACE(bulk__done, SDS_ENDPOINT_BULK_IN,
+			      convert_error(libusb_error), get_time_ns() - start);
+			log_write(context, LOG_BULK_FAILED,
+				  convert_error(libusb_error), dataavail);
 			return convert_error(libusb_error);
 		}
 
 		*length = transferred;
+		stats_frame(context, start, get_time_ns(), transferred);
+		if (capture_enabled(context))
+			capture_bulk(context, start, get_time_ns(),
+				     SDS_ENDPOINT_BULK_IN, data, transferred);
+		TRACE(bulk__done, SDS_ENDPOINT_BULK_IN, transferred,
+		      get_time_ns() - start);
 		/* TODO: Parse values */
-		/* Debugging:
-		printf("\r %04u %04u",  decode_data(data[8], data[9]), decode_data(data[10], data[11]));
-		fflush(stdout);
-		*/
 	} else {
 		*length = 0;
 	}
@@ -1099,17 +1298,29 @@ sds_error sds_get_data(sds_context *context, char *data, size_t length, size_t *
 	}
 }
 
-sds_error sds_get_raw_data(sds_context *context, struct sds_samples **data, size_t *written)
+unsigned int get_frame_size(enum sds_time time)
 {
-	unsigned int size;
-	sds_error err;
-
-	/* Select the appropriate size for the current time/div setting */
-	switch(context->time)
+	/* Select the appropriate size for the time/div setting */
+	switch(time)
 	{
 		default:
-			size = 8192;
+			return 8192;
 	}
+}
+
+/* Reads one frame with the current configuration. The settings of the
+ * configuration and the arrival time are stored in settings and timestamp. */
+static sds_error read_frame(sds_context *context, struct sds_samples **data, size_t *written, struct frame_settings *settings, uint64_t *timestamp)
+{
+	const struct config *config;
+	unsigned int size;
+	uint64_t stalled;
+	sds_error err;
+
+	config = config_read(context);
+	size = get_frame_size(config->time);
+	record_settings(config, settings);
+	config_release(context);
 
 	/* Allocate memory to store the buffers */
 	*data = malloc(size);
@@ -1119,12 +1330,25 @@ sds_error sds_get_raw_data(sds_context *context, struct sds_samples **data, size
 	}
 
 	/* Read the data */
-	if ((err = read_data(context, (unsigned char *) *data, &size)) || size == 0) {
+	if ((err = read_data(context, (unsigned char *) *data, &size))) {
+		goto get_raw_free_buffer;
+	}
+	if (size == 0) {
+		/* No data yet, unless the device does not announce any more */
+		stalled = timing_stalled(context, settings->time, get_time_ns());
+		if (stalled) {
+			stats_error(context, SDS_ERROR_TIMEOUT);
+			log_write(context, LOG_STALLED, 0, stalled / 1000000);
+			err = SDS_ERROR_TIMEOUT;
+		}
 		goto get_raw_free_buffer;
 	}
+	*timestamp = get_time_ns();
+	timing_frame(context, *timestamp);
 
 	/* Do not report negative sizes */
 	if (size < sizeof((*data)->unknown_padding)) {
+		log_write(context, LOG_SHORT_FRAME, size, 0);
 		err = SDS_ERROR_IO;
 		goto get_raw_free_buffer;
 	}
@@ -1133,6 +1357,8 @@ sds_error sds_get_raw_data(sds_context *context, struct sds_samples **data, size
 	/* The actual size of the samples is 2 bytes */
 	*written /= sizeof((*data)->samples[0]);
 
+	if (recording_enabled(context))
+		record_frame(context, settings, 0, *timestamp, *data, *written);
 	return SDS_ERROR_SUCCESS;
 
 get_raw_free_buffer:
@@ -1143,6 +1369,40 @@ get_raw_free_buffer:
 	return err;
 }
 
+sds_error sds_get_raw_data(sds_context *context, struct sds_samples **data, size_t *written)
+{
+	struct frame_settings settings;
+	uint64_t timestamp;
+
+	return read_frame(context, data, written, &settings, &timestamp);
+}
+
+sds_error sds_get_frame(sds_context *context, struct sds_frame **frame)
+{
+	struct sds_frame *result;
+	struct frame_settings settings;
+	sds_error err;
+
+	if (!context || !frame)
+		return SDS_ERROR_INVALID_PARAM;
+
+	*frame = NULL;
+	result = malloc(sizeof(*result));
+	if (!result)
+		return SDS_ERROR_NO_MEM;
+
+	if ((err = read_frame(context, &result->data, &result->count,
+			      &settings, &result->timestamp)) ||
+	    !result->data) {
+		free(result);
+		return err;
+	}
+	result->device = 0;
+	result->config_version = settings.version;
+	*frame = result;
+	return SDS_ERROR_SUCCESS;
+}
+
 sds_error sds_decode_to_raw(sds_context *context, uint16_t sample, uint16_t *advalue) {
 	if (context == NULL || advalue == NULL) {
 		return SDS_ERROR_INVALID_PARAM;
@@ -1158,6 +1418,23 @@ sds_error sds_decode_to_raw(sds_context *context, uint16_t sample, uint16_t *adv
 	return SDS_ERROR_SUCCESS;
 }
 
+sds_error sds_decode_samples(sds_context *context, const struct sds_samples *data, size_t count, uint16_t *advalues)
+{
+	uint64_t start;
+
+	/* The context is optional, the decoding does not depend on the
+	 * device */
+	(void) context;
+	if (data == NULL || advalues == NULL) {
+		return SDS_ERROR_INVALID_PARAM;
+	}
+	start = TRACE_START(decode__done);
+	TRACE(decode__start, count);
+	decode_samples(data, count, advalues);
+	TRACE(decode__done, count, get_time_ns() - start);
+	return SDS_ERROR_SUCCESS;
+}
+
 sds_error sds_decode_to_volt(sds_context *context, uint16_t sample, double *voltage)
 {
 	uint16_t advalue;
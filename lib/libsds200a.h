@@ -16,6 +16,9 @@
  * (c) 2014 Simon Schuster, Sebastian Rachuj
  */
 
+#ifndef LIBSDS200A_H
+#define LIBSDS200A_H
+
 #include <stddef.h>
 #include <stdint.h>
 
@@ -24,6 +27,17 @@
  */
 typedef struct sds_context sds_context;
 
+/*!
+ * Represents a group of oscilloscopes whose data is acquired by one common
+ * event thread.
+ */
+typedef struct sds_group sds_group;
+
+/*!
+ * Represents a recording of frames opened for reading.
+ */
+typedef struct sds_recording sds_recording;
+
 /*!
  * Represents a list of devices.
  */
@@ -44,6 +58,40 @@ struct sds_device
         void *device_ptr; /*!< An opaque pointer to internal data. Do not modify! */
 };
 
+/*!
+ * The signals a simulated device can produce.
+ */
+enum sds_waveform
+{
+	SDS_SINE = 1, /*!< Sine wave */
+	SDS_SQUARE, /*!< Square wave with a duty cycle of 50% */
+	SDS_NOISE, /*!< Uniformly distributed noise */
+};
+
+/*!
+ * Describes the signals at the inputs of a simulated device.
+ */
+struct sds_simulation
+{
+	enum sds_waveform waveform[2]; /*!< The signals of both channels */
+	double frequency[2]; /*!< The frequencies of both signals in Hz */
+	double amplitude[2]; /*!< The amplitudes of both signals in V */
+	int realtime; /*!< true -> frames arrive at the rate of a real device,
+			   false -> as fast as possible */
+};
+
+/*!
+ * Describes the replay of a recorded trace.
+ */
+struct sds_replay
+{
+	const char *path; /*!< The path of a USBPcap or usbmon trace of a
+			       real device */
+	int realtime; /*!< true -> with the original timing,
+			   false -> as fast as possible */
+	int loop; /*!< true -> start over at the end of the trace */
+};
+
 /*!
  * This represents the calibration of the device (as known in software). Except
  * for saving the current settings, this should not be interesting for user.
@@ -77,6 +125,97 @@ struct __attribute__((packed)) sds_samples
 	uint16_t samples[];
 };
 
+/*!
+ * Represents one frame that was acquired by a device group.
+ */
+struct sds_frame
+{
+	unsigned int device; /*!< The index of the device within the group */
+	uint64_t timestamp; /*!< Completion time of the transfer in nanoseconds
+				 (CLOCK_MONOTONIC) */
+	uint64_t config_version; /*!< The configuration version the frame was
+				      captured under (see
+				      sds_get_config_version()) */
+	size_t count; /*!< The amount of samples in data */
+	struct sds_samples *data; /*!< The raw data as returned by the device */
+};
+
+/*!
+ * Represents frames of all devices of a synchronized group that were
+ * captured at (almost) the same time.
+ */
+struct sds_frame_set
+{
+	uint64_t timestamp; /*!< Mean of the latency corrected timestamps of the
+				 frames in nanoseconds (CLOCK_MONOTONIC) */
+	uint64_t skew; /*!< Distance between the earliest and the latest latency
+			    corrected timestamp in nanoseconds (the residual
+			    misalignment) */
+	uint64_t raw_skew; /*!< Distance between the earliest and the latest
+				uncorrected timestamp in nanoseconds */
+	unsigned int count; /*!< The amount of frames (equals the devices of
+				 the group) */
+	struct sds_frame *frames[]; /*!< One frame per device, ordered by the
+					 device index */
+};
+
+/*!
+ * The maximum amount of devices in a synchronized group.
+ */
+#define SDS_GROUP_MAX_DEVICES 16
+
+/*!
+ * The amount of buckets of the latency histograms in struct sds_stats.
+ * Bucket 0 counts durations below 1us, bucket i > 0 durations of
+ * [2^(i-1), 2^i) us and the last bucket all longer durations.
+ */
+#define SDS_STATS_BUCKETS 32
+
+/*!
+ * Counters of the transfers of a context (see sds_get_stats()).
+ */
+struct sds_stats
+{
+	uint64_t control_transfers; /*!< Control transfers including the polls */
+	uint64_t bulk_transfers; /*!< Successful bulk transfers */
+	uint64_t bulk_bytes; /*!< Bytes received by the bulk transfers */
+	uint64_t empty_polls; /*!< 0xc0 polls that reported no data */
+	uint64_t timeouts; /*!< Transfers that timed out */
+	uint64_t overflows; /*!< Transfers that overflowed */
+	uint64_t errors; /*!< Transfers that failed for other reasons */
+	uint64_t dropped_frames; /*!< Received frames that were thrown away
+				      (full queues, lack of memory or lack of
+				      partners in synchronized groups) */
+	uint64_t poll_latency[SDS_STATS_BUCKETS]; /*!< Time from the first poll
+						       until the data of a frame
+						       was received */
+	uint64_t transfer_latency[SDS_STATS_BUCKETS]; /*!< Duration of the bulk
+							   transfers */
+};
+
+/*!
+ * Describes how well the frames of a synchronized group are aligned.
+ */
+struct sds_skew_report
+{
+	unsigned int devices; /*!< The amount of devices in the group */
+	uint64_t sets; /*!< The amount of frame sets delivered so far */
+	uint64_t discarded; /*!< Frames discarded for lack of partners */
+	uint64_t arm_skew; /*!< Time between arming the first and the last device
+				in nanoseconds */
+	double mean_skew; /*!< Mean skew of the delivered sets in nanoseconds
+			       (after the latency correction) */
+	uint64_t max_skew; /*!< Maximum skew of the delivered sets in nanoseconds
+				(after the latency correction) */
+	double mean_raw_skew; /*!< Mean uncorrected skew of the delivered sets
+				   in nanoseconds */
+	uint64_t max_raw_skew; /*!< Maximum uncorrected skew of the delivered
+				    sets in nanoseconds */
+	double offset[SDS_GROUP_MAX_DEVICES]; /*!< Estimated latency of each
+						   device relative to the mean of
+						   all devices in nanoseconds */
+};
+
 /*!
  * Represents a probe channel.
  */
@@ -160,6 +299,85 @@ enum sds_trigger_mode
 			    (automatically trigger even if there was no trigger event) */
 };
 
+/*!
+ * Represents the formats frames are recorded in.
+ */
+enum sds_record_format
+{
+	SDS_RECORD_RAW = 0, /*!< The samples as returned by the device */
+	SDS_RECORD_PACKED, /*!< The packed format of sds_pack_samples() */
+	SDS_RECORD_COMPRESSED, /*!< The compressed format of
+				    sds_compress_samples() */
+};
+
+/*!
+ * Represents one frame of a recording (see sds_recording_get_frame()).
+ */
+struct sds_recorded_frame
+{
+	unsigned int device; /*!< The index of the device within its group (0
+				  for a single device) */
+	uint64_t timestamp; /*!< Completion time of the transfer in nanoseconds
+				 (CLOCK_MONOTONIC of the recording host) */
+	uint64_t realtime; /*!< The timestamp converted to CLOCK_REALTIME */
+	uint64_t config_version; /*!< The configuration version the frame was
+				      captured under */
+	enum sds_time time; /*!< The time/div setting */
+	enum sds_voltage voltage[2]; /*!< The voltage/div of both channels */
+	double offset[2]; /*!< The voltage offsets of both channels */
+	size_t count; /*!< The amount of samples */
+	enum sds_record_format format; /*!< The format of the samples */
+	const struct sds_samples *data; /*!< The raw data (NULL unless the
+					     format is SDS_RECORD_RAW) */
+	const uint8_t *encoded; /*!< The samples in their format (the same
+				     as data for SDS_RECORD_RAW) */
+	size_t encoded_size; /*!< The size of encoded in bytes */
+};
+
+/*!
+ * Represents events that are delivered to the application asynchronously.
+ */
+enum sds_event
+{
+	SDS_EVENT_DISCONNECTED = 1, /*!< The device was detached. All calls fail
+					 with SDS_ERROR_NO_DEVICE until it is
+					 attached again. */
+	SDS_EVENT_RECONNECTED, /*!< The device was attached again and its state
+				    was restored. The relays settle together,
+				    so the restore takes about 0.5 s. It
+				    publishes a new configuration version,
+				    frames with an older version were read
+				    while the device was being restored. */
+	SDS_EVENT_RECONNECT_FAILED, /*!< The device was attached again, but
+					 could not be opened or restored. */
+};
+
+/*!
+ * A function that is called on asynchronous events of a context.
+ *
+ * \param context   The context the event belongs to
+ * \param event     The event that occured
+ * \param user_data The pointer passed to sds_set_event_callback()
+ */
+typedef void (*sds_event_callback)(sds_context *context, enum sds_event event, void *user_data);
+
+/*!
+ * Represents the flags that can be passed to sds_group_create().
+ */
+enum sds_group_flags
+{
+	SDS_GROUP_MERGED = 1, /*!< Deliver the frames of all devices into one
+				   common queue (read with SDS_GROUP_ANY) */
+	SDS_GROUP_SYNCHRONIZED = 2, /*!< Align the frames of all devices in time
+					 (see sds_group_get_frame_set()). Can
+					 not be combined with SDS_GROUP_MERGED. */
+};
+
+/*!
+ * Selects the merged queue of a group in sds_group_get_frame().
+ */
+#define SDS_GROUP_ANY ((unsigned int) -1)
+
 /*!
  * Represents an error code.
  */
@@ -229,6 +447,44 @@ sds_error sds_get_devices(struct sds_device_list **list);
  */
 void sds_free_devices(struct sds_device_list *device_list);
 
+/*!
+ * Obtains an array of simulated oscilloscopes.
+ *
+ * A simulated device understands the same requests as a real one and
+ * delivers frames of synthetic signals in the format of the device. It is
+ * opened by sds_initialize() or sds_group_create() like a real device, but
+ * real and simulated devices cannot be mixed within a group.
+ *
+ * \param simulation The signals of the devices
+ * \param count      The amount of devices
+ * \param [out] list After the call, the pointer referenced by the list
+ *                   parameter will be set to an malloced sds_device_list. It
+ *                   has to be freed via sds_free_devices() after usage.
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_get_simulated_devices(const struct sds_simulation *simulation, unsigned int count, struct sds_device_list **list);
+
+/*!
+ * Obtains an array of devices that replay recorded traces.
+ *
+ * A replayed device serves the recorded answers of the 0xc0 requests and
+ * the recorded bulk data of the first oscilloscope in a USBPcap or Linux
+ * usbmon trace (link types 249, 189 and 220). All other requests are
+ * accepted without being compared to the trace. At the end of a trace that
+ * does not loop, no more data is available.
+ *
+ * \param replays    The traces, one per device
+ * \param count      The amount of devices
+ * \param [out] list After the call, the pointer referenced by the list
+ *                   parameter will be set to an malloced sds_device_list. It
+ *                   has to be freed via sds_free_devices() after usage.
+ *
+ * \return An error value to indicate the success. Errors in the traces are
+ *         reported by sds_initialize() or sds_group_create().
+ */
+sds_error sds_get_replay_devices(const struct sds_replay *replays, unsigned int count, struct sds_device_list **list);
+
 /*!
  * Frees the ressources of an sds_context.
  *
@@ -238,6 +494,34 @@ void sds_free_devices(struct sds_device_list *device_list);
  */
 void sds_destroy(sds_context *context);
 
+/*!
+ * Sets the function that is called on asynchronous events (e.g. when the
+ * device is detached).
+ *
+ * \remark The callback is called from an internal thread of the library.
+ *
+ * \param context   The device context
+ * \param callback  The function to be called or NULL to receive no events.
+ * \param user_data A pointer that is passed to the callback.
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_set_event_callback(sds_context *context, sds_event_callback callback, void *user_data);
+
+/*!
+ * Enables the handling of hotplug events. When the device is detached, it is
+ * reopened automatically as soon as it is attached again (at the same
+ * port). Its configuration is then restored from the state stored in
+ * software, without replaying the complete initialization.
+ *
+ * \remark Contexts that belong to a device group are not supported.
+ *
+ * \param context The device context
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_enable_hotplug(sds_context *context);
+
 /*!
  * Activates or deactivates a channel.
  *
@@ -331,6 +615,23 @@ sds_error sds_set_time(sds_context *context, enum sds_time time);
  */
 sds_error sds_get_time(sds_context *context, enum sds_time *time);
 
+/*!
+ * Returns the expected interval between two frames.
+ *
+ * The interval follows from the time/div setting (a frame covers ten
+ * divisions) and from the observed arrival of frames, whichever is larger.
+ * A device that announces no data for three intervals is considered
+ * stalled. The interval may be used to choose the timeout of blocking waits
+ * like sds_group_get_frame().
+ *
+ * \param context        The device context
+ * \param [out] interval A pointer to a variable that will contain the
+ *                       interval in nanoseconds
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_get_frame_interval(sds_context *context, uint64_t *interval);
+
 /*!
  * Sets the voltage offset.
  *
@@ -418,6 +719,193 @@ sds_error sds_set_trigger_mode(sds_context *context, enum sds_trigger_mode mode)
  */
 sds_error sds_get_trigger_mode(sds_context *context, enum sds_trigger_mode *mode);
 
+/*!
+ * Returns the version of the current configuration.
+ *
+ * Every successful setter increments the version. The setters and the data
+ * acquisition may be used from different threads at the same time.
+ *
+ * \param context       The device context
+ * \param [out] version A pointer to a variable that will contain the version
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_get_config_version(sds_context *context, uint64_t *version);
+
+/*!
+ * Returns the counters of the transfers of a context.
+ *
+ * Counting is always enabled and does not slow down the acquisition. The
+ * counters are read one by one, so the snapshot is not taken atomically if
+ * transfers run at the same time. Use sds_group_get_context() to obtain the
+ * counters of a device of a group.
+ *
+ * \param context     The device context
+ * \param [out] stats A pointer to a struct that will contain the counters
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_get_stats(sds_context *context, struct sds_stats *stats);
+
+/*!
+ * Sets all counters of a context to zero.
+ *
+ * \param context The device context
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_reset_stats(sds_context *context);
+
+/*!
+ * Writes the log of a context as text to a file descriptor.
+ *
+ * The library records failed transfers, dropped frames and hotplug events
+ * in a ring buffer per context. Recording does not block and is always
+ * enabled, the entries are only formatted by this function. Every call
+ * writes the entries that were added since the last call. If the ring
+ * overflowed in between, the amount of lost entries is written instead of
+ * the oldest ones.
+ *
+ * The log may be dumped from any thread (e.g. periodically from a thread
+ * of the application) while the device is in use.
+ *
+ * \param context The device context
+ * \param fd      The file descriptor the lines are written to
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_dump_log(sds_context *context, int fd);
+
+/*!
+ * Starts to record all transfers of a context into a pcap file.
+ *
+ * The file uses the format of USBPcap (link type 249), so it can be
+ * processed by the tools and replayed by sds_get_replay_devices(). The
+ * packets are written by a background thread. If the disk does not keep
+ * up, transfers are left out of the file (see sds_dump_log()).
+ *
+ * \param context The device context
+ * \param path    The path of the file, which is overwritten
+ *
+ * \return An error value to indicate the success. SDS_ERROR_BUSY if the
+ *         context is captured already.
+ */
+sds_error sds_start_capture(sds_context *context, const char *path);
+
+/*!
+ * Stops the recording of the transfers of a context and closes the file.
+ *
+ * Waits until all recorded transfers are written. Destroying the context
+ * stops the capture as well.
+ *
+ * \param context The device context
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_stop_capture(sds_context *context);
+
+/*!
+ * Starts to record the frames of a context into segment files.
+ *
+ * The frames acquired by sds_get_frame(), sds_get_raw_data() or the group
+ * the context belongs to are stored together with their timestamp and
+ * the time/div, voltage/div and offsets they were captured with. The
+ * recording consists of the files path.0000, path.0001, ... of
+ * segment_size bytes each, which are preallocated and mapped into memory.
+ * Storing a frame only copies it into the mapping, so the acquisition does
+ * not wait for the disk. If the next segment is not ready in time, frames
+ * are left out of the recording (see sds_dump_log()).
+ *
+ * SDS_RECORD_PACKED stores the samples in the packed format, which takes
+ * 5/8 of the space and keeps their values but not the unused bits.
+ * SDS_RECORD_COMPRESSED keeps the values as well and suits long
+ * recordings of slow signals.
+ *
+ * \param context      The device context
+ * \param path         The common prefix of the segment files, which are
+ *                     overwritten
+ * \param segment_size The size of a segment in bytes (at least 1 MiB) or 0
+ *                     for the default of 64 MiB
+ * \param format       The format the samples are stored in
+ *
+ * \return An error value to indicate the success. SDS_ERROR_BUSY if the
+ *         context is recorded already.
+ */
+sds_error sds_start_recording(sds_context *context, const char *path, size_t segment_size, enum sds_record_format format);
+
+/*!
+ * Stops the recording of the frames of a context.
+ *
+ * The unused space of the last segment is released. Destroying the context
+ * stops the recording as well.
+ *
+ * \param context The device context
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_stop_recording(sds_context *context);
+
+/*!
+ * Opens a recording for reading.
+ *
+ * All segments are mapped into memory, the frames are not copied. A
+ * recording that is still being written may be opened as well, it then
+ * contains the frames recorded so far.
+ *
+ * \param path            The path passed to sds_start_recording()
+ * \param [out] recording A pointer to a variable that will contain the
+ *                        recording. It **has to be closed** by
+ *                        sds_recording_close().
+ *
+ * \return An error value to indicate the success. SDS_ERROR_NOT_FOUND if
+ *         there is no recording at path.
+ */
+sds_error sds_recording_open(const char *path, sds_recording **recording);
+
+/*!
+ * Returns the amount of frames of a recording.
+ *
+ * \param recording   The recording
+ * \param [out] count A pointer to a variable that will contain the amount
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_recording_get_count(sds_recording *recording, uint64_t *count);
+
+/*!
+ * Returns a frame of a recording.
+ *
+ * \param recording   The recording
+ * \param index       The index of the frame (in the order of recording)
+ * \param [out] frame A pointer to a frame that will be filled. Its data
+ *                    stays valid until the recording is closed.
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_recording_get_frame(sds_recording *recording, uint64_t index, struct sds_recorded_frame *frame);
+
+/*!
+ * Decodes the samples of a recorded frame to raw 10bit A/D values
+ *
+ * Works for all formats, the result is the same as the one of
+ * sds_decode_samples() for the recorded samples.
+ *
+ * \param frame          The frame as returned by sds_recording_get_frame()
+ * \param [out] advalues An array of at least frame->count elements for the
+ *                       values
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_recorded_frame_decode(const struct sds_recorded_frame *frame, uint16_t *advalues);
+
+/*!
+ * Closes a recording.
+ *
+ * \param recording The recording to be closed. A NULL pointer results in an
+ *                  no-op.
+ */
+void sds_recording_close(sds_recording *recording);
+
 /*!
  * Sets the trigger offset.
  *
@@ -518,6 +1006,25 @@ sds_error sds_get_data(sds_context *context, char *data, size_t length, size_t *
  */
 sds_error sds_get_raw_data(sds_context *context, struct sds_samples **data, size_t *written);
 
+/*!
+ * Reads one frame from the device
+ *
+ * In contrast to sds_get_raw_data() the frame carries the time it was
+ * received and the version of the configuration it was captured under.
+ *
+ * \remark Waits for data from the device. (Blocking)
+ *
+ * \param context     The device context
+ * \param [out] frame A pointer to a variable that will contain the frame or
+ *                    NULL if the device had no data available. The frame
+ *                    **has to be freed** by sds_free_frame().
+ *
+ * \return An error value to indicate the success. SDS_ERROR_TIMEOUT is
+ *         returned if the device announced no data for three frame intervals
+ *         (see sds_get_frame_interval()) plus 250 ms.
+ */
+sds_error sds_get_frame(sds_context *context, struct sds_frame **frame);
+
 /*!
  * Decodes the passed samplevalue to the raw 10bit A/D value (after calibration)
  *
@@ -531,6 +1038,157 @@ sds_error sds_get_raw_data(sds_context *context, struct sds_samples **data, size
  */
 sds_error sds_decode_to_raw(sds_context *context, uint16_t sample, uint16_t *advalue);
 
+/*!
+ * The value of a sample that the device did not provide (RIS_MISSING).
+ */
+#define SDS_SAMPLE_MISSING 1024
+
+/*!
+ * Decodes all samples of a frame to raw 10bit A/D values
+ *
+ * In contrast to sds_decode_to_raw() invalid samples are detected and
+ * decoded to SDS_SAMPLE_MISSING. The samples of both channels stay
+ * interleaved.
+ *
+ * \param context        The context of the device that generated the samples
+ *                       or NULL, the decoding does not depend on the device
+ * \param data           The samples as returned by the device
+ * \param count          The amount of samples in data
+ * \param [out] advalues An array of at least count elements for the values
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_decode_samples(sds_context *context, const struct sds_samples *data, size_t count, uint16_t *advalues);
+
+/*!
+ * The size of count samples in the packed format (four samples in five
+ * bytes) if no sample is missing.
+ */
+#define SDS_PACKED_SIZE(count) (((count) + 3) / 4 * 5)
+
+/*!
+ * The size of the bitmap that marks the missing samples of count samples.
+ */
+#define SDS_PACKED_MASK_SIZE(count) (((count) + 7) / 8)
+
+/*!
+ * The size of count samples in the packed format if samples are missing.
+ * Buffers for sds_pack_samples() need this size.
+ */
+#define SDS_PACKED_MAX_SIZE(count) (SDS_PACKED_SIZE(count) + SDS_PACKED_MASK_SIZE(count))
+
+/*!
+ * Packs the samples of a frame into the packed format
+ *
+ * The 10bit values of the samples are stored without the unused bits, four
+ * samples in five bytes (the first one in the lowest bits). Missing samples
+ * are stored as 0 and marked in a bitmap behind the values, which is only
+ * stored if a sample is missing. The samples of both channels stay
+ * interleaved.
+ *
+ * \param data         The samples as returned by the device
+ * \param count        The amount of samples in data
+ * \param [out] packed A buffer of SDS_PACKED_MAX_SIZE(count) bytes
+ * \param [out] length The used size of packed, either SDS_PACKED_SIZE(count)
+ *                     or SDS_PACKED_MAX_SIZE(count)
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_pack_samples(const struct sds_samples *data, size_t count, uint8_t *packed, size_t *length);
+
+/*!
+ * Unpacks packed samples to raw 10bit A/D values
+ *
+ * The result is the same as the one of sds_decode_samples() for the
+ * original samples.
+ *
+ * \param packed         The packed samples
+ * \param length         The size of packed as returned by sds_pack_samples()
+ * \param count          The amount of packed samples
+ * \param [out] advalues An array of at least count elements for the values
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_unpack_samples(const uint8_t *packed, size_t length, size_t count, uint16_t *advalues);
+
+/*!
+ * Unpacks packed samples to samples in the format of the device
+ *
+ * The packed format only keeps the values, so the samples are rebuilt in
+ * a canonical form: they decode to the same values, missing samples are
+ * 0xffff and the unused bits (e.g. the channel bit) are cleared.
+ *
+ * \param packed     The packed samples
+ * \param length     The size of packed as returned by sds_pack_samples()
+ * \param count      The amount of packed samples
+ * \param [out] data A buffer for count samples
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_unpack_to_raw(const uint8_t *packed, size_t length, size_t count, struct sds_samples *data);
+
+/*!
+ * The size of the header of a compressed frame.
+ */
+#define SDS_COMPRESSED_HEADER_SIZE 8
+
+/*!
+ * The maximum size of count compressed samples. Buffers for
+ * sds_compress_samples() need this size.
+ */
+#define SDS_COMPRESSED_MAX_SIZE(count) (SDS_COMPRESSED_HEADER_SIZE + ((count) + 127) / 128 * 193)
+
+/*!
+ * Compresses the samples of a frame without loss
+ *
+ * Every channel is coded as the differences between its samples, which
+ * are bit-packed in blocks of 128 samples with the width of the largest
+ * difference. Signals that change slowly compared to the sample rate
+ * become a fraction of the packed format, noise may take more space. The
+ * result starts with a header of SDS_COMPRESSED_HEADER_SIZE bytes holding
+ * the amount of samples and the size, so compressed frames can be written
+ * to a pipe or socket one after another (see sds_compressed_info()).
+ *
+ * \param data             The samples as returned by the device
+ * \param count            The amount of samples in data
+ * \param [out] compressed A buffer of SDS_COMPRESSED_MAX_SIZE(count) bytes
+ * \param [out] length     The used size of compressed
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_compress_samples(const struct sds_samples *data, size_t count, uint8_t *compressed, size_t *length);
+
+/*!
+ * Reads the header of a compressed frame
+ *
+ * \param compressed   The start of the compressed frame
+ * \param available    The bytes available at compressed (at least
+ *                     SDS_COMPRESSED_HEADER_SIZE)
+ * \param [out] count  The amount of samples of the frame
+ * \param [out] length The size of the compressed frame including the
+ *                     header
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_compressed_info(const uint8_t *compressed, size_t available, size_t *count, size_t *length);
+
+/*!
+ * Decompresses samples to raw 10bit A/D values
+ *
+ * The result is the same as the one of sds_decode_samples() for the
+ * original samples.
+ *
+ * \param compressed     The compressed frame
+ * \param length         The size of compressed as returned by
+ *                       sds_compress_samples()
+ * \param count          The amount of compressed samples
+ * \param [out] advalues An array of at least count elements for the values
+ *
+ * \return An error value to indicate the success. SDS_ERROR_INVALID_PARAM
+ *         if the frame is damaged or does not match count and length.
+ */
+sds_error sds_decompress_samples(const uint8_t *compressed, size_t length, size_t count, uint16_t *advalues);
+
 /*!
  * Decodes the passed samplevalue to a 64bit double value (applys both calibartion
  * data and volts/div settings to the A/D value
@@ -543,3 +1201,141 @@ sds_error sds_decode_to_raw(sds_context *context, uint16_t sample, uint16_t *adv
  * \return An error value to indicate the success.
  */
 sds_error sds_decode_to_volt(sds_context *context, uint16_t sample, double *advalue);
+
+/*!
+ * Opens several oscilloscopes as one group. The data of all devices is
+ * acquired asynchronously by one event thread (see sds_group_start()), so
+ * no thread per device is required.
+ *
+ * \remark Every device is initialized like by sds_initialize().
+ *
+ * \param devices     An array of devices obtained by sds_get_devices().
+ * \param count       The amount of elements in devices.
+ * \param flags       A combination of enum sds_group_flags values or 0 for
+ *                    one queue per device.
+ * \param [out] group A pointer to a group pointer, that will contain the
+ *                    pointer to the created group.
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_group_create(struct sds_device *devices, unsigned int count, int flags, sds_group **group);
+
+/*!
+ * Frees the ressources of a group. A running group is stopped before.
+ *
+ * \param group The group to be destroyed. After this operation, neither the
+ *              group nor the contexts of its devices **must** be used any
+ *              more. A NULL pointer results in an no-op.
+ */
+void sds_group_destroy(sds_group *group);
+
+/*!
+ * Returns the context of a device within a group. It can be used to
+ * configure the device.
+ *
+ * \remark The context **must not** be destroyed by sds_destroy().
+ *
+ * \param group         The device group
+ * \param device        The index of the device (as passed to
+ *                      sds_group_create())
+ * \param [out] context A pointer to a variable that will contain the context.
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_group_get_context(sds_group *group, unsigned int device, sds_context **context);
+
+/*!
+ * Starts the event thread that acquires the data of all devices of the
+ * group.
+ *
+ * \param group The device group
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_group_start(sds_group *group);
+
+/*!
+ * Stops the acquisition of a group. Frames that were already acquired stay
+ * in the queues.
+ *
+ * \param group The device group
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_group_stop(sds_group *group);
+
+/*!
+ * Waits for the next frame of a device of the group. (Blocking)
+ *
+ * \remark When a queue is full, its oldest frame is dropped.
+ *
+ * \param group       The device group
+ * \param device      The index of the device whose queue is read or
+ *                    SDS_GROUP_ANY if the group was created with
+ *                    SDS_GROUP_MERGED.
+ * \param [out] frame A pointer to a variable that will contain the frame. It
+ *                    **has to be freed** by sds_free_frame().
+ * \param timeout     The time in milliseconds to wait for a frame or 0 to
+ *                    wait without a limit.
+ *
+ * \return An error value to indicate the success. SDS_ERROR_TIMEOUT is
+ *         returned if no frame arrived in time or a device of the queue
+ *         announced no data for three frame intervals plus 250 ms,
+ *         SDS_ERROR_NOT_FOUND if the
+ *         queue is empty and the group is not running and
+ *         SDS_ERROR_NO_DEVICE if the queue is empty and its devices failed.
+ */
+sds_error sds_group_get_frame(sds_group *group, unsigned int device, struct sds_frame **frame, unsigned int timeout);
+
+/*!
+ * Waits for the next set of aligned frames of a synchronized group.
+ * (Blocking)
+ *
+ * The timestamps of the frames are corrected by the estimated latency of
+ * their devices. A frame that is older than the newest head of the other
+ * queues by more than window is discarded, since its partners are lost.
+ * The first set after sds_group_start() is not checked against the window,
+ * it pairs the oldest frame with the nearest frames of the other devices and
+ * seeds the latency estimation.
+ *
+ * \param group     The device group (created with SDS_GROUP_SYNCHRONIZED)
+ * \param window    The maximum skew (in nanoseconds) of frames that belong
+ *                  to the same set.
+ * \param [out] set A pointer to a variable that will contain the set. It
+ *                  **has to be freed** by sds_free_frame_set().
+ * \param timeout   The time in milliseconds to wait for a set or 0 to wait
+ *                  without a limit.
+ *
+ * \return An error value to indicate the success. SDS_ERROR_TIMEOUT is
+ *         returned if no set was completed in time or a device stalled
+ *         (see sds_group_get_frame()) and SDS_ERROR_NO_DEVICE
+ *         if no set can be completed because a device of the group failed.
+ */
+sds_error sds_group_get_frame_set(sds_group *group, uint64_t window, struct sds_frame_set **set, unsigned int timeout);
+
+/*!
+ * Frees a frame set returned by sds_group_get_frame_set() including its
+ * frames.
+ *
+ * \param set The set to be freed. A NULL pointer results in an no-op.
+ */
+void sds_free_frame_set(struct sds_frame_set *set);
+
+/*!
+ * Returns statistics about the alignment of a synchronized group.
+ *
+ * \param group        The device group (created with SDS_GROUP_SYNCHRONIZED)
+ * \param [out] report A pointer to a report that will be filled.
+ *
+ * \return An error value to indicate the success.
+ */
+sds_error sds_group_get_skew_report(sds_group *group, struct sds_skew_report *report);
+
+/*!
+ * Frees a frame returned by the library.
+ *
+ * \param frame The frame to be freed. A NULL pointer results in an no-op.
+ */
+void sds_free_frame(struct sds_frame *frame);
+
+#endif /* LIBSDS200A_H */
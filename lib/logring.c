@@ -0,0 +1,230 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+/* The log of a context is a ring of binary entries. Writers reserve a
+ * position with one atomic increment and never wait, so logging is cheap
+ * enough for the acquisition path. When the ring is full the oldest entries
+ * are overwritten.
+ *
+ * Every entry carries its position (plus one) as a sequence number, which
+ * is zero while the entry is written. The reader copies an entry and checks
+ * the sequence number before and after, which detects entries that are
+ * incomplete or were overwritten in the meantime. Formatting only happens
+ * in sds_dump_log(). */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/* Entries of a ring (a power of two) */
+#define LOG_SIZE 1024
+
+/* Maximum length of a formatted entry */
+#define LOG_LINE_LENGTH 160
+
+struct log_entry
+{
+	_Atomic uint64_t sequence; /* position + 1 if complete, else 0 */
+	_Atomic uint64_t timestamp;
+	_Atomic int event; /* enum log_event */
+	_Atomic int64_t args[LOG_ARGS];
+};
+
+struct log_ring
+{
+	_Atomic uint64_t head; /* position of the next entry */
+	pthread_mutex_t dump_lock; /* serializes the readers */
+	uint64_t tail; /* position of the next entry to dump */
+	struct log_entry entries[LOG_SIZE];
+};
+
+/* The messages of the events. The arguments are passed as long long. */
+static const char *const messages[] = {
+	[LOG_CONTROL_FAILED] = "control transfer 0x%02llx failed: error %lld",
+	[LOG_BULK_FAILED] = "bulk transfer failed: error %lld (poll returned %lld)",
+	[LOG_SHORT_FRAME] = "frame of %lld bytes is too short",
+	[LOG_FRAME_DROPPED] = "frame dropped (queue of device %lld is full)",
+	[LOG_MEMBER_FAILED] = "device %lld of the group failed: error %lld",
+	[LOG_DISCONNECTED] = "device was detached",
+	[LOG_RECONNECTED] = "device was attached again",
+	[LOG_RECONNECT_FAILED] = "device was attached again, but could not be restored",
+	[LOG_CAPTURE_OVERFLOW] = "capture dropped a transfer of %lld bytes",
+	[LOG_CAPTURE_FAILED] = "capture file could not be written: errno %lld",
+	[LOG_RECORD_OVERFLOW] = "recording dropped a frame of %lld bytes (no segment ready)",
+	[LOG_RECORD_FAILED] = "recording segment %lld could not be created: error %lld",
+	[LOG_STALLED] = "device %lld announced no frame for %lld ms",
+};
+
+sds_error log_init(sds_context *context)
+{
+	context->log = calloc(1, sizeof(*context->log));
+	if (!context->log)
+		return SDS_ERROR_NO_MEM;
+	pthread_mutex_init(&context->log->dump_lock, NULL);
+	return SDS_ERROR_SUCCESS;
+}
+
+void log_destroy(sds_context *context)
+{
+	pthread_mutex_destroy(&context->log->dump_lock);
+	free(context->log);
+}
+
+void log_write(sds_context *context, enum log_event event,
+	       int64_t arg0, int64_t arg1)
+{
+	struct log_ring *ring = context->log;
+	uint64_t position = atomic_fetch_add_explicit(&ring->head, 1,
+						      memory_order_relaxed);
+	struct log_entry *entry = &ring->entries[position & (LOG_SIZE - 1)];
+
+	atomic_store_explicit(&entry->sequence, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&entry->timestamp, get_time_ns(),
+			      memory_order_relaxed);
+	atomic_store_explicit(&entry->event, event, memory_order_relaxed);
+	atomic_store_explicit(&entry->args[0], arg0, memory_order_relaxed);
+	atomic_store_explicit(&entry->args[1], arg1, memory_order_relaxed);
+	atomic_store_explicit(&entry->sequence, position + 1,
+			      memory_order_release);
+}
+
+/* Copies the entry at position. Returns 0 on success, 1 if it is not
+ * complete yet and 2 if it was overwritten already. */
+static int read_entry(struct log_ring *ring, uint64_t position,
+		      uint64_t *timestamp, int *event, int64_t *args)
+{
+	struct log_entry *entry = &ring->entries[position & (LOG_SIZE - 1)];
+	uint64_t before = atomic_load_explicit(&entry->sequence,
+					       memory_order_acquire);
+	uint64_t after;
+	unsigned int i;
+
+	*timestamp = atomic_load_explicit(&entry->timestamp,
+					  memory_order_relaxed);
+	*event = atomic_load_explicit(&entry->event, memory_order_relaxed);
+	for (i = 0; i < LOG_ARGS; ++i)
+		args[i] = atomic_load_explicit(&entry->args[i],
+					       memory_order_relaxed);
+	atomic_thread_fence(memory_order_acquire);
+	after = atomic_load_explicit(&entry->sequence, memory_order_relaxed);
+
+	if (before == position + 1 && after == position + 1)
+		return 0;
+	if (before > position + 1 || after > position + 1)
+		return 2;
+	return 1;
+}
+
+/* Writes a whole line to fd */
+static sds_error write_line(int fd, const char *line, size_t length)
+{
+	ssize_t written;
+
+	while (length) {
+		written = write(fd, line, length);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return SDS_ERROR_IO;
+		}
+		line += written;
+		length -= written;
+	}
+	return SDS_ERROR_SUCCESS;
+}
+
+/* Formats an entry and returns the length of the line */
+static int format_entry(char *line, uint64_t timestamp, int event,
+			const int64_t *args)
+{
+	int count = sizeof(messages) / sizeof(messages[0]);
+	int length = snprintf(line, LOG_LINE_LENGTH, "[%llu.%09llu] ",
+			      (unsigned long long) (timestamp / 1000000000),
+			      (unsigned long long) (timestamp % 1000000000));
+
+	if (event <= 0 || event >= count || !messages[event])
+		length += snprintf(line + length, LOG_LINE_LENGTH - length,
+				   "unknown event %d", event);
+	else
+		length += snprintf(line + length, LOG_LINE_LENGTH - length,
+				   messages[event], (long long) args[0],
+				   (long long) args[1]);
+	/* Truncated lines still end with a newline */
+	if (length > LOG_LINE_LENGTH - 2)
+		length = LOG_LINE_LENGTH - 2;
+	line[length++] = '\n';
+	line[length] = '\0';
+	return length;
+}
+
+/* Reports entries that were overwritten before they were dumped */
+static sds_error write_lost(int fd, uint64_t lost)
+{
+	char line[LOG_LINE_LENGTH];
+	int length = snprintf(line, sizeof(line), "[...] %llu entries lost\n",
+			      (unsigned long long) lost);
+	return write_line(fd, line, length);
+}
+
+sds_error sds_dump_log(sds_context *context, int fd)
+{
+	struct log_ring *ring;
+	char line[LOG_LINE_LENGTH];
+	uint64_t head;
+	uint64_t timestamp;
+	uint64_t lost = 0;
+	int64_t args[LOG_ARGS];
+	int event;
+	int status;
+	sds_error err = SDS_ERROR_SUCCESS;
+
+	if (!context || fd < 0)
+		return SDS_ERROR_INVALID_PARAM;
+	ring = context->log;
+
+	pthread_mutex_lock(&ring->dump_lock);
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if (head - ring->tail > LOG_SIZE) {
+		lost = head - LOG_SIZE - ring->tail;
+		ring->tail = head - LOG_SIZE;
+	}
+	while (ring->tail != head && !err) {
+		status = read_entry(ring, ring->tail, &timestamp, &event, args);
+		/* An entry that is still written is dumped next time */
+		if (status == 1)
+			break;
+		ring->tail++;
+		if (status == 2) {
+			lost++;
+			continue;
+		}
+		if (lost && (err = write_lost(fd, lost)))
+			break;
+		lost = 0;
+		err = write_line(fd, line,
+				 format_entry(line, timestamp, event, args));
+	}
+	if (lost && !err)
+		err = write_lost(fd, lost);
+	pthread_mutex_unlock(&ring->dump_lock);
+	return err;
+}
@@ -0,0 +1,230 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+/* The packed sample format. A sample carries 10 bits of data in 16 bits
+ * (see dataformat.md), so the decoded values are stored as groups of four
+ * samples in five bytes:
+ *
+ *	byte 0   byte 1   byte 2   byte 3   byte 4
+ *	00000000 11111100 22221111 33222222 33333333
+ *
+ * (sample 0 in the lowest bits). A missing sample is stored as 0 and marked
+ * in a bitmap behind the groups (bit i % 8 of byte i / 8), which is left
+ * out if no sample of the frame is missing. */
+
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "internal.h"
+
+/* The raw sample a missing sample is unpacked to (its 0x30 bits are set) */
+#define RAW_MISSING 0xffff
+
+/* Stores four 10 bit values as a group of five bytes */
+static void pack_group(const uint16_t *values, uint8_t *out)
+{
+	uint64_t bits = values[0] | (uint64_t) values[1] << 10
+			| (uint64_t) values[2] << 20
+			| (uint64_t) values[3] << 30;
+	int i;
+
+	for (i = 0; i < 5; ++i)
+		out[i] = bits >> (8 * i);
+}
+
+/* Returns value i (0 - 3) of a group of five bytes */
+static uint16_t unpack_value(const uint8_t *group, unsigned int i)
+{
+	uint64_t bits = 0;
+	int k;
+
+	for (k = 4; k >= 0; --k)
+		bits = bits << 8 | group[k];
+	return (bits >> (10 * i)) & 0x3ff;
+}
+
+/* Converts a value back to a raw sample that decodes to it */
+static uint16_t encode_sample(uint16_t value)
+{
+	return 0x8000 | ((value & 0x3c0) << 2) | (value & 0x3f);
+}
+
+sds_error sds_pack_samples(const struct sds_samples *data, size_t count, uint8_t *packed, size_t *length)
+{
+	const uint16_t *samples;
+	uint8_t *mask;
+	uint16_t values[4];
+	uint16_t value;
+	size_t missing = 0;
+	size_t i = 0;
+	size_t k;
+
+	if (data == NULL || packed == NULL || length == NULL) {
+		return SDS_ERROR_INVALID_PARAM;
+	}
+	/* The samples are aligned within the packed struct */
+	samples = (const uint16_t *) ((const uint8_t *) data
+				      + sizeof(data->unknown_padding));
+	mask = packed + SDS_PACKED_SIZE(count);
+	memset(mask, 0, SDS_PACKED_MASK_SIZE(count));
+
+#ifdef __SSE2__
+	{
+		const __m128i low = _mm_set1_epi16(0x3f);
+		const __m128i high = _mm_set1_epi16(0x3c0);
+		const __m128i flags = _mm_set1_epi16((short) 0xb000);
+		const __m128i valid = _mm_set1_epi16((short) 0x8000);
+		/* Multiplies the odd values by 1 << 10 */
+		const __m128i pair = _mm_set1_epi32(1 | 1 << 26);
+		const __m128i bits20 = _mm_set1_epi64x(0xfffff);
+		uint64_t groups[2];
+		int bad;
+
+		/* Eight samples become two groups. Each group is stored with
+		 * eight bytes, so at least three bytes have to follow. */
+		for (; i + 9 <= count; i += 8) {
+			__m128i sample = _mm_loadu_si128((const __m128i *) &samples[i]);
+			__m128i value = _mm_or_si128(
+				_mm_and_si128(sample, low),
+				_mm_and_si128(_mm_srli_epi16(sample, 2), high));
+			__m128i ok = _mm_cmpeq_epi16(_mm_and_si128(sample, flags),
+						     valid);
+
+			bad = ~_mm_movemask_epi8(_mm_packs_epi16(ok, ok)) & 0xff;
+			if (bad) {
+				mask[i / 8] = bad;
+				missing += __builtin_popcount(bad);
+				value = _mm_and_si128(value, ok);
+			}
+			/* 20 bits per pair, then 40 bits per group */
+			value = _mm_madd_epi16(value, pair);
+			value = _mm_or_si128(
+				_mm_and_si128(value, bits20),
+				_mm_slli_epi64(_mm_srli_epi64(value, 32), 20));
+			_mm_storeu_si128((__m128i *) groups, value);
+			memcpy(packed + i / 4 * 5, &groups[0], sizeof(groups[0]));
+			memcpy(packed + i / 4 * 5 + 5, &groups[1], sizeof(groups[1]));
+		}
+	}
+#endif
+	for (; i < count; i += 4) {
+		for (k = 0; k < 4; ++k) {
+			value = i + k < count ? decode_sample(samples[i + k]) : 0;
+			if (value == SDS_SAMPLE_MISSING) {
+				mask[(i + k) / 8] |= 1 << ((i + k) % 8);
+				missing++;
+				value = 0;
+			}
+			values[k] = value;
+		}
+		pack_group(values, packed + i / 4 * 5);
+	}
+
+	*length = SDS_PACKED_SIZE(count)
+		  + (missing ? SDS_PACKED_MASK_SIZE(count) : 0);
+	return SDS_ERROR_SUCCESS;
+}
+
+/* Unpacks to values (raw = 0) or to raw samples */
+static sds_error unpack(const uint8_t *packed, size_t length, size_t count,
+			uint16_t *out, int raw)
+{
+	const uint8_t *mask = NULL;
+	uint16_t missing = raw ? RAW_MISSING : SDS_SAMPLE_MISSING;
+	uint16_t value;
+	size_t i = 0;
+
+	if (length == SDS_PACKED_MAX_SIZE(count))
+		mask = packed + SDS_PACKED_SIZE(count);
+	else if (length != SDS_PACKED_SIZE(count))
+		return SDS_ERROR_INVALID_PARAM;
+
+#ifdef __SSE2__
+	{
+		const __m128i bits20 = _mm_set1_epi64x(0xfffff);
+		const __m128i bits10 = _mm_set1_epi32(0x3ff);
+		const __m128i low = _mm_set1_epi16(0x3f);
+		const __m128i high = _mm_set1_epi16(0x3c0);
+		const __m128i valid = _mm_set1_epi16((short) 0x8000);
+		const __m128i bit = _mm_set_epi16(128, 64, 32, 16, 8, 4, 2, 1);
+		const __m128i replacement = _mm_set1_epi16((short) missing);
+		uint64_t groups[2];
+
+		/* Two groups become eight samples. Each group is loaded with
+		 * eight bytes, so at least three bytes have to follow. */
+		for (; i + 8 <= count && i / 4 * 5 + 13 <= length; i += 8) {
+			memcpy(&groups[0], packed + i / 4 * 5, sizeof(groups[0]));
+			memcpy(&groups[1], packed + i / 4 * 5 + 5, sizeof(groups[1]));
+			__m128i value = _mm_loadu_si128((const __m128i *) groups);
+
+			/* 20 bits per pair in 32 bit lanes, then 10 bits per
+			 * value in 16 bit lanes */
+			value = _mm_or_si128(
+				_mm_and_si128(value, bits20),
+				_mm_slli_epi64(_mm_and_si128(_mm_srli_epi64(value, 20),
+							     bits20), 32));
+			value = _mm_or_si128(
+				_mm_and_si128(value, bits10),
+				_mm_slli_epi32(_mm_srli_epi32(value, 10), 16));
+			if (raw)
+				value = _mm_or_si128(valid, _mm_or_si128(
+					_mm_and_si128(value, low),
+					_mm_slli_epi16(_mm_and_si128(value, high), 2)));
+			if (mask && mask[i / 8]) {
+				__m128i flags = _mm_and_si128(_mm_set1_epi16(mask[i / 8]),
+							      bit);
+				__m128i gone = _mm_cmpeq_epi16(flags, bit);
+				value = _mm_or_si128(_mm_andnot_si128(gone, value),
+						     _mm_and_si128(gone, replacement));
+			}
+			_mm_storeu_si128((__m128i *) &out[i], value);
+		}
+	}
+#endif
+	for (; i < count; ++i) {
+		if (mask && (mask[i / 8] >> (i % 8) & 1)) {
+			out[i] = missing;
+		} else {
+			value = unpack_value(packed + i / 4 * 5, i % 4);
+			out[i] = raw ? encode_sample(value) : value;
+		}
+	}
+	return SDS_ERROR_SUCCESS;
+}
+
+sds_error sds_unpack_samples(const uint8_t *packed, size_t length, size_t count, uint16_t *advalues)
+{
+	if (packed == NULL || advalues == NULL) {
+		return SDS_ERROR_INVALID_PARAM;
+	}
+	return unpack(packed, length, count, advalues, 0);
+}
+
+sds_error sds_unpack_to_raw(const uint8_t *packed, size_t length, size_t count, struct sds_samples *data)
+{
+	if (packed == NULL || data == NULL) {
+		return SDS_ERROR_INVALID_PARAM;
+	}
+	memset(data->unknown_padding, 0, sizeof(data->unknown_padding));
+	/* The samples are aligned within the packed struct */
+	return unpack(packed, length, count,
+		      (uint16_t *) ((uint8_t *) data
+				    + sizeof(data->unknown_padding)), 1);
+}
@@ -0,0 +1,711 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+/* Records the frames of a context into segment files and reads them back.
+ *
+ * A recording consists of the segments <path>.0000, <path>.0001, ... of a
+ * fixed size. Every segment is preallocated on the disk and mapped into
+ * memory, so storing a frame only copies its samples into the mapping and
+ * adds an entry to the frame index of the segment. Writing the pages back is
+ * left to the kernel and the acquisition never waits for the disk. A
+ * background thread creates the next segment before it is needed and
+ * finishes the full ones. If it falls behind, frames are left out of the
+ * recording instead.
+ *
+ * The samples grow from the header towards the end of a segment, the frame
+ * index grows from the end towards the samples. The amount of frames in the
+ * header is updated after a frame is complete, so readers may map a segment
+ * while it is being written.
+ *
+ * The samples are stored as returned by the device or packed or compressed
+ * into the mapping right away (see packed.c and compress.c), which is the
+ * format of every entry. */
+
+#define _GNU_SOURCE /* fallocate() */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/* The segments of a recording are named after the path and a number */
+#define RECORD_NAME_FORMAT "%s.%04u"
+#define RECORD_NAME_DIGITS 16
+
+#define RECORD_MAGIC "SDSREC1"
+#define RECORD_FORMAT 2
+
+/* The samples start behind the first page */
+#define RECORD_HEADER_SIZE 4096
+
+/* Alignment of the samples of a frame within a segment */
+#define RECORD_ALIGNMENT 64
+
+#define RECORD_DEFAULT_SEGMENT_SIZE (64 << 20)
+#define RECORD_MIN_SEGMENT_SIZE (1 << 20)
+
+/* The header at the start of every segment (in host byte order) */
+struct record_header
+{
+	char magic[8];
+	uint32_t format;
+	uint32_t segment; /* number of the segment within the recording */
+	uint64_t size; /* size of the segment file */
+	uint64_t clock_offset; /* realtime minus monotonic clock in ns */
+	uint64_t data_size; /* bytes of samples behind the header */
+	_Atomic uint64_t count; /* frames in the segment */
+	uint32_t complete; /* true -> the segment is finished */
+};
+
+/* An entry of the frame index. Entry i is stored i + 1 entries before the
+ * end of the segment. */
+struct record_entry
+{
+	uint64_t timestamp; /* completion of the transfer (CLOCK_MONOTONIC) */
+	uint64_t config_version;
+	uint64_t data; /* position of the struct sds_samples in the segment */
+	uint32_t count; /* samples */
+	uint16_t device;
+	uint8_t time; /* enum sds_time */
+	uint8_t voltage[2]; /* enum sds_voltage of both channels */
+	uint8_t format; /* enum sds_record_format of the samples */
+	uint32_t size; /* bytes of the samples */
+	double offset[2]; /* voltage offsets of both channels */
+};
+
+/* A mapped segment. map is NULL if the segment does not exist. */
+struct segment
+{
+	int fd;
+	unsigned int number;
+	unsigned char *map;
+	uint64_t size;
+	uint64_t fill; /* end of the samples */
+	uint64_t count; /* frames in the segment */
+};
+
+struct recorder
+{
+	char *path;
+	uint64_t segment_size;
+	enum sds_record_format format;
+	uint64_t clock_offset;
+	pthread_t thread;
+
+	pthread_mutex_t lock; /* protects the members below */
+	pthread_cond_t changed; /* signalled when a segment is handed over */
+	struct segment current; /* the segment frames are added to */
+	struct segment next; /* prepared by the thread */
+	struct segment full; /* to be finished by the thread */
+	unsigned int segments; /* number of the next segment to create */
+	int failed; /* true -> no more segments are created */
+	int stop; /* true -> the thread exits */
+};
+
+/* A segment mapped for reading */
+struct recording_segment
+{
+	const unsigned char *map;
+	size_t size;
+	uint64_t first; /* index of its first frame within the recording */
+	uint64_t count;
+};
+
+struct sds_recording
+{
+	struct recording_segment *segments;
+	unsigned int segment_count;
+	uint64_t count; /* frames of all segments */
+	uint64_t clock_offset;
+};
+
+static uint64_t align(uint64_t value, uint64_t alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+static struct record_entry *get_entry(unsigned char *map, uint64_t size,
+				      uint64_t index)
+{
+	return (struct record_entry *) (map + size) - (index + 1);
+}
+
+/* Returns true if the size of the samples of an entry matches its format */
+static int valid_size(const struct record_entry *entry)
+{
+	switch (entry->format) {
+		case SDS_RECORD_RAW:
+			return entry->size == sizeof(struct sds_samples)
+					      + (uint64_t) entry->count
+					      * sizeof(uint16_t);
+		case SDS_RECORD_PACKED:
+			return entry->size == SDS_PACKED_SIZE((uint64_t) entry->count) ||
+			       entry->size == SDS_PACKED_MAX_SIZE((uint64_t) entry->count);
+		case SDS_RECORD_COMPRESSED:
+			return entry->size >= SDS_COMPRESSED_HEADER_SIZE &&
+			       entry->size <= SDS_COMPRESSED_MAX_SIZE((uint64_t) entry->count);
+		default:
+			return 0;
+	}
+}
+
+/* Returns true if a frame of size bytes and its entry fit into a segment */
+static int fits(const struct segment *segment, uint64_t size)
+{
+	return align(segment->fill, RECORD_ALIGNMENT) + size
+	       + (segment->count + 1) * sizeof(struct record_entry)
+	       <= segment->size;
+}
+
+/* Returns the path of a segment. The result has to be freed. */
+static char *segment_path(const char *path, unsigned int number)
+{
+	size_t length = strlen(path) + RECORD_NAME_DIGITS;
+	char *result = malloc(length);
+
+	if (result)
+		snprintf(result, length, RECORD_NAME_FORMAT, path, number);
+	return result;
+}
+
+static sds_error errno_error(int error)
+{
+	switch (error) {
+		case EACCES:
+		case EPERM:
+			return SDS_ERROR_ACCESS;
+		case ENOENT:
+			return SDS_ERROR_NOT_FOUND;
+		case ENOMEM:
+			return SDS_ERROR_NO_MEM;
+		default:
+			return SDS_ERROR_IO;
+	}
+}
+
+/* Creates, preallocates and maps a segment */
+static sds_error create_segment(struct recorder *recorder, unsigned int number,
+				struct segment *segment)
+{
+	struct record_header *header;
+	char *path = segment_path(recorder->path, number);
+	sds_error err = SDS_ERROR_SUCCESS;
+	int error;
+
+	if (!path)
+		return SDS_ERROR_NO_MEM;
+	memset(segment, 0, sizeof(*segment));
+	segment->number = number;
+	segment->size = recorder->segment_size;
+	segment->fill = RECORD_HEADER_SIZE;
+
+	segment->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (segment->fd < 0) {
+		err = errno_error(errno);
+		goto path_free;
+	}
+	/* Reserve the blocks now, so writing to the mapping never fails */
+	if ((error = posix_fallocate(segment->fd, 0, segment->size))) {
+		err = errno_error(error);
+		goto file_remove;
+	}
+	/* Fault in all pages before the segment is used */
+	segment->map = mmap(NULL, segment->size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, segment->fd, 0);
+	if (segment->map == MAP_FAILED) {
+		segment->map = NULL;
+		err = errno_error(errno);
+		goto file_remove;
+	}
+
+	header = (struct record_header *) segment->map;
+	memcpy(header->magic, RECORD_MAGIC, sizeof(header->magic));
+	header->format = RECORD_FORMAT;
+	header->segment = number;
+	header->size = segment->size;
+	header->clock_offset = recorder->clock_offset;
+	atomic_store(&header->count, 0);
+	free(path);
+	return err;
+
+file_remove:
+	close(segment->fd);
+	unlink(path);
+
+path_free:
+	free(path);
+	return err;
+}
+
+/* Completes the header of a segment, releases the unused space and unmaps
+ * it */
+static void finish_segment(struct segment *segment)
+{
+	struct record_header *header = (struct record_header *) segment->map;
+	long page = sysconf(_SC_PAGESIZE);
+	uint64_t start = align(segment->fill, page);
+	uint64_t end = (segment->size - segment->count
+			* sizeof(struct record_entry)) / page * page;
+
+	header->data_size = segment->fill - RECORD_HEADER_SIZE;
+	header->complete = 1;
+	munmap(segment->map, segment->size);
+	segment->map = NULL;
+
+	/* Frees the blocks between the samples and the index. The file keeps
+	 * its size, so the index stays at the end. */
+	if (end > start)
+		fallocate(segment->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			  start, end - start);
+	close(segment->fd);
+}
+
+/* Removes a segment that was prepared but never used */
+static void remove_segment(struct recorder *recorder, struct segment *segment)
+{
+	char *path = segment_path(recorder->path, segment->number);
+
+	munmap(segment->map, segment->size);
+	segment->map = NULL;
+	close(segment->fd);
+	if (path)
+		unlink(path);
+	free(path);
+}
+
+static void *recorder_thread(void *arg)
+{
+	sds_context *context = arg;
+	struct recorder *recorder = context->recorder;
+	struct segment segment;
+	unsigned int number;
+	sds_error err;
+
+	pthread_mutex_lock(&recorder->lock);
+	while (!recorder->stop) {
+		if (recorder->full.map) {
+			/* The segment belongs to this thread until full.map is
+			 * reset */
+			segment = recorder->full;
+			pthread_mutex_unlock(&recorder->lock);
+			finish_segment(&segment);
+			pthread_mutex_lock(&recorder->lock);
+			recorder->full.map = NULL;
+		} else if (!recorder->next.map && !recorder->failed) {
+			number = recorder->segments++;
+			pthread_mutex_unlock(&recorder->lock);
+			err = create_segment(recorder, number, &segment);
+			pthread_mutex_lock(&recorder->lock);
+			if (err) {
+				log_write(context, LOG_RECORD_FAILED, number, err);
+				recorder->failed = 1;
+			} else {
+				recorder->next = segment;
+			}
+		} else {
+			pthread_cond_wait(&recorder->changed, &recorder->lock);
+		}
+	}
+	pthread_mutex_unlock(&recorder->lock);
+	return NULL;
+}
+
+void record_settings(const struct config *config,
+		     struct frame_settings *settings)
+{
+	settings->version = config->version;
+	settings->time = config->time;
+	settings->voltage[0] = config->voltage[0];
+	settings->voltage[1] = config->voltage[1];
+	settings->offset[0] = config->offset[0];
+	settings->offset[1] = config->offset[1];
+}
+
+void record_frame(sds_context *context, const struct frame_settings *settings,
+		  unsigned int device, uint64_t timestamp,
+		  const struct sds_samples *data, size_t count)
+{
+	struct recorder *recorder;
+	struct segment *segment;
+	struct record_entry *entry;
+	uint64_t size;
+	uint64_t position;
+	size_t length;
+
+	pthread_rwlock_rdlock(&context->recorder_lock);
+	if (!(recorder = context->recorder))
+		goto unlock;
+
+	/* The space a frame may take */
+	if (recorder->format == SDS_RECORD_PACKED)
+		size = SDS_PACKED_MAX_SIZE(count);
+	else if (recorder->format == SDS_RECORD_COMPRESSED)
+		size = SDS_COMPRESSED_MAX_SIZE(count);
+	else
+		size = sizeof(*data) + count * sizeof(data->samples[0]);
+
+	pthread_mutex_lock(&recorder->lock);
+	segment = &recorder->current;
+	if (!fits(segment, size)) {
+		/* Switch to the next segment if the thread is ready */
+		if (!recorder->next.map || recorder->full.map ||
+		    !fits(&recorder->next, size)) {
+			log_write(context, LOG_RECORD_OVERFLOW, size, 0);
+			goto unlock_recorder;
+		}
+		recorder->full = *segment;
+		*segment = recorder->next;
+		recorder->next.map = NULL;
+		pthread_cond_signal(&recorder->changed);
+	}
+
+	position = align(segment->fill, RECORD_ALIGNMENT);
+	if (recorder->format == SDS_RECORD_PACKED) {
+		sds_pack_samples(data, count, segment->map + position, &length);
+		size = length;
+	} else if (recorder->format == SDS_RECORD_COMPRESSED) {
+		sds_compress_samples(data, count, segment->map + position,
+				     &length);
+		size = length;
+	} else {
+		memcpy(segment->map + position, data, size);
+	}
+	entry = get_entry(segment->map, segment->size, segment->count);
+	entry->timestamp = timestamp;
+	entry->config_version = settings->version;
+	entry->data = position;
+	entry->count = count;
+	entry->device = device;
+	entry->time = settings->time;
+	entry->voltage[0] = settings->voltage[0];
+	entry->voltage[1] = settings->voltage[1];
+	entry->format = recorder->format;
+	entry->size = size;
+	entry->offset[0] = settings->offset[0];
+	entry->offset[1] = settings->offset[1];
+	segment->fill = position + size;
+	segment->count++;
+	/* Publish the frame to readers of the segment */
+	atomic_store_explicit(&((struct record_header *) segment->map)->count,
+			      segment->count, memory_order_release);
+
+unlock_recorder:
+	pthread_mutex_unlock(&recorder->lock);
+unlock:
+	pthread_rwlock_unlock(&context->recorder_lock);
+}
+
+/* Stops the thread, finishes the segments and frees the recorder. Requires
+ * the write lock. */
+static void recorder_free(sds_context *context)
+{
+	struct recorder *recorder = context->recorder;
+
+	atomic_store(&context->recording, 0);
+	pthread_mutex_lock(&recorder->lock);
+	recorder->stop = 1;
+	pthread_cond_signal(&recorder->changed);
+	pthread_mutex_unlock(&recorder->lock);
+	pthread_join(recorder->thread, NULL);
+
+	if (recorder->full.map)
+		finish_segment(&recorder->full);
+	if (recorder->next.map)
+		remove_segment(recorder, &recorder->next);
+	finish_segment(&recorder->current);
+
+	pthread_cond_destroy(&recorder->changed);
+	pthread_mutex_destroy(&recorder->lock);
+	free(recorder->path);
+	free(recorder);
+	context->recorder = NULL;
+}
+
+sds_error sds_start_recording(sds_context *context, const char *path, size_t segment_size, enum sds_record_format format)
+{
+	struct recorder *recorder;
+	struct timespec realtime;
+	sds_error err = SDS_ERROR_SUCCESS;
+
+	if (!context || !path)
+		return SDS_ERROR_INVALID_PARAM;
+	if (!segment_size)
+		segment_size = RECORD_DEFAULT_SEGMENT_SIZE;
+	if (segment_size < RECORD_MIN_SEGMENT_SIZE ||
+	    (format != SDS_RECORD_RAW && format != SDS_RECORD_PACKED &&
+	     format != SDS_RECORD_COMPRESSED))
+		return SDS_ERROR_INVALID_PARAM;
+
+	/* Frames wait until the recorder is set up */
+	pthread_rwlock_wrlock(&context->recorder_lock);
+	if (context->recorder) {
+		err = SDS_ERROR_BUSY;
+		goto unlock;
+	}
+	recorder = calloc(1, sizeof(*recorder));
+	if (!recorder) {
+		err = SDS_ERROR_NO_MEM;
+		goto unlock;
+	}
+	recorder->path = strdup(path);
+	if (!recorder->path) {
+		err = SDS_ERROR_NO_MEM;
+		goto recorder_remove;
+	}
+	recorder->segment_size = align(segment_size, sysconf(_SC_PAGESIZE));
+	recorder->format = format;
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	recorder->clock_offset = (uint64_t) realtime.tv_sec * 1000000000
+				 + realtime.tv_nsec - get_time_ns();
+
+	/* The first segment is created right away to report errors */
+	if ((err = create_segment(recorder, 0, &recorder->current)))
+		goto recorder_remove;
+	recorder->segments = 1;
+	pthread_cond_init(&recorder->changed, NULL);
+	pthread_mutex_init(&recorder->lock, NULL);
+
+	context->recorder = recorder;
+	if (pthread_create(&recorder->thread, NULL, recorder_thread, context)) {
+		err = SDS_ERROR_NO_MEM;
+		goto sync_remove;
+	}
+	atomic_store(&context->recording, 1);
+	pthread_rwlock_unlock(&context->recorder_lock);
+	return err;
+
+sync_remove:
+	context->recorder = NULL;
+	pthread_cond_destroy(&recorder->changed);
+	pthread_mutex_destroy(&recorder->lock);
+	remove_segment(recorder, &recorder->current);
+
+recorder_remove:
+	free(recorder->path);
+	free(recorder);
+
+unlock:
+	pthread_rwlock_unlock(&context->recorder_lock);
+	return err;
+}
+
+sds_error sds_stop_recording(sds_context *context)
+{
+	if (!context)
+		return SDS_ERROR_INVALID_PARAM;
+	pthread_rwlock_wrlock(&context->recorder_lock);
+	if (context->recorder)
+		recorder_free(context);
+	pthread_rwlock_unlock(&context->recorder_lock);
+	return SDS_ERROR_SUCCESS;
+}
+
+/* Maps a segment for reading and checks its header */
+static sds_error map_segment(const char *path, struct recording_segment *segment,
+			     uint64_t *clock_offset)
+{
+	const struct record_header *header;
+	struct stat info;
+	sds_error err = SDS_ERROR_SUCCESS;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return errno_error(errno);
+	if (fstat(fd, &info)) {
+		err = errno_error(errno);
+		goto file_close;
+	}
+	if (info.st_size < RECORD_HEADER_SIZE) {
+		err = SDS_ERROR_IO;
+		goto file_close;
+	}
+	segment->size = info.st_size;
+	segment->map = mmap(NULL, segment->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (segment->map == MAP_FAILED) {
+		segment->map = NULL;
+		err = errno_error(errno);
+		goto file_close;
+	}
+
+	header = (const struct record_header *) segment->map;
+	segment->count = atomic_load_explicit(&header->count,
+					      memory_order_acquire);
+	if (memcmp(header->magic, RECORD_MAGIC, sizeof(header->magic)) ||
+	    header->format != RECORD_FORMAT || header->size != segment->size ||
+	    segment->count > (segment->size - RECORD_HEADER_SIZE)
+			     / sizeof(struct record_entry)) {
+		err = SDS_ERROR_IO;
+		munmap((void *) segment->map, segment->size);
+		segment->map = NULL;
+		goto file_close;
+	}
+	*clock_offset = header->clock_offset;
+
+file_close:
+	close(fd);
+	return err;
+}
+
+sds_error sds_recording_open(const char *path, sds_recording **recording)
+{
+	struct recording_segment *segments;
+	sds_recording *result;
+	char *name;
+	sds_error err = SDS_ERROR_SUCCESS;
+	unsigned int i;
+
+	if (!path || !recording)
+		return SDS_ERROR_INVALID_PARAM;
+	*recording = NULL;
+	result = calloc(1, sizeof(*result));
+	if (!result)
+		return SDS_ERROR_NO_MEM;
+
+	/* The segments are numbered without gaps */
+	for (;;) {
+		if (!(name = segment_path(path, result->segment_count))) {
+			err = SDS_ERROR_NO_MEM;
+			goto recording_close;
+		}
+		if (access(name, F_OK)) {
+			free(name);
+			break;
+		}
+		segments = realloc(result->segments, (result->segment_count + 1)
+						     * sizeof(*segments));
+		if (!segments) {
+			free(name);
+			err = SDS_ERROR_NO_MEM;
+			goto recording_close;
+		}
+		result->segments = segments;
+		err = map_segment(name, &segments[result->segment_count],
+				  &result->clock_offset);
+		free(name);
+		if (err)
+			goto recording_close;
+		segments[result->segment_count].first = result->count;
+		result->count += segments[result->segment_count].count;
+		result->segment_count++;
+	}
+	if (!result->segment_count) {
+		err = SDS_ERROR_NOT_FOUND;
+		goto recording_close;
+	}
+	*recording = result;
+	return err;
+
+recording_close:
+	for (i = 0; i < result->segment_count; i++)
+		munmap((void *) result->segments[i].map, result->segments[i].size);
+	free(result->segments);
+	free(result);
+	return err;
+}
+
+void sds_recording_close(sds_recording *recording)
+{
+	unsigned int i;
+
+	if (!recording)
+		return;
+	for (i = 0; i < recording->segment_count; i++)
+		munmap((void *) recording->segments[i].map,
+		       recording->segments[i].size);
+	free(recording->segments);
+	free(recording);
+}
+
+sds_error sds_recording_get_count(sds_recording *recording, uint64_t *count)
+{
+	if (!recording || !count)
+		return SDS_ERROR_INVALID_PARAM;
+	*count = recording->count;
+	return SDS_ERROR_SUCCESS;
+}
+
+sds_error sds_recording_get_frame(sds_recording *recording, uint64_t index, struct sds_recorded_frame *frame)
+{
+	const struct recording_segment *segment;
+	const struct record_entry *entry;
+	unsigned int low, high, middle;
+
+	if (!recording || !frame || index >= recording->count)
+		return SDS_ERROR_INVALID_PARAM;
+
+	/* Find the last segment that starts at or before the frame */
+	low = 0;
+	high = recording->segment_count;
+	while (high - low > 1) {
+		middle = (low + high) / 2;
+		if (recording->segments[middle].first <= index)
+			low = middle;
+		else
+			high = middle;
+	}
+	segment = &recording->segments[low];
+	entry = get_entry((unsigned char *) segment->map, segment->size,
+			  index - segment->first);
+	if (!valid_size(entry) || entry->data < RECORD_HEADER_SIZE ||
+	    entry->data + entry->size > segment->size)
+		return SDS_ERROR_IO;
+
+	frame->device = entry->device;
+	frame->timestamp = entry->timestamp;
+	frame->realtime = entry->timestamp + recording->clock_offset;
+	frame->config_version = entry->config_version;
+	frame->time = entry->time;
+	frame->voltage[0] = entry->voltage[0];
+	frame->voltage[1] = entry->voltage[1];
+	frame->offset[0] = entry->offset[0];
+	frame->offset[1] = entry->offset[1];
+	frame->count = entry->count;
+	frame->format = entry->format;
+	frame->encoded = segment->map + entry->data;
+	frame->encoded_size = entry->size;
+	frame->data = NULL;
+	if (entry->format == SDS_RECORD_RAW)
+		frame->data = (const struct sds_samples *) frame->encoded;
+	return SDS_ERROR_SUCCESS;
+}
+
+sds_error sds_recorded_frame_decode(const struct sds_recorded_frame *frame, uint16_t *advalues)
+{
+	if (!frame || !advalues)
+		return SDS_ERROR_INVALID_PARAM;
+	switch (frame->format) {
+		case SDS_RECORD_RAW:
+			decode_samples(frame->data, frame->count, advalues);
+			return SDS_ERROR_SUCCESS;
+		case SDS_RECORD_PACKED:
+			return sds_unpack_samples(frame->encoded,
+						  frame->encoded_size,
+						  frame->count, advalues);
+		case SDS_RECORD_COMPRESSED:
+			return sds_decompress_samples(frame->encoded,
+						      frame->encoded_size,
+						      frame->count, advalues);
+		default:
+			return SDS_ERROR_INVALID_PARAM;
+	}
+}
@@ -0,0 +1,486 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+/* A transport backend that replays a trace of a real device, recorded with
+ * USBPcap or Linux usbmon (read through the pcap reader of the tools). The
+ * recorded answers of the 0xc0 requests and the recorded payloads of the
+ * bulk endpoint are served in their original order, either at their
+ * original time or as fast as possible. All other requests are accepted
+ * without checking them against the trace, so the library may configure
+ * the device differently than the recording did. */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "internal.h"
+#include "usbpcap.h"
+
+/* pcap_types.h leaves the packing of structures on */
+#pragma pack()
+
+/* How many 0xc0 requests may wait for their completion in a trace */
+#define REPLAY_MAX_OPEN_POLLS 16
+
+/* A recorded answer of a 0xc0 request or a recorded bulk payload */
+struct replay_event
+{
+	uint64_t time; /* in ns since the first packet of the trace */
+	const unsigned char *data; /* points into the mapped trace */
+	uint32_t length;
+};
+
+/* A device that replays a trace */
+struct replay_device
+{
+	int realtime;
+	int loop;
+	PcapFile trace; /* the mapped file */
+	struct replay_event *polls;
+	size_t poll_count;
+	struct replay_event *bulks;
+	size_t bulk_count;
+	uint64_t duration; /* time of the last event */
+
+	pthread_mutex_t lock; /* protects the members below */
+	size_t next_poll;
+	size_t next_bulk;
+	uint64_t start; /* monotonic time of time 0 of the trace or 0 */
+};
+
+static int replay_add(struct replay_event **events, size_t *count,
+		      uint64_t time, const unsigned char *data,
+		      uint32_t length)
+{
+	struct replay_event *more;
+
+	/* Grow in powers of two */
+	if (!(*count & (*count - 1))) {
+		more = realloc(*events, (*count ? 2 * *count : 1)
+					* sizeof(**events));
+		if (!more)
+			return LIBUSB_ERROR_NO_MEM;
+		*events = more;
+	}
+	(*events)[*count].time = time;
+	(*events)[*count].data = data;
+	(*events)[*count].length = length;
+	(*count)++;
+	return LIBUSB_SUCCESS;
+}
+
+/* Extracts the events of the first device that issues 0xc0 requests */
+static int replay_parse(struct replay_device *device)
+{
+	uint64_t open_polls[REPLAY_MAX_OPEN_POLLS];
+	unsigned int open_count = 0;
+	uint64_t first = 0;
+	uint64_t time;
+	int address = -1;
+	PcapRecord record;
+	unsigned int i;
+	int err;
+
+	while (pcapNext(&device->trace, &record)) {
+		const USBPCAP_BUFFER_PACKET_HEADER *packet = recordPacket(&record);
+		const USBPCAP_BUFFER_CONTROL_HEADER *control = recordControl(&record);
+		const USB_SETUP *setup = recordSetup(&record);
+		const unsigned char *data;
+		uint32_t data_length;
+
+		time = (uint64_t) record.ts.tv_sec * 1000000000
+		       + (uint64_t) record.ts.tv_usec * 1000;
+		if (!first)
+			first = time;
+		time -= first;
+
+		if (!packet)
+			continue;
+
+		if (setup) {
+			if (setup->bmRequestType != SDS_BM_REQUEST_TYPE_IN ||
+			    setup->bRequest != SDS_REQUEST_DATA_AVAILABLE)
+				continue;
+			/* The first device polling is the oscilloscope */
+			if (address < 0)
+				address = packet->device;
+			if (packet->device != address)
+				continue;
+			if (open_count == REPLAY_MAX_OPEN_POLLS)
+				return LIBUSB_ERROR_OVERFLOW;
+			open_polls[open_count++] = packet->irpId;
+		} else if (control &&
+			   control->stage == USBPCAP_CONTROL_STAGE_DATA &&
+			   !hostToDevice(packet->info) &&
+			   packet->device == address) {
+			for (i = 0; i < open_count; ++i)
+				if (open_polls[i] == packet->irpId)
+					break;
+			if (i == open_count)
+				continue;
+			open_polls[i] = open_polls[--open_count];
+			data = recordControlData(&record, &data_length);
+			if (packet->status || !data_length)
+				continue;
+			if ((err = replay_add(&device->polls,
+					      &device->poll_count,
+					      time, data, 1)))
+				return err;
+		} else if (packet->transfer == USBPCAP_TRANSFER_BULK &&
+			   packet->endpoint == SDS_ENDPOINT_BULK_IN &&
+			   !hostToDevice(packet->info) &&
+			   packet->device == address &&
+			   !packet->status) {
+			data = recordPayload(&record, &data_length);
+			if (!data_length)
+				continue;
+			if ((err = replay_add(&device->bulks,
+					      &device->bulk_count,
+					      time, data, data_length)))
+				return err;
+		}
+		device->duration = time;
+	}
+
+	return device->poll_count ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static void replay_free(struct replay_device *device)
+{
+	free(device->polls);
+	free(device->bulks);
+	pcapClose(&device->trace);
+	free(device);
+}
+
+static int replay_open(struct backend *backend, struct sds_device *device,
+		       sds_context *context)
+{
+	struct device_info *info = device->device_ptr;
+	struct replay_device *replay;
+	char errbuf[PCAP_ERRBUF_SIZE];
+	int err;
+
+	if (!info || info->kind != DEVICE_REPLAYED)
+		return LIBUSB_ERROR_NOT_FOUND;
+	replay = calloc(1, sizeof(*replay));
+	if (!replay)
+		return LIBUSB_ERROR_NO_MEM;
+	replay->realtime = info->replay.realtime;
+	replay->loop = info->replay.loop;
+
+	/* The reader only describes its errors in errbuf */
+	if (pcapOpen(&replay->trace, info->replay.path, errbuf)) {
+		free(replay);
+		return errno == ENOENT ? LIBUSB_ERROR_NOT_FOUND
+				       : LIBUSB_ERROR_IO;
+	}
+	if ((err = replay_parse(replay))) {
+		replay_free(replay);
+		return err;
+	}
+
+	pthread_mutex_init(&replay->lock, NULL);
+	context->device = replay;
+	/* There are no relays to wait for */
+	context->relay_wait = 0;
+	return LIBUSB_SUCCESS;
+}
+
+static void replay_close(sds_context *context)
+{
+	struct replay_device *replay = context->device;
+
+	if (!replay)
+		return;
+	pthread_mutex_destroy(&replay->lock);
+	replay_free(replay);
+	context->device = NULL;
+}
+
+/* Returns the next event of a kind or NULL at the end of the trace. Starts
+ * over if the replay loops. Requires the device lock. */
+static struct replay_event *replay_next(struct replay_device *replay,
+					int bulk)
+{
+	size_t next = bulk ? replay->next_bulk : replay->next_poll;
+	size_t count = bulk ? replay->bulk_count : replay->poll_count;
+
+	if (next == count) {
+		/* Both kinds start over together */
+		if (!replay->loop)
+			return NULL;
+		replay->next_poll = 0;
+		replay->next_bulk = 0;
+		replay->start += replay->duration + 1;
+		next = 0;
+	}
+	if (!count)
+		return NULL;
+	return bulk ? &replay->bulks[next] : &replay->polls[next];
+}
+
+/* Returns whether there is another event of a kind, like replay_next()
+ * but without starting over. Requires the device lock. */
+static int replay_has_next(struct replay_device *replay, int bulk)
+{
+	size_t next = bulk ? replay->next_bulk : replay->next_poll;
+	size_t count = bulk ? replay->bulk_count : replay->poll_count;
+
+	return count && (next < count || replay->loop);
+}
+
+/* Returns when the next event of a kind is due. The replay starts with the
+ * first request. Requires the device lock. */
+static uint64_t replay_due(struct replay_device *replay, int bulk)
+{
+	struct replay_event *event;
+	uint64_t now = get_time_ns();
+
+	if (!replay->realtime)
+		return now;
+	event = replay_next(replay, bulk);
+	if (!event)
+		return now;
+	if (!replay->start)
+		replay->start = now - event->time;
+	return replay->start + event->time;
+}
+
+/* Serves the next 0xc0 answer. Requires the device lock. */
+static void replay_poll(struct replay_device *replay, unsigned char *data)
+{
+	struct replay_event *event = replay_next(replay, 0);
+
+	data[0] = 0;
+	if (!event)
+		return;
+	replay->next_poll++;
+	/* Do not announce data that the trace does not contain */
+	if (replay_has_next(replay, 1))
+		data[0] = event->data[0];
+}
+
+/* Serves the next bulk payload and returns its size or a negative value at
+ * the end of the trace. Requires the device lock. */
+static int replay_bulk(struct replay_device *replay, unsigned char *data,
+		       int length)
+{
+	struct replay_event *event = replay_next(replay, 1);
+
+	if (!event)
+		return LIBUSB_ERROR_TIMEOUT;
+	replay->next_bulk++;
+	/* The library might use a smaller buffer than the original driver,
+	 * the rest of the payload is dropped then */
+	if (event->length < (uint32_t) length)
+		length = event->length;
+	memcpy(data, event->data, length);
+	return length;
+}
+
+/* Waits until an event is due or the timeout (in ms) expired. Returns false
+ * in the latter case. Requires the device lock. */
+static int replay_wait(struct replay_device *replay, int bulk,
+		       unsigned int timeout)
+{
+	uint64_t now = get_time_ns();
+	uint64_t due = replay_due(replay, bulk);
+	int in_time = 1;
+
+	if (due <= now)
+		return 1;
+	if (timeout && due - now > (uint64_t) timeout * 1000000) {
+		due = now + (uint64_t) timeout * 1000000;
+		in_time = 0;
+	}
+	pthread_mutex_unlock(&replay->lock);
+	usleep((due - now) / 1000);
+	pthread_mutex_lock(&replay->lock);
+	return in_time;
+}
+
+static int replay_control(sds_context *context,
+			  uint8_t bmRequestType,
+			  uint8_t bRequest,
+			  uint16_t wValue,
+			  uint16_t wIndex,
+			  unsigned char *data,
+			  uint16_t wLength,
+			  unsigned int timeout)
+{
+	struct replay_device *replay = context->device;
+
+	if (bmRequestType == SDS_BM_REQUEST_TYPE_OUT)
+		return wLength;
+	if (bRequest != SDS_REQUEST_DATA_AVAILABLE || wLength < 1)
+		return LIBUSB_ERROR_PIPE;
+
+	pthread_mutex_lock(&replay->lock);
+	if (replay_wait(replay, 0, timeout))
+		replay_poll(replay, data);
+	else
+		data[0] = 0;
+	pthread_mutex_unlock(&replay->lock);
+	return 1;
+}
+
+static int replay_bulk_in(sds_context *context,
+			  unsigned char endpoint,
+			  unsigned char *data,
+			  int length,
+			  int *transferred,
+			  unsigned int timeout)
+{
+	struct replay_device *replay = context->device;
+	int result = LIBUSB_ERROR_TIMEOUT;
+
+	if (endpoint != SDS_ENDPOINT_BULK_IN)
+		return LIBUSB_ERROR_PIPE;
+
+	pthread_mutex_lock(&replay->lock);
+	if (replay_wait(replay, 1, timeout))
+		result = replay_bulk(replay, data, length);
+	pthread_mutex_unlock(&replay->lock);
+	if (result < 0)
+		return result;
+	*transferred = result;
+	return LIBUSB_SUCCESS;
+}
+
+static int replay_submit(sds_context *context,
+			 struct libusb_transfer *transfer)
+{
+	struct replay_device *replay = context->device;
+	uint64_t due;
+
+	pthread_mutex_lock(&replay->lock);
+	due = replay_due(replay,
+			 transfer->type != LIBUSB_TRANSFER_TYPE_CONTROL);
+	pthread_mutex_unlock(&replay->lock);
+	return emulated_submit(context, transfer, due);
+}
+
+static void replay_complete(sds_context *context,
+			    struct libusb_transfer *transfer)
+{
+	struct replay_device *replay = context->device;
+	struct libusb_control_setup *setup;
+	int result;
+
+	transfer->status = LIBUSB_TRANSFER_COMPLETED;
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		setup = libusb_control_transfer_get_setup(transfer);
+		transfer->actual_length = libusb_le16_to_cpu(setup->wLength);
+		if (setup->bmRequestType == SDS_BM_REQUEST_TYPE_OUT)
+			return;
+		if (setup->bRequest != SDS_REQUEST_DATA_AVAILABLE ||
+		    transfer->actual_length < 1) {
+			transfer->status = LIBUSB_TRANSFER_STALL;
+			transfer->actual_length = 0;
+			return;
+		}
+		pthread_mutex_lock(&replay->lock);
+		replay_poll(replay, libusb_control_transfer_get_data(transfer));
+		pthread_mutex_unlock(&replay->lock);
+		transfer->actual_length = 1;
+		return;
+	}
+
+	pthread_mutex_lock(&replay->lock);
+	result = replay_bulk(replay, transfer->buffer, transfer->length);
+	pthread_mutex_unlock(&replay->lock);
+	if (result < 0)
+		transfer->status = LIBUSB_TRANSFER_TIMED_OUT;
+	else
+		transfer->actual_length = result;
+}
+
+static void replay_destroy(struct backend *backend)
+{
+	emulated_release((struct emulated_backend *) backend);
+	free(backend);
+}
+
+static const struct backend_ops replay_ops = {
+	.open = replay_open,
+	.close = replay_close,
+	.control = replay_control,
+	.bulk_in = replay_bulk_in,
+	.submit = replay_submit,
+	.cancel = emulated_cancel,
+	.handle_events = emulated_handle_events,
+	.destroy = replay_destroy,
+};
+
+sds_error replay_create(struct backend **backend)
+{
+	struct emulated_backend *replay = malloc(sizeof(*replay));
+
+	if (!replay)
+		return SDS_ERROR_NO_MEM;
+	emulated_init(replay, &replay_ops, replay_complete);
+	*backend = &replay->backend;
+	return SDS_ERROR_SUCCESS;
+}
+
+sds_error sds_get_replay_devices(const struct sds_replay *replays, unsigned int count, struct sds_device_list **list)
+{
+	struct device_info *info;
+	size_t length;
+	unsigned int i;
+
+	if (!replays || !count || !list)
+		return SDS_ERROR_INVALID_PARAM;
+	for (i = 0; i < count; ++i)
+		if (!replays[i].path)
+			return SDS_ERROR_INVALID_PARAM;
+	*list = malloc(sizeof(**list));
+	if (!*list)
+		return SDS_ERROR_NO_MEM;
+	(*list)->size = count;
+	(*list)->devices_ptr = NULL;
+	(*list)->array = calloc(count, sizeof(*(*list)->array));
+	if (!(*list)->array) {
+		free(*list);
+		*list = NULL;
+		return SDS_ERROR_NO_MEM;
+	}
+
+	for (i = 0; i < count; ++i) {
+		/* The path is stored behind the info, so it is freed along */
+		length = strlen(replays[i].path) + 1;
+		info = malloc(sizeof(*info) + length);
+		if (!info) {
+			/* calloc left the remaining device_ptrs NULL */
+			sds_free_devices(*list);
+			*list = NULL;
+			return SDS_ERROR_NO_MEM;
+		}
+		info->kind = DEVICE_REPLAYED;
+		info->replay = replays[i];
+		info->replay.path = memcpy(info + 1, replays[i].path, length);
+		/* Replayed devices sit on the (nonexistent) bus 0 as well */
+		(*list)->array[i].bus_no = 0;
+		(*list)->array[i].port_no = i + 1;
+		(*list)->array[i].device_ptr = info;
+	}
+	return SDS_ERROR_SUCCESS;
+}
@@ -0,0 +1,474 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+/* A transport backend that simulates devices in software. It understands the
+ * requests the library sends (0xd0, 0xb1/0xb3, 0xb5, 0xb2 and 0xc0) and
+ * answers bulk reads with frames of synthetic signals in the format described
+ * in dataformat.md. Nothing about the real device is known beyond that
+ * protocol, so the analog frontend is modeled coarsely:
+ *  - The voltage relays select 100mV, 1V or 10V per division.
+ *  - A division has SIM_TICKS_PER_DIV ticks around the center of the range.
+ *  - The coupling relays are ignored (the signals have no DC component).
+ *
+ * A realtime simulation produces a frame every ten divisions (but not faster
+ * than the USB transfers of the real device), waits for the relays and
+ * delays control transfers. Otherwise a frame is always available. */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/* Time (in us) a control transfer takes in a realtime simulation */
+#define SIM_CONTROL_LATENCY 125
+
+/* Least time (in ns) between two frames in a realtime simulation */
+#define SIM_MIN_FRAME_INTERVAL 1000000
+
+/* Ticks of the A/D converter per division and the center of its range */
+#define SIM_TICKS_PER_DIV 128
+#define SIM_ZERO 512
+#define SIM_MAX 1023
+
+/* The raw offset (0xb2) that does not move the signal */
+#define SIM_OFFSET_ZERO 1024
+
+/* The bit of byte 19 of the state word that selects the normal trigger mode
+ * and the bits of byte 15 for the trigger slope and source */
+#define SIM_STATE_NORMAL 0x08
+#define SIM_STATE_FALLING 0x01
+#define SIM_STATE_CH2 0x02
+
+#define SIM_PI 3.14159265358979323846
+
+/* A simulated device */
+struct sim_device
+{
+	struct sds_simulation simulation;
+	pthread_mutex_t lock; /* protects the members below */
+	unsigned char relays; /* bit i set -> relay i is switched */
+	unsigned int offset[2]; /* raw offsets of both channels */
+	char state[SDS_STATE_SIZE]; /* the last state word */
+	enum sds_time time; /* time/div recognized in the state word or 0 */
+	uint64_t next_frame; /* realtime: when the next frame is complete */
+	uint64_t frames; /* amount of frames produced so far */
+	uint32_t seed; /* state of the noise generator */
+};
+
+static void sim_reset(struct sim_device *device)
+{
+	device->relays = 0;
+	device->offset[0] = SIM_OFFSET_ZERO;
+	device->offset[1] = SIM_OFFSET_ZERO;
+	memset(device->state, 0, sizeof(device->state));
+	device->time = 0;
+	device->next_frame = 0;
+}
+
+/* Returns the time/div selected by a state word or 0 if it is unknown. The
+ * trigger settings share bytes 15 and 19 with the time words. */
+static enum sds_time sim_get_time(const char *state)
+{
+	enum sds_time time;
+	const char *command;
+
+	for (time = SDS_2ns; time <= SDS_10s; ++time) {
+		command = get_time_command(time);
+		if (!memcmp(command, state, 15) &&
+		    !((command[19] ^ state[19]) & ~SIM_STATE_NORMAL))
+			return time;
+	}
+	return 0;
+}
+
+static uint64_t sim_frame_interval(struct sim_device *device)
+{
+	uint64_t interval = 10 * get_time_per_div(device->time);
+	return (interval < SIM_MIN_FRAME_INTERVAL) ? SIM_MIN_FRAME_INTERVAL
+						   : interval;
+}
+
+/* Returns true if a frame can be read. Requires the device lock. */
+static int sim_frame_ready(struct sim_device *device, uint64_t now)
+{
+	if (!device->time)
+		return 0;
+	return !device->simulation.realtime || now >= device->next_frame;
+}
+
+/* Handles a control transfer. Requires the device lock. */
+static int sim_control(struct sim_device *device,
+		       uint8_t bmRequestType,
+		       uint8_t bRequest,
+		       unsigned char *data,
+		       uint16_t wLength)
+{
+	unsigned char bits;
+	enum sds_time time;
+
+	if (bRequest == SDS_REQUEST_DATA_AVAILABLE) {
+		if (bmRequestType != SDS_BM_REQUEST_TYPE_IN || wLength < 1)
+			return LIBUSB_ERROR_PIPE;
+		data[0] = sim_frame_ready(device, get_time_ns());
+		return 1;
+	}
+	if (bmRequestType != SDS_BM_REQUEST_TYPE_OUT)
+		return LIBUSB_ERROR_PIPE;
+
+	switch (bRequest) {
+		case SDS_REQUEST_RESET:
+			sim_reset(device);
+			return 0;
+		case SDS_REQUEST_RELAY:
+			if (wLength != 1)
+				return LIBUSB_ERROR_PIPE;
+			/* One bit set switches a relay, one bit cleared
+			 * releases it and 0 flushes */
+			bits = data[0];
+			if (bits && !(bits & (bits - 1)))
+				device->relays |= bits;
+			else if ((unsigned char) ~bits &&
+				 !((unsigned char) ~bits & ((unsigned char) ~bits - 1)))
+				device->relays &= bits;
+			return 1;
+		case SDS_REQUEST_STATE1:
+		case SDS_REQUEST_STATE2:
+			if (wLength != SDS_STATE_SIZE)
+				return LIBUSB_ERROR_PIPE;
+			memcpy(device->state, data, SDS_STATE_SIZE);
+			time = sim_get_time(device->state);
+			if (time && time != device->time) {
+				/* Start over with the new time base */
+				device->time = time;
+				device->next_frame = get_time_ns()
+						     + sim_frame_interval(device);
+			}
+			return SDS_STATE_SIZE;
+		case SDS_REQUEST_OFFSET:
+			if (wLength != 3)
+				return LIBUSB_ERROR_PIPE;
+			device->offset[data[2] ? 0 : 1] = data[0]
+							  | (data[1] & 0xf) << 8;
+			return 3;
+		default:
+			return LIBUSB_ERROR_PIPE;
+	}
+}
+
+/* Returns the signal (-1 .. 1) of a waveform at the given phase */
+static double sim_wave(enum sds_waveform waveform, double phase,
+		       uint32_t *seed)
+{
+	switch (waveform) {
+		case SDS_SINE:
+			return sin(2 * SIM_PI * phase);
+		case SDS_SQUARE:
+			return (phase - floor(phase) < 0.5) ? 1.0 : -1.0;
+		case SDS_NOISE:
+			/* xorshift32 */
+			*seed ^= *seed << 13;
+			*seed ^= *seed >> 17;
+			*seed ^= *seed << 5;
+			return *seed / 2147483648.0 - 1.0;
+		default:
+			return 0.0;
+	}
+}
+
+/* Returns the volts per division selected by the relays of a channel */
+static double sim_volts_per_div(struct sim_device *device, int channel)
+{
+	if (device->relays & (1 << (channel ? ch2_100_relay : ch1_100_relay)))
+		return 10.0;
+	if (device->relays & (1 << (channel ? ch2_10_relay : ch1_10_relay)))
+		return 1.0;
+	return 0.1;
+}
+
+/* Fills data with the next frame and returns its size. The size is the one
+ * the library reads (get_frame_size), which is 8192 bytes for every
+ * time/div setting. Real devices send between 64 and 20096 bytes depending
+ * on the setting (dataformat.md), but the sizes per setting are not known
+ * yet. Requires the device lock and a ready frame. */
+static int sim_frame(struct sim_device *device, unsigned char *data,
+		     int length)
+{
+	struct sds_simulation *simulation = &device->simulation;
+	uint64_t interval = 10 * get_time_per_div(device->time);
+	uint64_t now = get_time_ns();
+	int size = get_frame_size(device->time);
+	int count;
+	int trigger;
+	double start;
+	double step;
+	double scale[2];
+	double shift[2];
+	double phase0;
+	double value;
+	int i;
+
+	if (size > length)
+		size = length;
+	count = (size - 8) / 2;
+	memset(data, 0, 8);
+
+	/* The capture covered the last ten divisions. The time of a
+	 * simulation that runs as fast as possible only exists virtually. */
+	if (simulation->realtime)
+		start = (now - interval) / 1e9;
+	else
+		start = device->frames * (sim_frame_interval(device) / 1e9);
+	step = interval / 1e9 / ((count + 1) / 2);
+
+	/* In the normal mode the frame starts when the signal of the trigger
+	 * source passes the slope */
+	trigger = (device->state[15] & SIM_STATE_CH2) ? 1 : 0;
+	if ((device->state[19] & SIM_STATE_NORMAL) &&
+	    simulation->waveform[trigger] != SDS_NOISE &&
+	    simulation->frequency[trigger] > 0) {
+		phase0 = (device->state[15] & SIM_STATE_FALLING) ? 0.5 : 0.0;
+		start = (ceil(start * simulation->frequency[trigger] - phase0)
+			 + phase0) / simulation->frequency[trigger];
+	}
+
+	for (i = 0; i < 2; ++i) {
+		scale[i] = simulation->amplitude[i] * SIM_TICKS_PER_DIV
+			   / sim_volts_per_div(device, i);
+		shift[i] = SIM_ZERO + ((double) device->offset[i]
+				       - SIM_OFFSET_ZERO) / 2;
+	}
+
+	/* The samples of both channels alternate */
+	for (i = 0; i < count; ++i) {
+		int channel = i & 1;
+		double t = start + (i >> 1) * step;
+		unsigned int sample;
+
+		value = shift[channel] + scale[channel]
+			* sim_wave(simulation->waveform[channel],
+				   t * simulation->frequency[channel],
+				   &device->seed);
+		if (value < 0)
+			sample = 0;
+		else if (value > SIM_MAX)
+			sample = SIM_MAX;
+		else
+			sample = (unsigned int) value;
+		data[8 + 2 * i] = sample & 0x3f;
+		data[9 + 2 * i] = 0x80 | (channel ? 0x40 : 0)
+				  | ((sample >> 6) & 0xf);
+	}
+
+	device->frames++;
+	device->next_frame = now + sim_frame_interval(device);
+	return 8 + 2 * count;
+}
+
+static int sim_open(struct backend *backend, struct sds_device *device,
+		    sds_context *context)
+{
+	struct device_info *info = device->device_ptr;
+	struct sim_device *sim;
+
+	if (!info || info->kind != DEVICE_SIMULATED)
+		return LIBUSB_ERROR_NOT_FOUND;
+	sim = calloc(1, sizeof(*sim));
+	if (!sim)
+		return LIBUSB_ERROR_NO_MEM;
+	sim->simulation = info->simulation;
+	sim->seed = 0x9e3779b9 ^ (device->bus_no << 16) ^ device->port_no;
+	pthread_mutex_init(&sim->lock, NULL);
+	sim_reset(sim);
+
+	context->device = sim;
+	context->relay_wait = sim->simulation.realtime ? SDS_RELAY_WAIT : 0;
+	return LIBUSB_SUCCESS;
+}
+
+static void sim_close(sds_context *context)
+{
+	struct sim_device *sim = context->device;
+
+	if (!sim)
+		return;
+	pthread_mutex_destroy(&sim->lock);
+	free(sim);
+	context->device = NULL;
+}
+
+static int sim_control_sync(sds_context *context,
+			    uint8_t bmRequestType,
+			    uint8_t bRequest,
+			    uint16_t wValue,
+			    uint16_t wIndex,
+			    unsigned char *data,
+			    uint16_t wLength,
+			    unsigned int timeout)
+{
+	struct sim_device *sim = context->device;
+	int err;
+
+	if (sim->simulation.realtime)
+		usleep(SIM_CONTROL_LATENCY);
+	pthread_mutex_lock(&sim->lock);
+	err = sim_control(sim, bmRequestType, bRequest, data, wLength);
+	pthread_mutex_unlock(&sim->lock);
+	return err;
+}
+
+static int sim_bulk_in(sds_context *context,
+		       unsigned char endpoint,
+		       unsigned char *data,
+		       int length,
+		       int *transferred,
+		       unsigned int timeout)
+{
+	struct sim_device *sim = context->device;
+	uint64_t deadline = get_time_ns() + (uint64_t) timeout * 1000000;
+	uint64_t now;
+
+	if (endpoint != SDS_ENDPOINT_BULK_IN)
+		return LIBUSB_ERROR_PIPE;
+
+	/* Like the real device, wait until the frame is complete */
+	pthread_mutex_lock(&sim->lock);
+	while (!sim_frame_ready(sim, now = get_time_ns())) {
+		uint64_t wake = sim->time ? sim->next_frame : deadline;
+		if (now >= deadline) {
+			pthread_mutex_unlock(&sim->lock);
+			return LIBUSB_ERROR_TIMEOUT;
+		}
+		pthread_mutex_unlock(&sim->lock);
+		usleep(((wake < deadline) ? wake - now : deadline - now)
+		       / 1000 + 1);
+		pthread_mutex_lock(&sim->lock);
+	}
+	*transferred = sim_frame(sim, data, length);
+	pthread_mutex_unlock(&sim->lock);
+	return LIBUSB_SUCCESS;
+}
+
+static int sim_submit(sds_context *context, struct libusb_transfer *transfer)
+{
+	struct sim_device *sim = context->device;
+	uint64_t due = get_time_ns();
+
+	if (sim->simulation.realtime &&
+	    transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+		due += SIM_CONTROL_LATENCY * 1000;
+	return emulated_submit(context, transfer, due);
+}
+
+static void sim_complete(sds_context *context, struct libusb_transfer *transfer)
+{
+	struct sim_device *sim = context->device;
+	struct libusb_control_setup *setup;
+	int result;
+
+	pthread_mutex_lock(&sim->lock);
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		setup = libusb_control_transfer_get_setup(transfer);
+		result = sim_control(sim,
+				     setup->bmRequestType,
+				     setup->bRequest,
+				     libusb_control_transfer_get_data(transfer),
+				     libusb_le16_to_cpu(setup->wLength));
+		if (result >= 0) {
+			transfer->status = LIBUSB_TRANSFER_COMPLETED;
+			transfer->actual_length = result;
+		} else {
+			transfer->status = LIBUSB_TRANSFER_STALL;
+		}
+	} else if (sim_frame_ready(sim, get_time_ns())) {
+		transfer->status = LIBUSB_TRANSFER_COMPLETED;
+		transfer->actual_length = sim_frame(sim, transfer->buffer,
+						    transfer->length);
+	} else {
+		transfer->status = LIBUSB_TRANSFER_TIMED_OUT;
+	}
+	pthread_mutex_unlock(&sim->lock);
+}
+
+static void sim_destroy(struct backend *backend)
+{
+	emulated_release((struct emulated_backend *) backend);
+	free(backend);
+}
+
+static const struct backend_ops sim_ops = {
+	.open = sim_open,
+	.close = sim_close,
+	.control = sim_control_sync,
+	.bulk_in = sim_bulk_in,
+	.submit = sim_submit,
+	.cancel = emulated_cancel,
+	.handle_events = emulated_handle_events,
+	.destroy = sim_destroy,
+};
+
+sds_error sim_create(struct backend **backend)
+{
+	struct emulated_backend *sim = malloc(sizeof(*sim));
+
+	if (!sim)
+		return SDS_ERROR_NO_MEM;
+	emulated_init(sim, &sim_ops, sim_complete);
+	*backend = &sim->backend;
+	return SDS_ERROR_SUCCESS;
+}
+
+sds_error sds_get_simulated_devices(const struct sds_simulation *simulation, unsigned int count, struct sds_device_list **list)
+{
+	struct device_info *info;
+	unsigned int i;
+
+	if (!simulation || !count || !list)
+		return SDS_ERROR_INVALID_PARAM;
+	*list = malloc(sizeof(**list));
+	if (!*list)
+		return SDS_ERROR_NO_MEM;
+	(*list)->size = count;
+	(*list)->devices_ptr = NULL;
+	(*list)->array = calloc(count, sizeof(*(*list)->array));
+	if (!(*list)->array) {
+		free(*list);
+		*list = NULL;
+		return SDS_ERROR_NO_MEM;
+	}
+
+	for (i = 0; i < count; ++i) {
+		info = malloc(sizeof(*info));
+		if (!info)
+			goto list_remove;
+		info->kind = DEVICE_SIMULATED;
+		info->simulation = *simulation;
+		/* Simulated devices sit on the (nonexistent) bus 0 */
+		(*list)->array[i].bus_no = 0;
+		(*list)->array[i].port_no = i + 1;
+		(*list)->array[i].device_ptr = info;
+	}
+	return SDS_ERROR_SUCCESS;
+
+list_remove:
+	/* calloc left the remaining device_ptrs NULL */
+	sds_free_devices(*list);
+	*list = NULL;
+	return SDS_ERROR_NO_MEM;
+}
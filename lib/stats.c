@@ -0,0 +1,124 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+/* Counters of the transfers of a context. The acquisition path only does a
+ * few relaxed atomic increments, so counting is always enabled. */
+
+#include "internal.h"
+
+void stats_error(sds_context *context, sds_error err)
+{
+	switch (err) {
+		case SDS_ERROR_SUCCESS:
+			break;
+		case SDS_ERROR_TIMEOUT:
+			stats_add(&context->stats.timeouts, 1);
+			break;
+		case SDS_ERROR_OVERFLOW:
+			stats_add(&context->stats.overflows, 1);
+			break;
+		default:
+			stats_add(&context->stats.errors, 1);
+			break;
+	}
+}
+
+void stats_latency(_Atomic uint64_t *histogram, uint64_t duration)
+{
+	uint64_t us = duration / 1000;
+	unsigned int bucket = 0;
+
+	/* The bucket is the position of the highest bit set */
+	if (us)
+		bucket = 64 - __builtin_clzll(us);
+	if (bucket >= SDS_STATS_BUCKETS)
+		bucket = SDS_STATS_BUCKETS - 1;
+	stats_add(&histogram[bucket], 1);
+}
+
+void stats_poll(sds_context *context, uint64_t now, int available)
+{
+	uint64_t idle = 0;
+
+	if (!available)
+		stats_add(&context->stats.empty_polls, 1);
+	/* Only the first poll for a frame starts the wait */
+	atomic_compare_exchange_strong(&context->stats.poll_start, &idle, now);
+}
+
+void stats_frame(sds_context *context, uint64_t start, uint64_t now,
+		 unsigned int bytes)
+{
+	uint64_t poll_start = atomic_exchange(&context->stats.poll_start, 0);
+
+	stats_add(&context->stats.bulk_transfers, 1);
+	stats_add(&context->stats.bulk_bytes, bytes);
+	stats_latency(context->stats.transfer_latency, now - start);
+	if (poll_start)
+		stats_latency(context->stats.poll_latency, now - poll_start);
+}
+
+/* Returns the value of a counter and sets it to zero if reset is true */
+static uint64_t fetch(_Atomic uint64_t *counter, int reset)
+{
+	if (reset)
+		return atomic_exchange_explicit(counter, 0,
+						memory_order_relaxed);
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/* Copies the counters to stats (if not NULL) and resets them if requested */
+static void collect(sds_context *context, struct sds_stats *stats, int reset)
+{
+	struct stats *counters = &context->stats;
+	struct sds_stats ignored;
+	unsigned int i;
+
+	if (!stats)
+		stats = &ignored;
+	stats->control_transfers = fetch(&counters->control_transfers, reset);
+	stats->bulk_transfers = fetch(&counters->bulk_transfers, reset);
+	stats->bulk_bytes = fetch(&counters->bulk_bytes, reset);
+	stats->empty_polls = fetch(&counters->empty_polls, reset);
+	stats->timeouts = fetch(&counters->timeouts, reset);
+	stats->overflows = fetch(&counters->overflows, reset);
+	stats->errors = fetch(&counters->errors, reset);
+	stats->dropped_frames = fetch(&counters->dropped_frames, reset);
+	for (i = 0; i < SDS_STATS_BUCKETS; ++i) {
+		stats->poll_latency[i] = fetch(&counters->poll_latency[i],
+					       reset);
+		stats->transfer_latency[i] =
+			fetch(&counters->transfer_latency[i], reset);
+	}
+}
+
+sds_error sds_get_stats(sds_context *context, struct sds_stats *stats)
+{
+	if (!context || !stats)
+		return SDS_ERROR_INVALID_PARAM;
+	collect(context, stats, 0);
+	return SDS_ERROR_SUCCESS;
+}
+
+sds_error sds_reset_stats(sds_context *context)
+{
+	if (!context)
+		return SDS_ERROR_INVALID_PARAM;
+	collect(context, NULL, 1);
+	return SDS_ERROR_SUCCESS;
+}
@@ -0,0 +1,122 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+/* The detection of stalled devices follows the time/div setting. A frame
+ * covers ten divisions, so that is the least time the device needs to
+ * provide a new one. Since the real rate also depends on the trigger and on
+ * the consumer, the observed interval between frames is estimated as well
+ * and the larger of both is used.
+ *
+ * The bulk transfers keep a short timeout, they are only issued after the
+ * device announced a frame. A device that stops announcing frames is
+ * detected by the polls instead: if none announced data for a few frame
+ * intervals, the device is considered stalled. */
+
+#include "internal.h"
+
+/* Weight of a new measurement in the frame interval estimation (1/n) */
+#define TIMING_INTERVAL_WEIGHT 8
+
+/* Amount of divisions covered by one frame */
+#define TIMING_DIVISIONS 10
+
+/* The device may announce no frame for this multiple of the frame interval
+ * before it is considered stalled */
+#define TIMING_STALL_FACTOR 3
+
+/* Time (in ms) added to every stall deadline for the polls themselves */
+#define TIMING_STALL_BASE SDS_DEFAULT_TIMEOUT
+
+uint64_t get_time_per_div(enum sds_time time)
+{
+	/* The settings follow the sequence 2, 4, 10, 20, 40, 100, ... ns */
+	static const uint64_t mantissa[] = { 2, 4, 10 };
+	uint64_t result;
+	int i;
+
+	if (time < SDS_2ns || time > SDS_10s)
+		return 0;
+	result = mantissa[(time - SDS_2ns) % 3];
+	for (i = (time - SDS_2ns) / 3; i > 0; --i)
+		result *= 10;
+	return result;
+}
+
+void timing_reset(sds_context *context)
+{
+	atomic_store(&context->last_frame, 0);
+	atomic_store(&context->frame_interval, 0);
+	atomic_store(&context->waiting_since, 0);
+}
+
+void timing_frame(sds_context *context, uint64_t timestamp)
+{
+	uint64_t last = atomic_exchange(&context->last_frame, timestamp);
+	uint64_t interval;
+	int64_t sample;
+
+	atomic_store(&context->waiting_since, timestamp);
+	if (!last || timestamp <= last)
+		return;
+	sample = timestamp - last;
+	interval = atomic_load(&context->frame_interval);
+	if (interval)
+		interval += (sample - (int64_t) interval)
+			    / TIMING_INTERVAL_WEIGHT;
+	else
+		interval = sample;
+	atomic_store(&context->frame_interval, interval);
+}
+
+uint64_t get_frame_interval(sds_context *context, enum sds_time time)
+{
+	uint64_t expected = TIMING_DIVISIONS * get_time_per_div(time);
+	uint64_t observed = atomic_load(&context->frame_interval);
+
+	return (observed > expected) ? observed : expected;
+}
+
+uint64_t timing_stalled(sds_context *context, enum sds_time time,
+			uint64_t now)
+{
+	uint64_t since = atomic_load(&context->waiting_since);
+	uint64_t deadline = get_frame_interval(context, time)
+			    * TIMING_STALL_FACTOR
+			    + (uint64_t) TIMING_STALL_BASE * 1000000;
+
+	/* The first empty poll starts the wait */
+	if (!since) {
+		atomic_compare_exchange_strong(&context->waiting_since,
+					       &since, now);
+		return 0;
+	}
+	if (now <= since || now - since <= deadline)
+		return 0;
+	/* The wait starts over, so a stall is reported once per deadline */
+	atomic_store(&context->waiting_since, now);
+	return now - since;
+}
+
+sds_error sds_get_frame_interval(sds_context *context, uint64_t *interval)
+{
+	if (!context || !interval)
+		return SDS_ERROR_INVALID_PARAM;
+	*interval = get_frame_interval(context, config_read(context)->time);
+	config_release(context);
+	return SDS_ERROR_SUCCESS;
+}
@@ -0,0 +1,41 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+/* The semaphores of the probes declared in trace.h. Tracers find them by
+ * name in the .probes section. */
+
+#include "trace.h"
+
+#ifdef SDS_HAVE_SDT
+
+#define SEMAPHORE(probe) \
+	__extension__ unsigned short TRACE_SEMAPHORE(probe) \
+	__attribute__((section(".probes")))
+
+SEMAPHORE(control__start);
+SEMAPHORE(control__done);
+SEMAPHORE(bulk__start);
+SEMAPHORE(bulk__done);
+SEMAPHORE(relay__start);
+SEMAPHORE(relay__done);
+SEMAPHORE(state__start);
+SEMAPHORE(state__done);
+SEMAPHORE(decode__start);
+SEMAPHORE(decode__done);
+
+#endif /* SDS_HAVE_SDT */
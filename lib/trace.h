@@ -0,0 +1,94 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+/* Static tracepoints (USDT) of the library, provider "libsds200a". They are
+ * compiled in if sys/sdt.h is available (SDS_HAVE_SDT, see the Makefile)
+ * and can be attached to by perf, bpftrace, SystemTap and the like.
+ *
+ * Every probe has a semaphore that the tracer increments while it is
+ * attached. The arguments (including the durations) are only computed if
+ * the semaphore is set, so a disabled probe costs a load and a branch.
+ *
+ * Probes and their arguments:
+ *   control__start  bmRequestType, bRequest, wValue, wIndex, wLength
+ *   control__done   bRequest, result, duration
+ *   bulk__start     endpoint, length
+ *   bulk__done      endpoint, result, duration
+ *   relay__start    relay, set
+ *   relay__done     relay, set, result, duration
+ *   state__start    pointer to the state word (SDS_STATE_SIZE bytes)
+ *   state__done     result, duration
+ *   decode__start   samples
+ *   decode__done    samples, duration
+ *
+ * A result is the amount of transferred bytes or a (negative) sds_error,
+ * durations are in nanoseconds. The transfers of device groups fire the
+ * start probes on submission and the done probes in their callbacks. */
+
+#ifndef SDS_TRACE_H
+#define SDS_TRACE_H
+
+#ifdef SDS_HAVE_SDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define TRACE_SEMAPHORE(probe) libsds200a_##probe##_semaphore
+
+extern unsigned short TRACE_SEMAPHORE(control__start);
+extern unsigned short TRACE_SEMAPHORE(control__done);
+extern unsigned short TRACE_SEMAPHORE(bulk__start);
+extern unsigned short TRACE_SEMAPHORE(bulk__done);
+extern unsigned short TRACE_SEMAPHORE(relay__start);
+extern unsigned short TRACE_SEMAPHORE(relay__done);
+extern unsigned short TRACE_SEMAPHORE(state__start);
+extern unsigned short TRACE_SEMAPHORE(state__done);
+extern unsigned short TRACE_SEMAPHORE(decode__start);
+extern unsigned short TRACE_SEMAPHORE(decode__done);
+
+#define TRACE_ENABLED(probe) \
+	__builtin_expect(*(volatile unsigned short *) &TRACE_SEMAPHORE(probe), 0)
+
+#define TRACE(probe, ...) \
+	do { \
+		if (TRACE_ENABLED(probe)) \
+			STAP_PROBEV(libsds200a, probe, __VA_ARGS__); \
+	} while (0)
+
+#else
+
+/* The arguments are never evaluated, but count as used */
+static inline void trace_unused(int dummy, ...)
+{
+	(void) dummy;
+}
+
+#define TRACE_ENABLED(probe) 0
+#define TRACE(probe, ...) \
+	do { \
+		if (0) \
+			trace_unused(0, __VA_ARGS__); \
+	} while (0)
+
+#endif /* SDS_HAVE_SDT */
+
+/* Returns the start time of an operation whose duration is reported by the
+ * given probe or 0 if the probe is disabled. Requires internal.h. */
+#define TRACE_START(probe) (TRACE_ENABLED(probe) ? get_time_ns() : 0)
+
+#endif /* SDS_TRACE_H */
@@ -0,0 +1,207 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+/* The transport backend for real devices, implemented with libusb. */
+
+#include <stdlib.h>
+
+#include "internal.h"
+
+struct usb_backend
+{
+	struct backend backend;
+	libusb_context *usb_context;
+};
+
+int probe_usb_device(libusb_device *dev)
+{
+	struct libusb_device_descriptor desc;
+	if (libusb_get_device_descriptor(dev, &desc) < 0)
+		return 1;
+	if (desc.idVendor == SDS_VENDOR_ID &&
+	    desc.idProduct == SDS_PRODUCT_ID)
+		return 0;
+	return 1;
+}
+
+/* Searches the device (as returned by sds_get_devices) in the device list of
+ * usb_context. The found device has to be unreferenced by the caller. */
+static int find_usb_device(libusb_context *usb_context,
+			   struct sds_device *device,
+			   libusb_device **found)
+{
+	libusb_device **list;
+	ssize_t usb_count;
+	ssize_t i = 0;
+	int err = LIBUSB_ERROR_NO_DEVICE;
+
+	usb_count = libusb_get_device_list(usb_context, &list);
+	if (usb_count < 0)
+		return usb_count;
+
+	/* The libusb_device of the sds_device belongs to another libusb
+	 * context, therefore it is identified by its position on the bus. */
+	for (i = 0; i < usb_count; i++) {
+		if (!probe_usb_device(list[i]) &&
+		    libusb_get_bus_number(list[i]) == device->bus_no &&
+		    libusb_get_port_number(list[i]) == device->port_no) {
+			*found = libusb_ref_device(list[i]);
+			err = LIBUSB_SUCCESS;
+			break;
+		}
+	}
+
+	libusb_free_device_list(list, 1);
+	return err;
+}
+
+static int usb_open(struct backend *backend, struct sds_device *device,
+		    sds_context *context)
+{
+	struct usb_backend *usb = (struct usb_backend *) backend;
+	libusb_device *usb_device;
+	int err;
+
+	if ((err = find_usb_device(usb->usb_context, device, &usb_device)))
+		return err;
+	err = libusb_open(usb_device, &context->device_handle);
+	libusb_unref_device(usb_device);
+	if (err)
+		return err;
+	context->usb_context = usb->usb_context;
+	context->relay_wait = SDS_RELAY_WAIT;
+	return LIBUSB_SUCCESS;
+}
+
+static void usb_close(sds_context *context)
+{
+	if (context->device_handle)
+		libusb_close(context->device_handle);
+	context->device_handle = NULL;
+}
+
+static int usb_control(sds_context *context,
+		       uint8_t bmRequestType,
+		       uint8_t bRequest,
+		       uint16_t wValue,
+		       uint16_t wIndex,
+		       unsigned char *data,
+		       uint16_t wLength,
+		       unsigned int timeout)
+{
+	int written;
+
+	/* The handle is replaced when the device is attached again */
+	pthread_rwlock_rdlock(&context->handle_lock);
+	if (context->device_handle)
+		written = libusb_control_transfer(context->device_handle,
+						  bmRequestType,
+						  bRequest,
+						  wValue,
+						  wIndex,
+						  data,
+						  wLength,
+						  timeout);
+	else
+		written = LIBUSB_ERROR_NO_DEVICE;
+	pthread_rwlock_unlock(&context->handle_lock);
+	return written;
+}
+
+static int usb_bulk_in(sds_context *context,
+		       unsigned char endpoint,
+		       unsigned char *data,
+		       int length,
+		       int *transferred,
+		       unsigned int timeout)
+{
+	int err;
+
+	pthread_rwlock_rdlock(&context->handle_lock);
+	if (context->device_handle)
+		err = libusb_bulk_transfer(context->device_handle,
+					   endpoint,
+					   data,
+					   length,
+					   transferred,
+					   timeout);
+	else
+		err = LIBUSB_ERROR_NO_DEVICE;
+	pthread_rwlock_unlock(&context->handle_lock);
+	return err;
+}
+
+static int usb_submit(sds_context *context, struct libusb_transfer *transfer)
+{
+	int err;
+
+	pthread_rwlock_rdlock(&context->handle_lock);
+	transfer->dev_handle = context->device_handle;
+	if (context->device_handle)
+		err = libusb_submit_transfer(transfer);
+	else
+		err = LIBUSB_ERROR_NO_DEVICE;
+	pthread_rwlock_unlock(&context->handle_lock);
+	return err;
+}
+
+static int usb_cancel(sds_context *context, struct libusb_transfer *transfer)
+{
+	return libusb_cancel_transfer(transfer);
+}
+
+static int usb_handle_events(struct backend *backend, struct timeval *timeout)
+{
+	struct usb_backend *usb = (struct usb_backend *) backend;
+	return libusb_handle_events_timeout_completed(usb->usb_context,
+						      timeout, NULL);
+}
+
+static void usb_destroy(struct backend *backend)
+{
+	struct usb_backend *usb = (struct usb_backend *) backend;
+	libusb_exit(usb->usb_context);
+	free(usb);
+}
+
+static const struct backend_ops usb_ops = {
+	.open = usb_open,
+	.close = usb_close,
+	.control = usb_control,
+	.bulk_in = usb_bulk_in,
+	.submit = usb_submit,
+	.cancel = usb_cancel,
+	.handle_events = usb_handle_events,
+	.destroy = usb_destroy,
+};
+
+sds_error usb_create(struct backend **backend)
+{
+	struct usb_backend *usb = malloc(sizeof(*usb));
+	sds_error err;
+
+	if (!usb)
+		return SDS_ERROR_NO_MEM;
+	if ((err = convert_error(libusb_init(&usb->usb_context)))) {
+		free(usb);
+		return err;
+	}
+	usb->backend.ops = &usb_ops;
+	*backend = &usb->backend;
+	return SDS_ERROR_SUCCESS;
+}
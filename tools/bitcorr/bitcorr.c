@@ -0,0 +1,447 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+//	bitcorr
+//
+//	 reads control transfers from many pcap files and counts per bRequest how
+//	 often each bit of the payload is set and toggles, which bits toggle
+//	 together and how often a bit equals the same bit of the payload sent
+//	 right before by another request.
+//
+//	 The payloads are gathered in blocks of 64: plane[bit] holds this bit of
+//	 all payloads of a block, so a block is counted with one popcount per bit
+//	 (or pair of bits).
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "usbpcap.h"
+
+// Longer payloads are truncated
+#define MAX_BYTES 64
+#define MAX_BITS (8 * MAX_BYTES)
+#define BLOCK 64
+
+// Counters of one bRequest
+typedef struct {
+	unsigned int bytes; // the longest payload
+	uint64_t payloads;
+	uint64_t transitions; // payloads with a predecessor of the same length
+	uint64_t comparisons; // payloads compared to another request
+	uint64_t neighbours[256]; // the requests they were compared to
+	uint64_t ones[MAX_BITS];
+	uint64_t toggles[MAX_BITS];
+	uint64_t agree[MAX_BITS];
+	uint64_t cotoggles[MAX_BITS][MAX_BITS]; // only [i][j] with j <= i
+} Stats;
+
+// A block of payloads of one bRequest that is not counted yet
+typedef struct {
+	int count;
+	uint64_t transitionMask; // payloads with a predecessor
+	uint64_t comparisonMask; // payloads compared to another request
+	uint64_t value[MAX_BITS];
+	uint64_t toggle[MAX_BITS];
+	uint64_t agree[MAX_BITS];
+	unsigned char last[MAX_BYTES]; // the previous payload of this request
+	unsigned int lastLength; // 0: none in this file
+} Block;
+
+// The counters of a worker
+typedef struct {
+	Stats *stats[256];
+	Block *blocks[256];
+} Analysis;
+
+int selectedRequest = -1;
+
+static Stats *getStats(Analysis *analysis, int request) {
+	if (!analysis->stats[request]) {
+		analysis->stats[request] = calloc(1, sizeof(Stats));
+		analysis->blocks[request] = calloc(1, sizeof(Block));
+		if (!analysis->stats[request] || !analysis->blocks[request]) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return analysis->stats[request];
+}
+
+// Sets the bits of data in the planes
+static void scatter(uint64_t *planes, const unsigned char *data, unsigned int length, int sample) {
+	for (unsigned int byte = 0; byte < length; byte++) {
+		unsigned int value = data[byte];
+		while (value) {
+			int bit = __builtin_ctz(value);
+			// bit 0 of a plane index is the MSB, like in the binary dumps
+			planes[8 * byte + 7 - bit] |= (uint64_t) 1 << sample;
+			value &= value - 1;
+		}
+	}
+}
+
+// Counts a block and clears it
+static void flush(Stats *stats, Block *block) {
+	unsigned int bits = 8 * stats->bytes;
+
+	if (!block->count) {
+		return;
+	}
+	for (unsigned int i = 0; i < bits; i++) {
+		stats->ones[i] += __builtin_popcountll(block->value[i]);
+		stats->agree[i] += __builtin_popcountll(block->agree[i] & block->comparisonMask);
+		uint64_t toggle = block->toggle[i] & block->transitionMask;
+		if (!toggle) {
+			continue;
+		}
+		stats->toggles[i] += __builtin_popcountll(toggle);
+		for (unsigned int j = 0; j <= i; j++) {
+			stats->cotoggles[i][j] += __builtin_popcountll(toggle & block->toggle[j]);
+		}
+	}
+	stats->transitions += __builtin_popcountll(block->transitionMask);
+	stats->comparisons += __builtin_popcountll(block->comparisonMask);
+	memset(block->value, 0, sizeof(block->value));
+	memset(block->toggle, 0, sizeof(block->toggle));
+	memset(block->agree, 0, sizeof(block->agree));
+	block->transitionMask = 0;
+	block->comparisonMask = 0;
+	block->count = 0;
+}
+
+// Adds the payload of a control transfer. neighbour is the payload sent
+// before by another request (or NULL).
+static void addPayload(Analysis *analysis, int request, const unsigned char *data, unsigned int length,
+                       int neighbourRequest, const unsigned char *neighbour, unsigned int neighbourLength) {
+	Stats *stats = getStats(analysis, request);
+	Block *block = analysis->blocks[request];
+	unsigned char difference[MAX_BYTES];
+	int sample = block->count;
+
+	if (length > MAX_BYTES) {
+		length = MAX_BYTES;
+	}
+	if (length > stats->bytes) {
+		stats->bytes = length;
+	}
+	stats->payloads++;
+
+	scatter(block->value, data, length, sample);
+	if (block->lastLength == length) {
+		for (unsigned int i = 0; i < length; i++) {
+			difference[i] = data[i] ^ block->last[i];
+		}
+		scatter(block->toggle, difference, length, sample);
+		block->transitionMask |= (uint64_t) 1 << sample;
+	}
+	if (neighbour && neighbourLength == length) {
+		// Equal bits are set
+		for (unsigned int i = 0; i < length; i++) {
+			difference[i] = ~(data[i] ^ neighbour[i]);
+		}
+		scatter(block->agree, difference, length, sample);
+		block->comparisonMask |= (uint64_t) 1 << sample;
+		stats->neighbours[neighbourRequest]++;
+	}
+	memcpy(block->last, data, length);
+	block->lastLength = length;
+
+	if (++block->count == BLOCK) {
+		flush(stats, block);
+	}
+}
+
+// Adds the control transfers of one file
+static int analyzeFile(Analysis *analysis, const char *path) {
+	PcapFile file;
+	PcapRecord record;
+	char errbuf[PCAP_ERRBUF_SIZE];
+	int request = -1; // of the last setup packet
+	int lastRequest = -1; // of the last payload
+	unsigned char last[MAX_BYTES];
+	unsigned int lastLength = 0;
+
+	if (pcapOpen(&file, path, errbuf)) {
+		fprintf(stderr, "Couldn't open pcap file %s: %s\n", path, errbuf);
+		return -1;
+	}
+	while (pcapNext(&file, &record)) {
+		const USBPCAP_BUFFER_CONTROL_HEADER *control = recordControl(&record);
+		const USB_SETUP *setup = recordSetup(&record);
+		const unsigned char *payload = NULL;
+		uint32_t length = 0;
+
+		if (!control) {
+			continue;
+		}
+		if (setup) {
+			request = setup->bRequest;
+		}
+		if (request != -1) {
+			payload = recordControlData(&record, &length);
+		}
+		if (!length) {
+			continue;
+		}
+		if (length > MAX_BYTES) {
+			length = MAX_BYTES;
+		}
+		if (selectedRequest == -1 || request == selectedRequest) {
+			int other = lastRequest != -1 && lastRequest != request;
+			addPayload(analysis, request, payload, length,
+			           lastRequest, other ? last : NULL, lastLength);
+		}
+		memcpy(last, payload, length);
+		lastLength = length;
+		lastRequest = request;
+		// Only the first data stage belongs to the setup packet
+		request = -1;
+	}
+	pcapClose(&file);
+
+	// Toggles are only counted within a file
+	for (int i = 0; i < 256; i++) {
+		if (analysis->stats[i]) {
+			flush(analysis->stats[i], analysis->blocks[i]);
+			analysis->blocks[i]->lastLength = 0;
+		}
+	}
+	return 0;
+}
+
+// The files are distributed on the workers
+typedef struct {
+	char **paths;
+	int count;
+	int next;
+	int failed;
+	pthread_mutex_t lock;
+} Queue;
+
+typedef struct {
+	Queue *queue;
+	Analysis analysis;
+	pthread_t thread;
+} Worker;
+
+void *work(void *arg) {
+	Worker *worker = arg;
+	Queue *queue = worker->queue;
+
+	for (;;) {
+		pthread_mutex_lock(&queue->lock);
+		int next = queue->next++;
+		pthread_mutex_unlock(&queue->lock);
+		if (next >= queue->count) {
+			break;
+		}
+		if (analyzeFile(&worker->analysis, queue->paths[next])) {
+			pthread_mutex_lock(&queue->lock);
+			queue->failed = 1;
+			pthread_mutex_unlock(&queue->lock);
+		}
+	}
+	return NULL;
+}
+
+// Adds the counters of from to to
+static void merge(Analysis *to, Analysis *from) {
+	for (int request = 0; request < 256; request++) {
+		Stats *source = from->stats[request];
+		if (!source) {
+			continue;
+		}
+		Stats *target = getStats(to, request);
+		unsigned int bits = 8 * source->bytes;
+		if (source->bytes > target->bytes) {
+			target->bytes = source->bytes;
+		}
+		target->payloads += source->payloads;
+		target->transitions += source->transitions;
+		target->comparisons += source->comparisons;
+		for (int i = 0; i < 256; i++) {
+			target->neighbours[i] += source->neighbours[i];
+		}
+		for (unsigned int i = 0; i < bits; i++) {
+			target->ones[i] += source->ones[i];
+			target->toggles[i] += source->toggles[i];
+			target->agree[i] += source->agree[i];
+			for (unsigned int j = 0; j <= i; j++) {
+				target->cotoggles[i][j] += source->cotoggles[i][j];
+			}
+		}
+		free(source);
+		free(from->blocks[request]);
+	}
+}
+
+// Phi coefficient of two bits toggling in n transitions
+static double phi(uint64_t n, uint64_t a, uint64_t b, uint64_t both) {
+	double denominator = sqrt((double) a * (n - a) * (double) b * (n - b));
+	if (denominator == 0) {
+		return 0;
+	}
+	return ((double) n * both - (double) a * b) / denominator;
+}
+
+// Bits are named byte.bit, bytes count from 1 (like in configurations.md),
+// bit 7 is the MSB
+static void printBit(unsigned int bit) {
+	printf("%2u.%u", bit / 8 + 1, 7 - bit % 8);
+}
+
+static void report(Analysis *analysis, double threshold) {
+	for (int request = 0; request < 256; request++) {
+		Stats *stats = analysis->stats[request];
+		if (!stats) {
+			continue;
+		}
+		unsigned int bits = 8 * stats->bytes;
+		int neighbour = -1;
+		for (int i = 0; i < 256; i++) {
+			if (stats->neighbours[i] && (neighbour == -1 || stats->neighbours[i] > stats->neighbours[neighbour])) {
+				neighbour = i;
+			}
+		}
+
+		printf("bRequest 0x%02x: %" PRIu64 " payloads of up to %u bytes, %" PRIu64 " transitions",
+		       request, stats->payloads, stats->bytes, stats->transitions);
+		if (neighbour != -1) {
+			printf(", %" PRIu64 " compared to the request before (mostly 0x%02x)",
+			       stats->comparisons, neighbour);
+		}
+		printf("\n  bit    set      toggled  equal before\n");
+		for (unsigned int i = 0; i < bits; i++) {
+			// Constant bits are of no interest
+			if (!stats->toggles[i] && (!stats->ones[i] || stats->ones[i] == stats->payloads) &&
+			    (!stats->comparisons || stats->agree[i] == stats->comparisons)) {
+				continue;
+			}
+			printf("  ");
+			printBit(i);
+			printf("  %6.2f%%  %6.2f%%  ", 100.0 * stats->ones[i] / stats->payloads,
+			       stats->transitions ? 100.0 * stats->toggles[i] / stats->transitions : 0);
+			if (stats->comparisons) {
+				printf("%6.2f%%\n", 100.0 * stats->agree[i] / stats->comparisons);
+			} else {
+				printf("     -\n");
+			}
+		}
+
+		printf("  bits toggling together (|phi| >= %.2f)\n", threshold);
+		for (unsigned int i = 0; i < bits; i++) {
+			for (unsigned int j = 0; j < i; j++) {
+				if (!stats->toggles[i] || !stats->toggles[j]) {
+					continue;
+				}
+				double correlation = phi(stats->transitions, stats->toggles[i], stats->toggles[j],
+				                         stats->cotoggles[i][j]);
+				if (fabs(correlation) >= threshold) {
+					printf("  ");
+					printBit(j);
+					printf(" ~ ");
+					printBit(i);
+					printf("  %+.2f  (%" PRIu64 " times)\n", correlation, stats->cotoggles[i][j]);
+				}
+			}
+		}
+		printf("\n");
+	}
+}
+
+//------------------------------------------------------------------- 
+int main(int argc, char **argv) 
+{ 
+	int workers = 1;
+	double threshold = 0.9;
+	int option;
+	char *end;
+
+	while ((option = getopt(argc, argv, "j:r:c:")) != -1) {
+		switch (option) {
+		case 'j':
+			workers = atoi(optarg);
+			if (workers <= 0) {
+				// one worker per core
+				workers = sysconf(_SC_NPROCESSORS_ONLN);
+			}
+			break;
+		case 'r':
+			selectedRequest = strtol(optarg, &end, 0);
+			if (*end || selectedRequest < 0 || selectedRequest > 0xff) {
+				goto usage;
+			}
+			break;
+		case 'c':
+			threshold = strtod(optarg, &end);
+			if (*end) {
+				goto usage;
+			}
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind >= argc) {
+		goto usage;
+	}
+
+	Queue queue = { .paths = argv + optind, .count = argc - optind };
+	if (workers > queue.count) {
+		workers = queue.count;
+	}
+	Worker *pool = calloc(workers, sizeof(Worker));
+	if (!pool) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_init(&queue.lock, NULL);
+	int started = 0;
+	for (; started < workers; started++) {
+		pool[started].queue = &queue;
+		if (pthread_create(&pool[started].thread, NULL, work, &pool[started])) {
+			break;
+		}
+	}
+	if (!started) {
+		// Do it alone
+		pool[0].queue = &queue;
+		work(&pool[0]);
+		started = 1;
+	} else {
+		for (int i = 0; i < started; i++) {
+			pthread_join(pool[i].thread, NULL);
+		}
+	}
+	for (int i = 1; i < started; i++) {
+		merge(&pool[0].analysis, &pool[i].analysis);
+	}
+
+	report(&pool[0].analysis, threshold);
+	pthread_mutex_destroy(&queue.lock);
+	return queue.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "Usage: %s [-j workers] [-r bRequest] [-c threshold] <input pcap>...\n", argv[0]);
+	exit(EXIT_FAILURE);
+}
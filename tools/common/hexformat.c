@@ -0,0 +1,115 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "hexformat.h"
+
+#define GROUP 4
+#define LINE 32
+// Bytes converted at once
+#define BLOCK 16
+// Bytes formatted before the buffer is written
+#define CHUNK 4096
+
+#define ROW(x) #x "0" #x "1" #x "2" #x "3" #x "4" #x "5" #x "6" #x "7" \
+	#x "8" #x "9" #x "a" #x "b" #x "c" #x "d" #x "e" #x "f"
+
+// The two hex digits of every byte value
+static const char hexPairs[] =
+	ROW(0) ROW(1) ROW(2) ROW(3) ROW(4) ROW(5) ROW(6) ROW(7)
+	ROW(8) ROW(9) ROW(a) ROW(b) ROW(c) ROW(d) ROW(e) ROW(f);
+
+// Converts BLOCK bytes to 2 * BLOCK hex digits
+static void hexBlock(char *out, const unsigned char *data) {
+#ifdef __SSE2__
+	__m128i bytes = _mm_loadu_si128((const __m128i *) data);
+	__m128i mask = _mm_set1_epi8(0x0f);
+	__m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), mask);
+	__m128i low = _mm_and_si128(bytes, mask);
+	// Interleave the nibbles, the high one comes first
+	__m128i first = _mm_unpacklo_epi8(high, low);
+	__m128i second = _mm_unpackhi_epi8(high, low);
+	// '0' + nibble, plus the distance from '9' + 1 to 'a' for nibbles > 9
+	__m128i nine = _mm_set1_epi8(9);
+	__m128i zero = _mm_set1_epi8('0');
+	__m128i letters = _mm_set1_epi8('a' - '9' - 1);
+	first = _mm_add_epi8(_mm_add_epi8(first, zero),
+	                     _mm_and_si128(_mm_cmpgt_epi8(first, nine), letters));
+	second = _mm_add_epi8(_mm_add_epi8(second, zero),
+	                      _mm_and_si128(_mm_cmpgt_epi8(second, nine), letters));
+	_mm_storeu_si128((__m128i *) out, first);
+	_mm_storeu_si128((__m128i *) (out + 16), second);
+#else
+	for (int i = 0; i < BLOCK; i++) {
+		memcpy(out + 2 * i, hexPairs + 2 * data[i], 2);
+	}
+#endif
+}
+
+// Formats length bytes of data to out. position is the offset of data in
+// the transfer, it has to be a multiple of LINE. Returns the characters used.
+static size_t formatHex(char *out, const unsigned char *data, size_t length,
+                        size_t position, const char *wrap, size_t wrapLength) {
+	char *begin = out;
+	size_t i = 0;
+	char digits[2 * BLOCK];
+
+	for (; i + BLOCK <= length; i += BLOCK) {
+		hexBlock(digits, data + i);
+		for (int group = 0; group < BLOCK / GROUP; group++) {
+			memcpy(out, digits + 2 * GROUP * group, 2 * GROUP);
+			out += 2 * GROUP;
+			if (wrap && (position + i + GROUP * (group + 1)) % LINE == 0) {
+				memcpy(out, wrap, wrapLength);
+				out += wrapLength;
+			} else {
+				*out++ = ' ';
+			}
+		}
+	}
+	for (; i < length; i++) {
+		memcpy(out, hexPairs + 2 * data[i], 2);
+		out += 2;
+		if ((i + 1) % GROUP == 0) {
+			if (wrap && (position + i + 1) % LINE == 0) {
+				memcpy(out, wrap, wrapLength);
+				out += wrapLength;
+			} else {
+				*out++ = ' ';
+			}
+		}
+	}
+	return out - begin;
+}
+
+void printHex(FILE *fd, const unsigned char *data, size_t length, const char *wrap) {
+	size_t wrapLength = wrap ? strlen(wrap) : 0;
+	// Every group of a chunk might end in a wrap
+	char buffer[CHUNK * 2 + (CHUNK / GROUP) * (wrapLength > 1 ? wrapLength : 1)];
+
+	for (size_t position = 0; position < length; position += CHUNK) {
+		size_t chunk = length - position < CHUNK ? length - position : CHUNK;
+		size_t used = formatHex(buffer, data + position, chunk, position, wrap, wrapLength);
+		fwrite(buffer, 1, used, fd);
+	}
+}
@@ -0,0 +1,35 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+//	hexformat
+//
+//	 prints binary data as hex digits in groups of 4 bytes, the way the pcap
+//	 tools show transfer data
+
+#ifndef HEXFORMAT_H
+#define HEXFORMAT_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Prints length bytes of data to fd. The groups are separated by a space,
+// after every 32 bytes wrap is printed instead (if it is not NULL). The output
+// is assembled in a large buffer and passed to fd with few writes.
+void printHex(FILE *fd, const unsigned char *data, size_t length, const char *wrap);
+
+#endif /* HEXFORMAT_H */
@@ -0,0 +1,344 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pcapindex.h"
+
+#define INDEX_MAGIC "USBPIDX"
+#define INDEX_VERSION 2
+
+// How many recent setup packets are searched for the setup of a stage
+#define SETUP_DEPTH 64
+
+// A setup packet seen while building the index
+typedef struct {
+	uint64_t irp;
+	uint16_t request;
+} IndexSetup;
+
+// Header of the sidecar file, followed by the entries. It is a cache of the
+// local machine, so everything is stored in host byte order.
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t entrySize;
+	uint64_t captureSize; // to detect a changed capture
+	int64_t captureModified; // nanoseconds
+	uint64_t count;
+	uint32_t sorted;
+	uint32_t unused;
+} IndexHeader;
+
+void filterInit(IndexFilter *filter) {
+	filter->packet = -1;
+	filter->request = -1;
+	filter->from = 0;
+	filter->to = -1;
+}
+
+int filterParseRequest(IndexFilter *filter, const char *argument) {
+	char *end;
+	long request = strtol(argument, &end, 0);
+	if (!*argument || *end || request < 0 || request > 0xff) {
+		return -1;
+	}
+	filter->request = request;
+	return 0;
+}
+
+int filterParseTime(IndexFilter *filter, const char *argument) {
+	const char *colon = strchr(argument, ':');
+	char *end;
+
+	if (!colon) {
+		return -1;
+	}
+	filter->from = 0;
+	filter->to = -1;
+	if (argument != colon) {
+		filter->from = strtoll(argument, &end, 10);
+		if (end != colon || filter->from < 0) {
+			return -1;
+		}
+	}
+	if (colon[1]) {
+		filter->to = strtoll(colon + 1, &end, 10);
+		if (*end || filter->to < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int filterAll(const IndexFilter *filter) {
+	return filter->packet == -1 && filter->request == -1 &&
+	       filter->from <= 0 && filter->to == -1;
+}
+
+static char *sidecarPath(const char *path) {
+	char *sidecar = malloc(strlen(path) + sizeof(".idx"));
+	if (sidecar) {
+		strcpy(sidecar, path);
+		strcat(sidecar, ".idx");
+	}
+	return sidecar;
+}
+
+static void headerInit(IndexHeader *header, const struct stat *capture) {
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	header->version = INDEX_VERSION;
+	header->entrySize = sizeof(IndexEntry);
+	header->captureSize = capture->st_size;
+	header->captureModified = (int64_t) capture->st_mtim.tv_sec * 1000000000 +
+	                          capture->st_mtim.tv_nsec;
+}
+
+// Maps the sidecar if it belongs to the current capture
+static int loadIndex(PcapIndex *index, const char *sidecar, const struct stat *capture) {
+	IndexHeader expected;
+	struct stat info;
+	int fd = open(sidecar, O_RDONLY);
+
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &info) || (size_t) info.st_size < sizeof(IndexHeader)) {
+		close(fd);
+		return -1;
+	}
+	void *mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		return -1;
+	}
+
+	const IndexHeader *header = mapping;
+	headerInit(&expected, capture);
+	if (memcmp(header->magic, expected.magic, sizeof(header->magic)) ||
+	    header->version != expected.version ||
+	    header->entrySize != expected.entrySize ||
+	    header->captureSize != expected.captureSize ||
+	    header->captureModified != expected.captureModified ||
+	    header->count != (info.st_size - sizeof(IndexHeader)) / sizeof(IndexEntry)) {
+		munmap(mapping, info.st_size);
+		return -1;
+	}
+	index->mapping = mapping;
+	index->mappingSize = info.st_size;
+	index->entries = (const IndexEntry *) ((const char *) mapping + sizeof(IndexHeader));
+	index->count = header->count;
+	index->sorted = header->sorted;
+	return 0;
+}
+
+// Scans the capture once
+static int buildIndex(PcapIndex *index, PcapFile *file) {
+	PcapRecord record;
+	size_t capacity = 1024;
+	size_t count = 0;
+	int sorted = 1;
+	IndexSetup setups[SETUP_DEPTH];
+	size_t setupCount = 0;
+	IndexEntry *entries = malloc(capacity * sizeof(IndexEntry));
+
+	if (!entries) {
+		return -1;
+	}
+	pcapRewind(file);
+	while (pcapNext(file, &record)) {
+		if (count == capacity) {
+			IndexEntry *grown = realloc(entries, 2 * capacity * sizeof(IndexEntry));
+			if (!grown) {
+				free(entries);
+				return -1;
+			}
+			entries = grown;
+			capacity *= 2;
+		}
+		IndexEntry *entry = &entries[count];
+		const USBPCAP_BUFFER_PACKET_HEADER *pkt = recordPacket(&record);
+		const USBPCAP_BUFFER_CONTROL_HEADER *control = recordControl(&record);
+		const USB_SETUP *setup = recordSetup(&record);
+
+		memset(entry, 0, sizeof(*entry));
+		entry->offset = record.offset;
+		entry->time = (int64_t) record.ts.tv_sec * 1000000 + record.ts.tv_usec;
+		entry->transfer = pkt ? pkt->transfer : 0xff;
+		entry->stage = control ? control->stage : 0xff;
+		entry->request = INDEX_NO_REQUEST;
+		// The other stages are matched to their setup by the request id,
+		// transfers may interleave (usbmon, several devices)
+		if (setup) {
+			setups[setupCount % SETUP_DEPTH].irp = pkt->irpId;
+			setups[setupCount % SETUP_DEPTH].request = setup->bRequest;
+			setupCount++;
+			entry->request = setup->bRequest;
+		} else if (control) {
+			for (size_t i = setupCount; i > 0 && setupCount - i < SETUP_DEPTH; i--) {
+				if (setups[(i - 1) % SETUP_DEPTH].irp == pkt->irpId) {
+					entry->request = setups[(i - 1) % SETUP_DEPTH].request;
+					break;
+				}
+			}
+		}
+		if (count && entry->time < entries[count - 1].time) {
+			sorted = 0;
+		}
+		count++;
+	}
+	pcapRewind(file);
+
+	index->built = entries;
+	index->entries = entries;
+	index->count = count;
+	index->sorted = sorted;
+	return 0;
+}
+
+// Writes the sidecar. It is renamed into place, so concurrent readers never
+// see a partial file.
+static void storeIndex(const PcapIndex *index, const char *sidecar, const struct stat *capture) {
+	IndexHeader header;
+	char *temporary = malloc(strlen(sidecar) + 32);
+
+	if (!temporary) {
+		return;
+	}
+	sprintf(temporary, "%s.%ld", sidecar, (long) getpid());
+	headerInit(&header, capture);
+	header.count = index->count;
+	header.sorted = index->sorted;
+
+	FILE *fd = fopen(temporary, "wb");
+	if (fd) {
+		int failed = fwrite(&header, sizeof(header), 1, fd) != 1 ||
+		             fwrite(index->entries, sizeof(IndexEntry), index->count, fd) != index->count;
+		if (fclose(fd) || failed || rename(temporary, sidecar)) {
+			unlink(temporary);
+		}
+	}
+	free(temporary);
+}
+
+int indexOpen(PcapIndex *index, PcapFile *file, const char *path) {
+	struct stat capture;
+	char *sidecar;
+
+	memset(index, 0, sizeof(*index));
+	if (stat(path, &capture) || !(sidecar = sidecarPath(path))) {
+		return -1;
+	}
+	if (loadIndex(index, sidecar, &capture)) {
+		if (buildIndex(index, file)) {
+			free(sidecar);
+			return -1;
+		}
+		// Without a writable directory the index is only used this time
+		storeIndex(index, sidecar, &capture);
+	}
+	free(sidecar);
+	return 0;
+}
+
+void indexClose(PcapIndex *index) {
+	if (index->mapping) {
+		munmap(index->mapping, index->mappingSize);
+	}
+	free(index->built);
+	memset(index, 0, sizeof(*index));
+}
+
+// Returns the first packet recorded at least time microseconds after the
+// first packet
+static size_t findTime(const PcapIndex *index, int64_t time) {
+	size_t low = 0;
+	size_t high = index->count;
+
+	if (!index->sorted || !index->count || time <= 0) {
+		return 0;
+	}
+	time += index->entries[0].time;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (index->entries[middle].time < time) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return low;
+}
+
+static int selected(const PcapIndex *index, const IndexFilter *filter, size_t packet) {
+	const IndexEntry *entry = &index->entries[packet];
+	int64_t time = entry->time - index->entries[0].time;
+
+	return (filter->request == -1 || entry->request == filter->request) &&
+	       time >= filter->from && (filter->to == -1 || time <= filter->to);
+}
+
+int indexNext(const PcapIndex *index, PcapFile *file, const IndexFilter *filter,
+              size_t *packet, PcapRecord *record) {
+	if (!index) {
+		*packet = *packet == INDEX_BEGIN ? 0 : *packet + 1;
+		return pcapNext(file, record);
+	}
+
+	size_t next;
+	if (filter->packet != -1) {
+		// A single packet
+		next = *packet == INDEX_BEGIN ? (size_t) filter->packet : index->count;
+	} else if (*packet == INDEX_BEGIN) {
+		next = findTime(index, filter->from);
+	} else {
+		next = *packet + 1;
+	}
+	for (; next < index->count; next++) {
+		if (filter->packet != -1 || selected(index, filter, next)) {
+			break;
+		}
+		// Nothing selected after the end of the time range
+		if (index->sorted && filter->to != -1 &&
+		    index->entries[next].time - index->entries[0].time > filter->to) {
+			return 0;
+		}
+	}
+	if (next >= index->count) {
+		return 0;
+	}
+	*packet = next;
+	pcapSeek(file, index->entries[next].offset);
+	return pcapNext(file, record);
+}
+
+void indexFirstTime(const PcapIndex *index, struct timeval *time) {
+	timerclear(time);
+	if (index->count) {
+		time->tv_sec = index->entries[0].time / 1000000;
+		time->tv_usec = index->entries[0].time % 1000000;
+	}
+}
@@ -0,0 +1,94 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+//	pcapindex
+//
+//	 random access to the packets of a capture. The index lists the offset,
+//	 time and transfer of every packet. It is stored next to the capture
+//	 (<capture>.idx) and rebuilt when the capture changes.
+
+#ifndef PCAPINDEX_H
+#define PCAPINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "usbpcap.h"
+
+// Start value of the packet number passed to indexNext()
+#define INDEX_BEGIN SIZE_MAX
+
+// No control transfer (and no bRequest)
+#define INDEX_NO_REQUEST 0xffff
+
+typedef struct {
+	uint64_t offset; // of the record in the capture
+	int64_t time; // timestamp in microseconds
+	uint16_t request; // bRequest of the control transfer or INDEX_NO_REQUEST
+	uint8_t transfer; // USBPCAP_TRANSFER_*, 0xff for broken packets
+	uint8_t stage; // control stage, 0xff for other transfers
+	uint32_t unused;
+} IndexEntry;
+
+typedef struct {
+	const IndexEntry *entries;
+	size_t count;
+	int sorted; // the timestamps never decrease
+	void *mapping; // the sidecar file if it is mapped
+	size_t mappingSize;
+	IndexEntry *built; // the entries if they were built in memory
+} PcapIndex;
+
+// Selects packets of a capture
+typedef struct {
+	long packet; // only this packet number, -1 for all
+	int request; // only control transfers with this bRequest, -1 for all
+	int64_t from; // only packets recorded at least from microseconds after
+	int64_t to; // the first one and at most to (-1: no limit)
+} IndexFilter;
+
+// Selects every packet
+void filterInit(IndexFilter *filter);
+
+// Restricts the filter to a bRequest (like 0xb3). Returns 0 on success.
+int filterParseRequest(IndexFilter *filter, const char *argument);
+
+// Restricts the filter to a time range "from:to" in microseconds after the
+// first packet, either end may be left out. Returns 0 on success.
+int filterParseTime(IndexFilter *filter, const char *argument);
+
+// Returns true if the filter selects all packets
+int filterAll(const IndexFilter *filter);
+
+// Loads the index of the capture at path (which is opened as file) or
+// builds it. Returns 0 on success.
+int indexOpen(PcapIndex *index, PcapFile *file, const char *path);
+
+void indexClose(PcapIndex *index);
+
+// Reads the next packet after *packet that passes filter and stores its
+// number in *packet. Returns 0 if there is none. Without an index (NULL) all
+// packets of the file are read in order.
+int indexNext(const PcapIndex *index, PcapFile *file, const IndexFilter *filter,
+              size_t *packet, PcapRecord *record);
+
+// Stores the timestamp of the first packet
+void indexFirstTime(const PcapIndex *index, struct timeval *time);
+
+#endif /* PCAPINDEX_H */
@@ -0,0 +1,323 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "usbpcap.h"
+
+#define MAGIC_US 0xa1b2c3d4
+#define MAGIC_NS 0xa1b23c4d
+#define FILE_HEADER_SIZE 24
+#define RECORD_HEADER_SIZE 16
+
+// struct usbmon_packet of the kernel (Documentation/usb/usbmon.rst). Its
+// fields are stored in the byte order of the recording machine.
+#define USBMON_ID 0
+#define USBMON_TYPE 8 // 'S'ubmission, 'C'allback or 'E'rror
+#define USBMON_TRANSFER 9 // same numbering as USBPcap
+#define USBMON_ENDPOINT 10
+#define USBMON_DEVICE 11
+#define USBMON_BUS 12
+#define USBMON_FLAG_SETUP 14 // 0 if the setup packet is present
+#define USBMON_STATUS 28
+#define USBMON_LENGTH_CAPTURED 36
+#define USBMON_SETUP 40
+#define USBMON_DESCRIPTORS 60 // of isochronous transfers (mmapped only)
+#define USBMON_HEADER_SIZE 48
+#define USBMON_MMAPPED_HEADER_SIZE 64
+#define USBMON_ISO_DESCRIPTOR_SIZE 16
+
+// Reads a field of the pcap headers, which are stored in the byte order of
+// the recording machine
+static uint32_t read32(const unsigned char *data, int swapped) {
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	if (swapped) {
+		value = __builtin_bswap32(value);
+	}
+	return value;
+}
+
+static uint16_t read16(const unsigned char *data, int swapped) {
+	uint16_t value;
+	memcpy(&value, data, sizeof(value));
+	if (swapped) {
+		value = __builtin_bswap16(value);
+	}
+	return value;
+}
+
+static uint64_t read64(const unsigned char *data, int swapped) {
+	uint64_t value;
+	memcpy(&value, data, sizeof(value));
+	if (swapped) {
+		value = __builtin_bswap64(value);
+	}
+	return value;
+}
+
+int pcapOpen(PcapFile *file, const char *path, char *errbuf) {
+	struct stat info;
+	int fd = open(path, O_RDONLY);
+
+	memset(file, 0, sizeof(*file));
+	if (fd < 0 || fstat(fd, &info)) {
+		snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s", strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	if (info.st_size < FILE_HEADER_SIZE) {
+		snprintf(errbuf, PCAP_ERRBUF_SIZE, "file is too short");
+		close(fd);
+		return -1;
+	}
+	file->size = info.st_size;
+	file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (file->data == MAP_FAILED) {
+		snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s", strerror(errno));
+		file->data = NULL;
+		return -1;
+	}
+	// The records are read front to back
+	madvise((void *) file->data, file->size, MADV_SEQUENTIAL);
+
+	uint32_t magic = read32(file->data, 0);
+	file->swapped = magic != MAGIC_US && magic != MAGIC_NS;
+	magic = read32(file->data, file->swapped);
+	if (magic != MAGIC_US && magic != MAGIC_NS) {
+		snprintf(errbuf, PCAP_ERRBUF_SIZE, "unknown file format");
+		pcapClose(file);
+		return -1;
+	}
+	file->nano = magic == MAGIC_NS;
+	file->linktype = read32(file->data + 20, file->swapped);
+	if (file->linktype != LINKTYPE_USBPCAP && file->linktype != LINKTYPE_USB_LINUX &&
+	    file->linktype != LINKTYPE_USB_LINUX_MMAPPED) {
+		snprintf(errbuf, PCAP_ERRBUF_SIZE, "unsupported link type %u", file->linktype);
+		pcapClose(file);
+		return -1;
+	}
+	file->offset = FILE_HEADER_SIZE;
+	return 0;
+}
+
+// Sets up the views of a USBPcap record, which point into the record
+static void viewUsbpcap(PcapRecord *record) {
+	const USBPCAP_BUFFER_PACKET_HEADER *pkt = NULL;
+	const USBPCAP_BUFFER_CONTROL_HEADER *control = NULL;
+	const USB_SETUP *setup = NULL;
+
+	record->payload = NULL;
+	record->payloadLength = 0;
+	if (record->caplen >= sizeof(USBPCAP_BUFFER_PACKET_HEADER)) {
+		pkt = (const USBPCAP_BUFFER_PACKET_HEADER *) record->data;
+	}
+	if (pkt && pkt->transfer == USBPCAP_TRANSFER_CONTROL &&
+	    record->caplen >= sizeof(USBPCAP_BUFFER_CONTROL_HEADER)) {
+		control = (const USBPCAP_BUFFER_CONTROL_HEADER *) record->data;
+	}
+	if (control && control->stage == USBPCAP_CONTROL_STAGE_SETUP &&
+	    record->caplen >= sizeof(USBPCAP_BUFFER_CONTROL_HEADER) + sizeof(USB_SETUP)) {
+		setup = (const USB_SETUP *) (record->data + sizeof(USBPCAP_BUFFER_CONTROL_HEADER));
+		record->payload = (const unsigned char *) (setup + 1);
+		record->payloadLength = record->caplen - sizeof(USBPCAP_BUFFER_CONTROL_HEADER) - sizeof(USB_SETUP);
+	} else if (pkt && pkt->headerLen <= record->caplen) {
+		record->payload = record->data + pkt->headerLen;
+		record->payloadLength = record->caplen - pkt->headerLen;
+		if (pkt->dataLength < record->payloadLength) {
+			record->payloadLength = pkt->dataLength;
+		}
+	}
+	record->packet = pkt;
+	record->control = control;
+	record->setup = setup;
+}
+
+// Translates the header of a usbmon record into record->header. Only the
+// headers are copied, the payload stays in the mapping.
+static void viewUsbmon(const PcapFile *file, PcapRecord *record) {
+	const unsigned char *data = record->data;
+	USBPCAP_BUFFER_PACKET_HEADER *pkt = &record->header.header;
+	size_t headerSize = file->linktype == LINKTYPE_USB_LINUX_MMAPPED ?
+	                    USBMON_MMAPPED_HEADER_SIZE : USBMON_HEADER_SIZE;
+
+	record->packet = NULL;
+	record->control = NULL;
+	record->setup = NULL;
+	record->payload = NULL;
+	record->payloadLength = 0;
+	if (record->caplen < headerSize) {
+		return;
+	}
+
+	int submission = data[USBMON_TYPE] == 'S';
+	// usbmon reports errors as negative errno values, submissions are
+	// "in progress"
+	int32_t status = read32(data + USBMON_STATUS, file->swapped);
+	memset(&record->header, 0, sizeof(record->header));
+	pkt->irpId = read64(data + USBMON_ID, file->swapped);
+	pkt->status = submission ? 0 : (uint32_t) -status;
+	pkt->info = submission ? 0 : USBPCAP_INFO_PDO_TO_FDO;
+	pkt->bus = read16(data + USBMON_BUS, file->swapped);
+	pkt->device = data[USBMON_DEVICE];
+	pkt->endpoint = data[USBMON_ENDPOINT];
+	pkt->transfer = data[USBMON_TRANSFER];
+	pkt->headerLen = pkt->transfer == USBPCAP_TRANSFER_CONTROL ?
+	                 sizeof(USBPCAP_BUFFER_CONTROL_HEADER) : sizeof(USBPCAP_BUFFER_PACKET_HEADER);
+
+	size_t start = headerSize;
+	if (headerSize == USBMON_MMAPPED_HEADER_SIZE && pkt->transfer == USBPCAP_TRANSFER_ISOCHRONOUS) {
+		start += (size_t) read32(data + USBMON_DESCRIPTORS, file->swapped) * USBMON_ISO_DESCRIPTOR_SIZE;
+	}
+	if (start <= record->caplen) {
+		record->payload = data + start;
+		record->payloadLength = read32(data + USBMON_LENGTH_CAPTURED, file->swapped);
+		if (record->payloadLength > record->caplen - start) {
+			record->payloadLength = record->caplen - start;
+		}
+	}
+	pkt->dataLength = record->payloadLength;
+	record->packet = pkt;
+
+	if (pkt->transfer == USBPCAP_TRANSFER_CONTROL) {
+		if (submission && data[USBMON_FLAG_SETUP] == 0) {
+			// The setup packet is always little endian
+			memcpy(&record->setupPacket, data + USBMON_SETUP, sizeof(USB_SETUP));
+			record->header.stage = USBPCAP_CONTROL_STAGE_SETUP;
+			record->setup = &record->setupPacket;
+		} else if (record->payloadLength) {
+			record->header.stage = USBPCAP_CONTROL_STAGE_DATA;
+		} else {
+			record->header.stage = USBPCAP_CONTROL_STAGE_STATUS;
+		}
+		record->control = &record->header;
+	}
+}
+
+int pcapNext(PcapFile *file, PcapRecord *record) {
+	if (file->offset + RECORD_HEADER_SIZE > file->size) {
+		return 0;
+	}
+	const unsigned char *header = file->data + file->offset;
+	uint32_t caplen = read32(header + 8, file->swapped);
+	if (caplen > file->size - file->offset - RECORD_HEADER_SIZE) {
+		// truncated file
+		return 0;
+	}
+	uint32_t fraction = read32(header + 4, file->swapped);
+	record->ts.tv_sec = read32(header, file->swapped);
+	record->ts.tv_usec = file->nano ? fraction / 1000 : fraction;
+	record->caplen = caplen;
+	record->len = read32(header + 12, file->swapped);
+	record->offset = file->offset;
+	record->data = header + RECORD_HEADER_SIZE;
+	file->offset += RECORD_HEADER_SIZE + caplen;
+	if (file->linktype == LINKTYPE_USBPCAP) {
+		viewUsbpcap(record);
+	} else {
+		viewUsbmon(file, record);
+	}
+	return 1;
+}
+
+void pcapSeek(PcapFile *file, size_t offset) {
+	file->offset = offset;
+}
+
+void pcapRewind(PcapFile *file) {
+	file->offset = FILE_HEADER_SIZE;
+}
+
+void pcapClose(PcapFile *file) {
+	if (file->data) {
+		munmap((void *) file->data, file->size);
+	}
+	file->data = NULL;
+}
+
+const USBPCAP_BUFFER_PACKET_HEADER *recordPacket(const PcapRecord *record) {
+	return record->packet;
+}
+
+const USBPCAP_BUFFER_CONTROL_HEADER *recordControl(const PcapRecord *record) {
+	return record->control;
+}
+
+const USB_SETUP *recordSetup(const PcapRecord *record) {
+	return record->setup;
+}
+
+const unsigned char *recordPayload(const PcapRecord *record, uint32_t *length) {
+	*length = record->payloadLength;
+	return record->payload;
+}
+
+const unsigned char *recordControlData(const PcapRecord *record, uint32_t *length) {
+	if (record->control && (record->setup || record->control->stage == USBPCAP_CONTROL_STAGE_DATA)) {
+		return recordPayload(record, length);
+	}
+	*length = 0;
+	return NULL;
+}
+
+int hostToDevice(unsigned char info) {
+	return !(info & 1);
+}
+
+int getEndpoint(unsigned char endpoint) {
+	return endpoint & 0b01111111;
+}
+
+int getDirection(unsigned char endpoint) {
+	return endpoint >> 7;
+}
+
+const char *endpointToDirection(unsigned char endpoint) {
+	if (getDirection(endpoint)) {
+		// in
+		return "i";
+	} else {
+		// out
+		return "o";
+	}
+}
+
+void normalizeTimeval(struct timeval *start, const struct timeval *recorded, struct timeval *result) {
+	if (!timerisset(start)) {
+		// This is the first packet
+		*start = *recorded;
+		// This packet has an offset of 0
+		timerclear(result);
+	} else {
+		// Get the offset
+		timersub(recorded, start, result);
+	}
+}
+
+unsigned long timevalToMicroseconds(const struct timeval *time) {
+	return time->tv_sec * 1000000 + time->tv_usec;
+}
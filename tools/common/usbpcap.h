@@ -0,0 +1,122 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+//	usbpcap
+//
+//	 shared pcap reader of the tools. The capture file is memory-mapped and
+//	 the records are handed out as views into the mapping, nothing is copied.
+//	 Besides USBPcap traces it reads the Linux usbmon link types, whose
+//	 headers are translated into the USBPcap ones.
+
+#ifndef USBPCAP_H
+#define USBPCAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "pcap_types.h"
+
+#define PCAP_ERRBUF_SIZE 256
+
+// link types of USBPcap and Linux usbmon traces (with the 48 byte header of
+// the binary interface and the 64 byte one of the mmapped interface)
+#define LINKTYPE_USBPCAP 249
+#define LINKTYPE_USB_LINUX 189
+#define LINKTYPE_USB_LINUX_MMAPPED 220
+
+// An opened (mapped) capture file
+typedef struct {
+	const unsigned char *data; // the whole file
+	size_t size;
+	size_t offset; // position of the next record
+	int swapped; // headers are in the other byte order
+	int nano; // timestamps have nanosecond resolution
+	uint32_t linktype;
+} PcapFile;
+
+// One record of a capture file. data and payload point into the mapping and
+// stay valid until the file is closed. The USBPcap headers of other link
+// types are stored in the record itself, so views of them only live as long
+// as the record is not overwritten.
+typedef struct {
+	struct timeval ts; // timestamp (microseconds, like libpcap)
+	uint32_t caplen; // bytes present in the file
+	uint32_t len; // bytes of the original packet
+	size_t offset; // position of the record header in the file
+	const unsigned char *data; // caplen bytes
+	// views set up by pcapNext, see the accessors below
+	const USBPCAP_BUFFER_PACKET_HEADER *packet;
+	const USBPCAP_BUFFER_CONTROL_HEADER *control;
+	const USB_SETUP *setup;
+	const unsigned char *payload;
+	uint32_t payloadLength;
+	// translated headers of usbmon records
+	USBPCAP_BUFFER_CONTROL_HEADER header;
+	USB_SETUP setupPacket;
+} PcapRecord;
+
+// Maps a capture file of one of the link types above. Returns 0 on success,
+// otherwise errbuf (of PCAP_ERRBUF_SIZE) describes the problem.
+int pcapOpen(PcapFile *file, const char *path, char *errbuf);
+
+// Returns the next record (1) or 0 at the end of the file
+int pcapNext(PcapFile *file, PcapRecord *record);
+
+// Continues reading at the record that starts at offset
+void pcapSeek(PcapFile *file, size_t offset);
+
+// Continues reading at the first record
+void pcapRewind(PcapFile *file);
+
+void pcapClose(PcapFile *file);
+
+// Typed USBPcap views of a record. They return NULL if the record is too
+// short for (or does not carry) the requested part.
+//
+// usbmon has no control stages: a submission with a setup packet becomes a
+// setup stage (carrying the data of an OUT transfer behind it, like older
+// USBPcap versions do), a completion with data a data stage and one without
+// a status stage.
+const USBPCAP_BUFFER_PACKET_HEADER *recordPacket(const PcapRecord *record);
+const USBPCAP_BUFFER_CONTROL_HEADER *recordControl(const PcapRecord *record);
+const USB_SETUP *recordSetup(const PcapRecord *record);
+
+// Returns the data behind the headers (the payload of a bulk transfer or a
+// control data stage, the data behind the setup packet of a setup stage) and
+// stores its length
+const unsigned char *recordPayload(const PcapRecord *record, uint32_t *length);
+
+// Returns the data of a control transfer carried by the record and stores
+// its length (0 if there is none). Newer USBPcap versions send the data of
+// OUT transfers in a separate data stage, while older ones and usbmon put it
+// behind the setup packet, so both stages may carry it.
+const unsigned char *recordControlData(const PcapRecord *record, uint32_t *length);
+
+// Helpers shared by the tools
+int hostToDevice(unsigned char info);
+int getEndpoint(unsigned char endpoint);
+int getDirection(unsigned char endpoint);
+const char *endpointToDirection(unsigned char endpoint);
+
+// Converts a timestamp to the offset to the first packet. start has to be
+// cleared before the first packet of a file.
+void normalizeTimeval(struct timeval *start, const struct timeval *recorded, struct timeval *result);
+unsigned long timevalToMicroseconds(const struct timeval *time);
+
+#endif /* USBPCAP_H */
@@ -16,101 +16,79 @@
  * (c) 2014 Simon Schuster, Sebastian Rachuj
  */
 
+#include <errno.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Bytes read at most at once. A hex digit expands to at most 5 characters. */
+#define BLOCK 65536
+
+/* The bits of every hex digit, NULL for other characters */
+static const char *nibbles[256] = {
+	['0'] = "0000", ['1'] = "0001", ['2'] = "0010", ['3'] = "0011",
+	['4'] = "0100", ['5'] = "0101", ['6'] = "0110", ['7'] = "0111",
+	['8'] = "1000", ['9'] = "1001", ['a'] = "1010", ['b'] = "1011",
+	['c'] = "1100", ['d'] = "1101", ['e'] = "1110", ['f'] = "1111",
+};
+
+static char in[BLOCK];
+static char out[5 * BLOCK];
 
 static int pstate = 0;
-void state_toggle()
+/* A space follows every second digit (one byte) */
+static char *state_toggle(char *pos)
 {
 	if (pstate)
-		putchar(' ');
+		*pos++ = ' ';
 	pstate = !pstate;
+	return pos;
 }
 
 int main(int argc, char **argv)
 {
 	int state = 0;
-	while (!feof(stdin) && !ferror(stdin)) {
-		int cur = fgetc(stdin);
-		if (cur == EOF)
-			break;
-		if (!state) {
-			if (cur == '\'')
-				state = 1;
-			putchar(cur);
-		} else {
-			switch(cur) {
-				case '0':
-					printf("0000");
-					state_toggle();
-					break;
-				case '1':
-					printf("0001");
-					state_toggle();
-					break;
-				case '2':
-					printf("0010");
-					state_toggle();
-					break;
-				case '3':
-					printf("0011");
-					state_toggle();
-					break;
-				case '4':
-					printf("0100");
-					state_toggle();
-					break;
-				case '5':
-					printf("0101");
-					state_toggle();
-					break;
-				case '6':
-					printf("0110");
-					state_toggle();
-					break;
-				case '7':
-					printf("0111");
-					state_toggle();
-					break;
-				case '8':
-					printf("1000");
-					state_toggle();
-					break;
-				case '9':
-					printf("1001");
-					state_toggle();
-					break;
-				case 'a':
-					printf("1010");
-					state_toggle();
-					break;
-				case 'b':
-					printf("1011");
-					state_toggle();
-					break;
-				case 'c':
-					printf("1100");
-					state_toggle();
-					break;
-				case 'd':
-					printf("1101");
-					state_toggle();
-					break;
-				case 'e':
-					printf("1110");
-					state_toggle();
-					break;
-				case 'f':
-					printf("1111");
-					state_toggle();
-					break;
-				case '\'':
+	ssize_t length;
+
+	/* read() returns what is available, so streamed input (e.g. from
+	 * tail -f) is converted as it comes in */
+	while ((length = read(STDIN_FILENO, in, sizeof(in))) != 0) {
+		if (length < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			return 1;
+		}
+		const char *cur = in;
+		const char *end = in + length;
+		char *pos = out;
+
+		while (cur < end) {
+			if (!state) {
+				/* Copy everything up to (and including) the next ' */
+				const char *quote = memchr(cur, '\'', end - cur);
+				const char *stop = quote ? quote + 1 : end;
+				memcpy(pos, cur, stop - cur);
+				pos += stop - cur;
+				cur = stop;
+				if (quote)
+					state = 1;
+				continue;
+			}
+			const char *bits = nibbles[(unsigned char) *cur];
+			if (bits) {
+				memcpy(pos, bits, 4);
+				pos = state_toggle(pos + 4);
+			} else {
+				if (*cur == '\'')
 					state = 0;
-				default:
-					pstate = 0;
-					putchar(cur);
-					break;
+				pstate = 0;
+				*pos++ = *cur;
 			}
+			cur++;
 		}
+		fwrite(out, 1, pos - out, stdout);
+		fflush(stdout);
 	}
+	return 0;
 }
-
@@ -22,69 +22,21 @@
 
 #include <stdio.h>
 #include <inttypes.h>
-#include <pcap.h>
 #include <stdlib.h>
 #include <sys/time.h>
-#include <stdlib.h>
-
-#include "pcap_types.h"
-
-int hostToDevice(unsigned char info) {
-	return !(info & 1);
-}
 
-int getEndpoint(unsigned char endpoint) {
-	return endpoint & 0b01111111;
-}
-
-int getDirection(unsigned char endpoint) {
-	return endpoint >> 7;
-}
+#include "hexformat.h"
+#include "usbpcap.h"
 
-const char *endpointToDirection(unsigned char endpoint) {
-	if (getDirection(endpoint)) {
-		// in
-		return "i";
-	} else {
-		// out
-		return "o";
-	}
-}
-
-struct timeval start = {0, 0};
-
-void normalizeTimeval(struct timeval *recorded, struct timeval *result) {
-	if (!timerisset(&start)) {
-		// This is the first packet
-		start = *recorded;
-		// This packet has an offset of 0
-		timerclear(result);
-	} else {
-		// Get the offset
-		timersub(recorded, &start, result);
-	}
-}
-
-unsigned long timevalToMicroseconds(struct timeval *time) {
-	return time->tv_sec * 1000000 + time->tv_usec;
-}
-
-void printData(FILE *fd, uint32_t length, unsigned char *pointer) {
-	for(int i=0; i<length; i++) {
-		fprintf(fd, "%02x", pointer[i]);
-		if(i != 0 && ((i + 1) % 4) == 0) {
-			fprintf(fd, " ");
-		}
-	}
+void printData(FILE *fd, uint32_t length, const unsigned char *pointer) {
+	printHex(fd, pointer, length, NULL);
 }
 
 //------------------------------------------------------------------- 
 int main(int argc, char **argv) 
 { 
  
-	//temporary packet buffers 
-	struct pcap_pkthdr header; // The header that pcap gives us 
-	const u_char *packet; // The actual packet 
+	PcapRecord record; // The current packet, a view into the mapped file
 	
 	//check command line arguments 
 	if (argc < 2) { 
@@ -96,15 +48,15 @@ int main(int argc, char **argv)
 	//loop through each pcap file in command line args 
 	for (int fnum=1; fnum < argc; fnum++) {  
 		unsigned int pkt_counter=0;	// packet counter 
+		struct timeval start;
 		timerclear(&start); // reset timervalues
 	 
 		//----------------- 
 		//open the pcap file 
-		pcap_t *handle; 
-		char errbuf[PCAP_ERRBUF_SIZE]; //not sure what to do with this, oh well 
-		handle = pcap_open_offline(argv[fnum], errbuf);		//call pcap library function 
+		PcapFile file; 
+		char errbuf[PCAP_ERRBUF_SIZE];
 	 
-		if (handle == NULL) { 
+		if (pcapOpen(&file, argv[fnum], errbuf)) { 
 			fprintf(stderr,"Couldn't open pcap file %s: %s\n", argv[fnum], errbuf); 
 			return(2); 
 		} 
@@ -112,14 +64,14 @@ int main(int argc, char **argv)
 		//----------------- 
 		//begin processing the packets in this particular file, one at a time 
 	 
-		while (packet = pcap_next(handle,&header)) { 
-			if (header.len < sizeof(USBPCAP_BUFFER_PACKET_HEADER)) {
+		while (pcapNext(&file, &record)) { 
+			// header contains information about the packet (e.g. timestamp) 
+			const USBPCAP_BUFFER_PACKET_HEADER *pkt = recordPacket(&record);
+			if (!pkt) {
 				fprintf(stderr, "Packet %d smaller than usb-packet header\n", pkt_counter);
 				exit(EXIT_FAILURE);
 			}
 
-			// header contains information about the packet (e.g. timestamp) 
-			USBPCAP_BUFFER_PACKET_HEADER *pkt = (USBPCAP_BUFFER_PACKET_HEADER *)packet; //cast a pointer to the packet data 
 
 			// endpoint (offset 17) is the endpoint number used on the USB bus
 			// (the MSB describes transfer direction)
@@ -129,11 +81,13 @@ int main(int argc, char **argv)
 			int device = pkt->device;
 			uint64_t requestid = pkt->irpId;
 			unsigned char info = pkt->info;
+			const unsigned char *payload;
+			uint32_t length;
 			//struct timeval normalized;
-			//normalizeTimeval(&header.ts, &normalized);
+			//normalizeTimeval(&start, &record.ts, &normalized);
 
 			printf("%lx ", requestid);
-			printf("%lu ", timevalToMicroseconds(&header.ts));
+			printf("%lu ", timevalToMicroseconds(&record.ts));
 			if(!pkt->status) {
 				if (hostToDevice(info) && !pkt->status) {
 					printf("S ");
@@ -151,27 +105,30 @@ int main(int argc, char **argv)
 				printf("C%s:", endpointToDirection(pkt->endpoint));
 				// Bus, device, endpoint
 				printf("%03d:%03d:%d ", bus, device, endpoint);
-				if (header.len < sizeof(USBPCAP_BUFFER_CONTROL_HEADER)) {
+				const USBPCAP_BUFFER_CONTROL_HEADER *controlheader = recordControl(&record);
+				const USB_SETUP *setupdata;
+				if (!controlheader) {
 					fprintf(stderr, "Packet %d is a control packet but too small for the controlheader\n", pkt_counter);
 					exit(EXIT_FAILURE);
 				}
-				USBPCAP_BUFFER_CONTROL_HEADER *controlheader = (USBPCAP_BUFFER_CONTROL_HEADER *) pkt;
 
 				switch (controlheader->stage) {
 				case USBPCAP_CONTROL_STAGE_SETUP:
-					if(header.len < sizeof(USBPCAP_BUFFER_CONTROL_HEADER) + sizeof(USB_SETUP)) {
+					setupdata = recordSetup(&record);
+					if (!setupdata) {
 						fprintf(stderr, "Packet %d is a setup packet but does not carry the setup header\n", pkt_counter);
 						exit(EXIT_FAILURE);
 					}
 
-					USB_SETUP *setupdata = (USB_SETUP *) (((char *) pkt) + sizeof(USBPCAP_BUFFER_CONTROL_HEADER));
 					// Setuppacket + setupdata
 					printf("s %02x %02x %04x %04x %04x ", setupdata->bmRequestType, setupdata->bRequest, setupdata->wValue, setupdata->wIndex, setupdata->wLength);
 					// Length
 					printf("%d ", setupdata->wLength);
 
-					if (header.len > sizeof(USBPCAP_BUFFER_CONTROL_HEADER) + sizeof(USB_SETUP)) {
-						fprintf(stderr, "Spare data in setup packet %d\n", pkt_counter);
+					payload = recordControlData(&record, &length);
+					if (length) {
+						printf("= ");
+						printData(stdout, length, payload);
 					} else {
 						// empty data
 						printf("<");
@@ -185,7 +142,8 @@ int main(int argc, char **argv)
 					// Data (that is present) starts with a =
 					printf("= ");
 					// print the data
-					printData(stdout, pkt->dataLength, ((char *) pkt) + sizeof(USBPCAP_BUFFER_CONTROL_HEADER));
+					payload = recordControlData(&record, &length);
+					printData(stdout, length, payload);
 					break;
 				case USBPCAP_CONTROL_STAGE_STATUS:
 					// Build a demo packet with the appropriate statuscode
@@ -197,7 +155,8 @@ int main(int argc, char **argv)
 						fprintf(stderr, "Warning: a STAGE_STATUS package with datasize > 0 received, parsing assumptions may not hold\n");
 					}
 					printf("= ");
-					printData(stdout, pkt->dataLength, ((char *) pkt) + sizeof(USBPCAP_BUFFER_CONTROL_HEADER));
+					payload = recordPayload(&record, &length);
+					printData(stdout, length, payload);
 					break;
 				default:
 					fprintf(stderr, "Unknown control stage received\n");
@@ -214,7 +173,8 @@ int main(int argc, char **argv)
 				printf("%u ", pkt->status);
 				// Data length:
 				printf("%d = ", pkt->dataLength);
-				printData(stdout, pkt->dataLength, ((char *) pkt) + sizeof(USBPCAP_BUFFER_PACKET_HEADER));
+				payload = recordPayload(&record, &length);
+				printData(stdout, length, payload);
 				break;
 
 			case USBPCAP_TRANSFER_ISOCHRONOUS:
@@ -237,7 +197,7 @@ int main(int argc, char **argv)
 
 		} //end internal loop for reading packets (all in one file) 
 	 
-		pcap_close(handle);  //close the pcap file 
+		pcapClose(&file);  //close the pcap file 
  
 	} //end for loop through each command line argument 
 	//---------- Done with Main Packet Processing Loop --------------  
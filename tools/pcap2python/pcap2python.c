@@ -22,12 +22,11 @@
 
 #include <stdio.h>
 #include <inttypes.h>
-#include <pcap.h>
 #include <stdlib.h>
 #include <sys/time.h>
-#include <stdlib.h>
 
-#include "pcap_types.h"
+#include "hexformat.h"
+#include "usbpcap.h"
 
 void printFunctionheader(){
 }
@@ -36,66 +35,17 @@ void printDelim(){
 	printf("|------+---------------+----------+--------+--------+---------------------------------------------------|\n");
 }
 
-int hostToDevice(unsigned char info) {
-	return !(info & 1);
-}
-
-int getEndpoint(unsigned char endpoint) {
-	return endpoint & 0b01111111;
-}
-
-int getDirection(unsigned char endpoint) {
-	return endpoint >> 7;
-}
-
-const char *endpointToDirection(unsigned char endpoint) {
-	if (getDirection(endpoint)) {
-		// in
-		return "i";
-	} else {
-		// out
-		return "o";
-	}
-}
-
-struct timeval start = {0, 0};
-
-void normalizeTimeval(struct timeval *recorded, struct timeval *result) {
-	if (!timerisset(&start)) {
-		// This is the first packet
-		start = *recorded;
-		// This packet has an offset of 0
-		timerclear(result);
-	} else {
-		// Get the offset
-		timersub(recorded, &start, result);
-	}
-}
-
-unsigned long timevalToMicroseconds(struct timeval *time) {
-	return time->tv_sec * 1000000 + time->tv_usec;
-}
-
-int printData(FILE *fd, uint32_t length, unsigned char *pointer) {
-	int charsprinted = 0;
-	for(int i=0; i<length; i++) {
-		fprintf(fd, "%02x", pointer[i]);
-		charsprinted +=2;
-		if(i != 0 && ((i + 1) % 4) == 0) {
-			fprintf(fd, " ");
-			charsprinted++;
-		}
-	}
-	return charsprinted;
+int printData(FILE *fd, uint32_t length, const unsigned char *pointer) {
+	printHex(fd, pointer, length, NULL);
+	// Two digits per byte and a space after each group
+	return 2 * length + length / 4;
 }
 
 //------------------------------------------------------------------- 
 int main(int argc, char **argv) 
 { 
  
-	//temporary packet buffers 
-	struct pcap_pkthdr header; // The header that pcap gives us 
-	const u_char *packet; // The actual packet 
+	PcapRecord record; // The current packet, a view into the mapped file
 	int packettodump = -1;
 	
 	//check command line arguments 
@@ -107,15 +57,15 @@ int main(int argc, char **argv)
 	//-------- Begin Main Packet Processing ------------------- 
 	//loop through each pcap file in command line args 
 	unsigned int pkt_counter=0;	// packet counter 
+	struct timeval start;
 	timerclear(&start); // reset timervalues
  
 	//----------------- 
 	//open the pcap file 
-	pcap_t *handle; 
-	char errbuf[PCAP_ERRBUF_SIZE]; //not sure what to do with this, oh well 
-	handle = pcap_open_offline(argv[1], errbuf);		//call pcap library function 
+	PcapFile file; 
+	char errbuf[PCAP_ERRBUF_SIZE];
  
-	if (handle == NULL) { 
+	if (pcapOpen(&file, argv[1], errbuf)) { 
 		fprintf(stderr,"Couldn't open pcap file %s: %s\n", argv[1], errbuf); 
 		return(2); 
 	} 
@@ -126,19 +76,19 @@ int main(int argc, char **argv)
 
 	printFunctionheader();
  
-	while (packet = pcap_next(handle,&header)) { 
+	while (pcapNext(&file, &record)) { 
 		if (pkt_counter != packettodump && packettodump != -1) {
 			pkt_counter++;
 			continue;
 		}
 
-		if (header.len < sizeof(USBPCAP_BUFFER_PACKET_HEADER)) {
+		// header contains information about the packet (e.g. timestamp) 
+		const USBPCAP_BUFFER_PACKET_HEADER *pkt = recordPacket(&record);
+		if (!pkt) {
 			fprintf(stderr, "Packet %d smaller than usb-packet header\n", pkt_counter);
 			exit(EXIT_FAILURE);
 		}
 
-		// header contains information about the packet (e.g. timestamp) 
-		USBPCAP_BUFFER_PACKET_HEADER *pkt = (USBPCAP_BUFFER_PACKET_HEADER *)packet; //cast a pointer to the packet data 
 
 		// endpoint (offset 17) is the endpoint number used on the USB bus
 		// (the MSB describes transfer direction)
@@ -149,7 +99,11 @@ int main(int argc, char **argv)
 		uint64_t requestid = pkt->irpId;
 		unsigned char info = pkt->info;
 		struct timeval normalized;
-		normalizeTimeval(&header.ts, &normalized);
+		const USBPCAP_BUFFER_CONTROL_HEADER *controlheader;
+		const USB_SETUP *setupdata;
+		const unsigned char *payload;
+		uint32_t length;
+		normalizeTimeval(&start, &record.ts, &normalized);
 
 #if 0
 		if (hostToDevice(info)) {
@@ -179,20 +133,21 @@ int main(int argc, char **argv)
 
 		switch (pkt->transfer) {
 		case USBPCAP_TRANSFER_CONTROL:
-			if (header.len < sizeof(USBPCAP_BUFFER_CONTROL_HEADER)) {
+			controlheader = recordControl(&record);
+			if (!controlheader) {
 				fprintf(stderr, "Packet %d is a control packet but too small for the controlheader\n", pkt_counter);
 				exit(EXIT_FAILURE);
 			}
-			USBPCAP_BUFFER_CONTROL_HEADER *controlheader = (USBPCAP_BUFFER_CONTROL_HEADER *) pkt;
+			payload = recordControlData(&record, &length);
 
 			switch (controlheader->stage) {
 			case USBPCAP_CONTROL_STAGE_SETUP:
-				if(header.len < sizeof(USBPCAP_BUFFER_CONTROL_HEADER) + sizeof(USB_SETUP)) {
+				setupdata = recordSetup(&record);
+				if (!setupdata) {
 					fprintf(stderr, "Packet %d is a setup packet but does not carry the setup header\n", pkt_counter);
 					exit(EXIT_FAILURE);
 				}
 
-				USB_SETUP *setupdata = (USB_SETUP *) (((char *) pkt) + sizeof(USBPCAP_BUFFER_CONTROL_HEADER));
 				//printf("\tSetupdata:\n\t\tbmRequesttype:\t%02x\n\t\tbRequest:\t%02x\n\t\twValue:\t\t%04x\n\t\twIndex:\t\t%04x\n\t\twLength:\t%04x\n", setupdata->bmRequestType, setupdata->bRequest, setupdata->wValue, setupdata->wIndex, setupdata->wLength);
 				if(setupdata->bRequest != 0xc0){
 					if(*endpointToDirection(pkt->endpoint) != 'i') {
@@ -216,10 +171,11 @@ int main(int argc, char **argv)
 					}
 				}
 
-				if (header.len > sizeof(USBPCAP_BUFFER_CONTROL_HEADER) + sizeof(USB_SETUP)) {
-					fprintf(stderr, "Spare data in setup packet %d\n", pkt_counter);
-				} else {
-					//printf("\tData: <\n");
+				if (printdata && length) {
+					printf("'");
+					printData(stdout, length, payload);
+					printf("', None)\n");
+					printdata = 0;
 				}
 				break;
 			case USBPCAP_CONTROL_STAGE_DATA:
@@ -230,7 +186,7 @@ int main(int argc, char **argv)
 #endif
 				if(printdata){
 					printf("'");
-					int dataprinted = printData(stdout, pkt->dataLength, ((char *) pkt) + sizeof(USBPCAP_BUFFER_CONTROL_HEADER));
+					int dataprinted = printData(stdout, length, payload);
 					printf("', None)\n");
 				}
 				printdata = 0;
@@ -279,13 +235,13 @@ int main(int argc, char **argv)
 
 	if (packettodump != -1) {
 		// the was only this one packet to dump
-		pcap_close(handle);  //close the pcap file 
+		pcapClose(&file);  //close the pcap file 
 		exit(EXIT_SUCCESS);
 	}
  
 	} //end for loop through each command line argument 
 
-	pcap_close(handle);  //close the pcap file 
+	pcapClose(&file);  //close the pcap file 
 	exit(EXIT_SUCCESS);
 	//---------- Done with Main Packet Processing Loop --------------  
 	return 0; //done
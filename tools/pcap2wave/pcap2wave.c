@@ -0,0 +1,208 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+//	pcap2wave
+//
+//	 extracts the measurement data of the bulk transfers in a pcap file. The
+//	 samples are decoded by the library and written to one binary file per
+//	 channel, a text file lists the frames and the time/div state word (0xb3)
+//	 that was sent last before each frame.
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <libsds200a.h>
+
+#include "usbpcap.h"
+
+// The endpoint of the measurement data
+#define BULK_ENDPOINT 0x82
+// The request that sets time/div
+#define REQUEST_TIME 0xb3
+// The length of the state word
+#define STATE_LENGTH 21
+// Bytes in front of the samples of a frame
+#define FRAME_HEADER 8
+
+// The largest payload the device sends is 20096 bytes
+#define MAX_SAMPLES 16384
+#define FILE_BUFFER (1 << 20)
+
+// The state word sent last
+unsigned char stateWord[STATE_LENGTH];
+int stateKnown = 0;
+
+FILE *openOutput(const char *prefix, const char *suffix) {
+	char path[strlen(prefix) + strlen(suffix) + 1];
+	strcpy(path, prefix);
+	strcat(path, suffix);
+	FILE *fd = fopen(path, "wb");
+	if (!fd) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	setvbuf(fd, NULL, _IOFBF, FILE_BUFFER);
+	return fd;
+}
+
+// Remembers the state word of a 0xb3 request
+void setState(const unsigned char *data, uint32_t length) {
+	if (length >= STATE_LENGTH) {
+		memcpy(stateWord, data, STATE_LENGTH);
+		stateKnown = 1;
+	}
+}
+
+void printState(FILE *fd) {
+	if (!stateKnown) {
+		fprintf(fd, "-");
+		return;
+	}
+	for (int i = 0; i < STATE_LENGTH; i++) {
+		fprintf(fd, "%02x", stateWord[i]);
+	}
+}
+
+//------------------------------------------------------------------- 
+int main(int argc, char **argv) 
+{ 
+	PcapRecord record; // The current packet, a view into the mapped file
+
+	//check command line arguments 
+	if (argc != 2 && argc != 3) { 
+		fprintf(stderr, "Usage: %s <input pcap> [<output prefix>]\n", argv[0]); 
+		exit(EXIT_FAILURE); 
+	} 
+	const char *prefix = argc == 3 ? argv[2] : argv[1];
+
+	PcapFile file; 
+	char errbuf[PCAP_ERRBUF_SIZE];
+	if (pcapOpen(&file, argv[1], errbuf)) { 
+		fprintf(stderr,"Couldn't open pcap file %s: %s\n", argv[1], errbuf); 
+		return(2); 
+	} 
+
+	FILE *channels[2] = { openOutput(prefix, ".ch1"), openOutput(prefix, ".ch2") };
+	FILE *frames = openOutput(prefix, ".frames");
+	fprintf(frames, "# frame\tpacket\ttime\toffset\tsamples\tstateword\n");
+
+	// The samples are copied out of the mapping since they are not aligned
+	// there
+	static union {
+		struct sds_samples samples;
+		unsigned char bytes[FRAME_HEADER + 2 * MAX_SAMPLES];
+	} frame;
+	static uint16_t decoded[MAX_SAMPLES];
+	static uint16_t samples[2][MAX_SAMPLES / 2];
+
+	unsigned int pkt_counter = 0;
+	unsigned int frame_counter = 0;
+	uint64_t offset = 0; // samples per channel written so far
+	int timeRequest = 0; // the data stage of a 0xb3 request follows
+	struct timeval start;
+	timerclear(&start);
+
+	for (; pcapNext(&file, &record); pkt_counter++) {
+		const USBPCAP_BUFFER_PACKET_HEADER *pkt = recordPacket(&record);
+		const USBPCAP_BUFFER_CONTROL_HEADER *control;
+		const USB_SETUP *setup;
+		const unsigned char *payload;
+		uint32_t length;
+		struct timeval normalized;
+
+		if (!pkt) {
+			fprintf(stderr, "Packet %d smaller than usb-packet header\n", pkt_counter);
+			continue;
+		}
+		normalizeTimeval(&start, &record.ts, &normalized);
+
+		switch (pkt->transfer) {
+		case USBPCAP_TRANSFER_CONTROL:
+			if (!(control = recordControl(&record))) {
+				break;
+			}
+			if ((setup = recordSetup(&record))) {
+				timeRequest = setup->bRequest == REQUEST_TIME;
+			}
+			payload = recordControlData(&record, &length);
+			if (timeRequest && length) {
+				setState(payload, length);
+				timeRequest = 0;
+			}
+			break;
+
+		case USBPCAP_TRANSFER_BULK:
+			// Only completed transfers of the data endpoint carry data
+			if (pkt->endpoint != BULK_ENDPOINT || hostToDevice(pkt->info) || pkt->status) {
+				break;
+			}
+			payload = recordPayload(&record, &length);
+			if (length <= FRAME_HEADER) {
+				break;
+			}
+			if (length > sizeof(frame.bytes)) {
+				fprintf(stderr, "Packet %d is too large for a frame, skipping\n", pkt_counter);
+				break;
+			}
+			size_t count = (length - FRAME_HEADER) / 2;
+			memcpy(frame.bytes, payload, length);
+			if (sds_decode_samples(NULL, &frame.samples, count, decoded)) {
+				fprintf(stderr, "Couldn't decode packet %d\n", pkt_counter);
+				break;
+			}
+
+			// The channels alternate
+			size_t perChannel = count / 2;
+			for (size_t i = 0; i < perChannel; i++) {
+				samples[0][i] = decoded[2 * i];
+				samples[1][i] = decoded[2 * i + 1];
+			}
+			fwrite(samples[0], sizeof(uint16_t), perChannel, channels[0]);
+			fwrite(samples[1], sizeof(uint16_t), perChannel, channels[1]);
+
+			fprintf(frames, "%u\t%u\t%lu\t%" PRIu64 "\t%zu\t", frame_counter, pkt_counter,
+			        timevalToMicroseconds(&normalized), offset, perChannel);
+			printState(frames);
+			fprintf(frames, "\n");
+			offset += perChannel;
+			frame_counter++;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	int status = EXIT_SUCCESS;
+	for (int i = 0; i < 2; i++) {
+		if (fclose(channels[i])) {
+			perror("Couldn't write the samples");
+			status = EXIT_FAILURE;
+		}
+	}
+	if (fclose(frames)) {
+		perror("Couldn't write the frame index");
+		status = EXIT_FAILURE;
+	}
+	pcapClose(&file);
+	return status;
+}
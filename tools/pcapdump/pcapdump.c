@@ -18,117 +18,75 @@
 
 //	pcap_throughput
 //
-//	 reads in a pcap file and outputs basic throughput statistics 
+//	 reads in a pcap file and outputs basic throughput statistics. Several
+//	 files can be dumped in parallel (-j), the output keeps their order.
 
 #include <stdio.h>
 #include <inttypes.h>
-#include <pcap.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <sys/time.h>
-#include <stdlib.h>
-
-#include "pcap_types.h"
-
-int hostToDevice(unsigned char info) {
-	return !(info & 1);
-}
-
-int getEndpoint(unsigned char endpoint) {
-	return endpoint & 0b01111111;
-}
-
-int getDirection(unsigned char endpoint) {
-	return endpoint >> 7;
-}
-
-const char *endpointToDirection(unsigned char endpoint) {
-	if (getDirection(endpoint)) {
-		// in
-		return "i";
-	} else {
-		// out
-		return "o";
-	}
-}
-
-struct timeval start = {0, 0};
+#include <unistd.h>
 
-void normalizeTimeval(struct timeval *recorded, struct timeval *result) {
-	if (!timerisset(&start)) {
-		// This is the first packet
-		start = *recorded;
-		// This packet has an offset of 0
-		timerclear(result);
-	} else {
-		// Get the offset
-		timersub(recorded, &start, result);
-	}
-}
-
-unsigned long timevalToMicroseconds(struct timeval *time) {
-	return time->tv_sec * 1000000 + time->tv_usec;
-}
+#include "hexformat.h"
+#include "pcapindex.h"
+#include "usbpcap.h"
 
-void printData(FILE *fd, uint32_t length, unsigned char *pointer) {
-	for(int i=0; i<length; i++) {
-		fprintf(fd, "%02x", pointer[i]);
-		if(i != 0 && ((i + 1) % 4) == 0) {
-			if ((i + 1) % 32 == 0) {
-				fprintf(fd, "\n\t\t");
-			} else {
-				fprintf(fd, " ");
-			}
-		}
-	}
+void printData(FILE *fd, uint32_t length, const unsigned char *pointer) {
+	printHex(fd, pointer, length, "\n\t\t");
 }
 
-//------------------------------------------------------------------- 
-int main(int argc, char **argv) 
-{ 
- 
-	//temporary packet buffers 
-	struct pcap_pkthdr header; // The header that pcap gives us 
-	const u_char *packet; // The actual packet 
-	int packettodump = -1;
-	
-	//check command line arguments 
-	if (!((argc == 2) || ((argc == 3) && (packettodump = atoi(argv[2])) > 0))) { 
-  		fprintf(stderr, "Usage: %s <input pcap> <packet number>\n", argv[0]); 
-		exit(EXIT_FAILURE); 
-	} 
-	
-	//-------- Begin Main Packet Processing ------------------- 
-	//loop through each pcap file in command line args 
+// Dumps the packets of one pcap file that pass filter to out, warnings go to
+// err. Returns the exit status of the file.
+int dumpFile(const char *path, const IndexFilter *filter, FILE *out, FILE *err)
+{
+	PcapRecord record; // The current packet, a view into the mapped file
+	PcapIndex index;
+	int indexed = 0;
+	size_t packet = INDEX_BEGIN;
 	unsigned int pkt_counter=0;	// packet counter 
+	struct timeval start;
 	timerclear(&start); // reset timervalues
  
 	//----------------- 
 	//open the pcap file 
-	pcap_t *handle; 
-	char errbuf[PCAP_ERRBUF_SIZE]; //not sure what to do with this, oh well 
-	handle = pcap_open_offline(argv[1], errbuf);		//call pcap library function 
+	PcapFile file; 
+	char errbuf[PCAP_ERRBUF_SIZE];
  
-	if (handle == NULL) { 
-		fprintf(stderr,"Couldn't open pcap file %s: %s\n", argv[1], errbuf); 
+	if (pcapOpen(&file, path, errbuf)) { 
+		fprintf(err,"Couldn't open pcap file %s: %s\n", path, errbuf); 
 		return(2); 
 	} 
  
+	// Selected packets are found with the index instead of reading all
+	if (!filterAll(filter)) {
+		if (indexOpen(&index, &file, path)) {
+			fprintf(err, "Couldn't index pcap file %s\n", path);
+			pcapClose(&file);
+			return EXIT_FAILURE;
+		}
+		indexed = 1;
+		if (filter->packet == -1) {
+			// The times stay relative to the first packet of the file
+			indexFirstTime(&index, &start);
+		}
+	}
+ 
 	//----------------- 
 	//begin processing the packets in this particular file, one at a time 
  
-	while (packet = pcap_next(handle,&header)) { 
-		if (pkt_counter != packettodump && packettodump != -1) {
-			pkt_counter++;
-			continue;
-		}
+	while (indexNext(indexed ? &index : NULL, &file, filter, &packet, &record)) { 
+		pkt_counter = packet;
 
-		if (header.len < sizeof(USBPCAP_BUFFER_PACKET_HEADER)) {
-			fprintf(stderr, "Packet %d smaller than usb-packet header\n", pkt_counter);
-			exit(EXIT_FAILURE);
+		// header contains information about the packet (e.g. timestamp) 
+		const USBPCAP_BUFFER_PACKET_HEADER *pkt = recordPacket(&record);
+		if (!pkt) {
+			fprintf(err, "Packet %d smaller than usb-packet header\n", pkt_counter);
+			pcapClose(&file);
+			return EXIT_FAILURE;
 		}
 
-		// header contains information about the packet (e.g. timestamp) 
-		USBPCAP_BUFFER_PACKET_HEADER *pkt = (USBPCAP_BUFFER_PACKET_HEADER *)packet; //cast a pointer to the packet data 
 
 		// endpoint (offset 17) is the endpoint number used on the USB bus
 		// (the MSB describes transfer direction)
@@ -139,114 +97,317 @@ int main(int argc, char **argv)
 		uint64_t requestid = pkt->irpId;
 		unsigned char info = pkt->info;
 		struct timeval normalized;
-		normalizeTimeval(&header.ts, &normalized);
+		const unsigned char *payload;
+		uint32_t length;
+		normalizeTimeval(&start, &record.ts, &normalized);
 
 		if (hostToDevice(info)) {
-			printf("-> ");
+			fprintf(out, "-> ");
 		} else {
-			printf("<- ");
+			fprintf(out, "<- ");
 		}
 
-		printf("Packet %d found\n", pkt_counter);
+		fprintf(out, "Packet %d found\n", pkt_counter);
 
-		printf("\tID: %lx\n", requestid);
-		printf("\tTime: %lu\n", timevalToMicroseconds(&normalized));
+		fprintf(out, "\tID: %lx\n", requestid);
+		fprintf(out, "\tTime: %lu\n", timevalToMicroseconds(&normalized));
 		if(!pkt->status) {
 			if (hostToDevice(info) && !pkt->status) {
-				printf("\tDirection: S\n");
+				fprintf(out, "\tDirection: S\n");
 			} else if (!hostToDevice(info) && !pkt->status) {
-				printf("\tDirection: C\n");
+				fprintf(out, "\tDirection: C\n");
 			}
 		} else {
-			printf("\tDirection: E\n");
+			fprintf(out, "\tDirection: E\n");
 		}
-		printf("\tirpInfo: %d\n", info);
-		printf("\tbus: %03d\n", bus);
-		printf("\tdevice: %03d\n", device);
-		printf("\tendpoint: %d\n", endpoint);
+		fprintf(out, "\tirpInfo: %d\n", info);
+		fprintf(out, "\tbus: %03d\n", bus);
+		fprintf(out, "\tdevice: %03d\n", device);
+		fprintf(out, "\tendpoint: %d\n", endpoint);
 
 		switch (pkt->transfer) {
 		case USBPCAP_TRANSFER_CONTROL:
-			printf("\tTransfertype: C%s\n", endpointToDirection(pkt->endpoint));
-			if (header.len < sizeof(USBPCAP_BUFFER_CONTROL_HEADER)) {
-				fprintf(stderr, "Packet %d is a control packet but too small for the controlheader\n", pkt_counter);
-				exit(EXIT_FAILURE);
+			fprintf(out, "\tTransfertype: C%s\n", endpointToDirection(pkt->endpoint));
+			const USBPCAP_BUFFER_CONTROL_HEADER *controlheader = recordControl(&record);
+			const USB_SETUP *setupdata;
+			if (!controlheader) {
+				fprintf(err, "Packet %d is a control packet but too small for the controlheader\n", pkt_counter);
+				pcapClose(&file);
+				return EXIT_FAILURE;
 			}
-			USBPCAP_BUFFER_CONTROL_HEADER *controlheader = (USBPCAP_BUFFER_CONTROL_HEADER *) pkt;
 
 			switch (controlheader->stage) {
 			case USBPCAP_CONTROL_STAGE_SETUP:
-				if(header.len < sizeof(USBPCAP_BUFFER_CONTROL_HEADER) + sizeof(USB_SETUP)) {
-					fprintf(stderr, "Packet %d is a setup packet but does not carry the setup header\n", pkt_counter);
-					exit(EXIT_FAILURE);
+				setupdata = recordSetup(&record);
+				if (!setupdata) {
+					fprintf(err, "Packet %d is a setup packet but does not carry the setup header\n", pkt_counter);
+					pcapClose(&file);
+					return EXIT_FAILURE;
 				}
 
-				USB_SETUP *setupdata = (USB_SETUP *) (((char *) pkt) + sizeof(USBPCAP_BUFFER_CONTROL_HEADER));
-				printf("\tURB-Statusword: setup\n");
-				printf("\tSetupdata:\n\t\tbmRequesttype:\t%02x\n\t\tbRequest:\t%02x\n\t\twValue:\t\t%04x\n\t\twIndex:\t\t%04x\n\t\twLength:\t%04x\n", setupdata->bmRequestType, setupdata->bRequest, setupdata->wValue, setupdata->wIndex, setupdata->wLength);
-				printf("\tLength: %d\n", setupdata->wLength);
+				fprintf(out, "\tURB-Statusword: setup\n");
+				fprintf(out, "\tSetupdata:\n\t\tbmRequesttype:\t%02x\n\t\tbRequest:\t%02x\n\t\twValue:\t\t%04x\n\t\twIndex:\t\t%04x\n\t\twLength:\t%04x\n", setupdata->bmRequestType, setupdata->bRequest, setupdata->wValue, setupdata->wIndex, setupdata->wLength);
+				fprintf(out, "\tLength: %d\n", setupdata->wLength);
 
-				if (header.len > sizeof(USBPCAP_BUFFER_CONTROL_HEADER) + sizeof(USB_SETUP)) {
-					fprintf(stderr, "Spare data in setup packet %d\n", pkt_counter);
+				payload = recordControlData(&record, &length);
+				if (length) {
+					fprintf(out, "\tData:\t");
+					printData(out, length, payload);
+					fprintf(out, "\n");
 				} else {
-					printf("\tData: <\n");
+					fprintf(out, "\tData: <\n");
 				}
 				break;
 			case USBPCAP_CONTROL_STAGE_DATA:
-				printf("\tURB-Statusword: %u\n", pkt->status);
-				printf("\tLength: %d\n", pkt->dataLength);
-				printf("\tData:\t");
-				printData(stdout, pkt->dataLength, ((char *) pkt) + sizeof(USBPCAP_BUFFER_CONTROL_HEADER));
-				printf("\n");
+				fprintf(out, "\tURB-Statusword: %u\n", pkt->status);
+				fprintf(out, "\tLength: %d\n", pkt->dataLength);
+				fprintf(out, "\tData:\t");
+				payload = recordControlData(&record, &length);
+				printData(out, length, payload);
+				fprintf(out, "\n");
 				break;
 			case USBPCAP_CONTROL_STAGE_STATUS:
 				// Build a demo packet with the appropriate statuscode
-				printf("\tURB-Statusword: %u\n", pkt->status);
-				printf("\tLength: %d\n", pkt->dataLength);
+				fprintf(out, "\tURB-Statusword: %u\n", pkt->status);
+				fprintf(out, "\tLength: %d\n", pkt->dataLength);
 				if (pkt->dataLength > 0) {
-					fprintf(stderr, "Warning: a STAGE_STATUS package with datasize > 0 received, parsing assumptions may not hold\n");
+					fprintf(err, "Warning: a STAGE_STATUS package with datasize > 0 received, parsing assumptions may not hold\n");
 				}
-				printf("\tData:\t");
-				printData(stdout, pkt->dataLength, ((char *) pkt) + sizeof(USBPCAP_BUFFER_CONTROL_HEADER));
-				printf("\n");
+				fprintf(out, "\tData:\t");
+				payload = recordPayload(&record, &length);
+				printData(out, length, payload);
+				fprintf(out, "\n");
 				break;
 			default:
-				fprintf(stderr, "Unknown control stage received\n");
+				fprintf(err, "Unknown control stage received\n");
 			}
 			break;
 
 		case USBPCAP_TRANSFER_BULK:
-			printf("\tTransfertype: B%s\n", endpointToDirection(pkt->endpoint));
-			printf("\tData:\t");
-			printData(stdout, pkt->dataLength, ((char *) pkt) + sizeof(USBPCAP_BUFFER_PACKET_HEADER));
-			printf("\n");
+			fprintf(out, "\tTransfertype: B%s\n", endpointToDirection(pkt->endpoint));
+			fprintf(out, "\tData:\t");
+			payload = recordPayload(&record, &length);
+			printData(out, length, payload);
+			fprintf(out, "\n");
 			break;
 
 		case USBPCAP_TRANSFER_ISOCHRONOUS:
-			fprintf(stderr, "Isochronous Transfer not implemented, skipping\n");
+			fprintf(err, "Isochronous Transfer not implemented, skipping\n");
 			break;
 
 		case USBPCAP_TRANSFER_INTERRUPT:
-			fprintf(stderr, "Interrupt Transfer not implemented, skipping\n");
+			fprintf(err, "Interrupt Transfer not implemented, skipping\n");
 			break;
 
 		default:
-			fprintf(stderr, "Unknown transfertype found, skipping\n");
+			fprintf(err, "Unknown transfertype found, skipping\n");
 			break;
 		}
  
-		pkt_counter++; //increment number of packets seen 
+	}
 
-	if (packettodump != -1) {
-		// the was only this one packet to dump
-		pcap_close(handle);  //close the pcap file 
-		exit(EXIT_SUCCESS);
+	if (indexed) {
+		indexClose(&index);
 	}
- 
-	} //end for loop through each command line argument 
+	pcapClose(&file);  //close the pcap file 
+	return EXIT_SUCCESS;
+}
+
+// One input file of the parallel mode. Its output is collected in memory and
+// printed as soon as all files before it have been printed.
+typedef struct {
+	const char *path;
+	char *out;
+	size_t outSize;
+	char *err;
+	size_t errSize;
+	int status;
+	int done;
+} Job;
+
+typedef struct {
+	Job *jobs;
+	int count;
+	int next; // the next job a worker takes
+	int printed; // the jobs before this one have been printed
+	int window; // how far the workers may run ahead of the printing
+	const IndexFilter *filter;
+	pthread_mutex_t lock;
+	pthread_cond_t changed; // a job was finished or printed
+} Pool;
+
+void *worker(void *arg) {
+	Pool *pool = arg;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->next < pool->count) {
+		// Bound the memory of the buffered output
+		if (pool->next >= pool->printed + pool->window) {
+			pthread_cond_wait(&pool->changed, &pool->lock);
+			continue;
+		}
+		Job *job = &pool->jobs[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		FILE *out = open_memstream(&job->out, &job->outSize);
+		FILE *err = open_memstream(&job->err, &job->errSize);
+		if (out && err) {
+			job->status = dumpFile(job->path, pool->filter, out, err);
+		} else {
+			job->status = EXIT_FAILURE;
+		}
+		if (out) {
+			fclose(out);
+		}
+		if (err) {
+			fclose(err);
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		job->done = 1;
+		pthread_cond_broadcast(&pool->changed);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+// Dumps the files on a pool of workers and prints them in the given order
+int dumpParallel(char **paths, int count, int workers, const IndexFilter *filter) {
+	Pool pool = { .count = count, .window = 2 * workers, .filter = filter };
+	pthread_t threads[workers];
+	int status = EXIT_SUCCESS;
+	int started;
+
+	pool.jobs = calloc(count, sizeof(Job));
+	if (!pool.jobs) {
+		fprintf(stderr, "Out of memory\n");
+		return EXIT_FAILURE;
+	}
+	for (int i = 0; i < count; i++) {
+		pool.jobs[i].path = paths[i];
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.changed, NULL);
+	for (started = 0; started < workers; started++) {
+		if (pthread_create(&threads[started], NULL, worker, &pool)) {
+			break;
+		}
+	}
+	if (!started) {
+		fprintf(stderr, "Couldn't start a worker\n");
+		status = EXIT_FAILURE;
+		goto cleanup;
+	}
+
+	for (int i = 0; i < count; i++) {
+		Job *job = &pool.jobs[i];
+
+		pthread_mutex_lock(&pool.lock);
+		while (!job->done) {
+			pthread_cond_wait(&pool.changed, &pool.lock);
+		}
+		pthread_mutex_unlock(&pool.lock);
+
+		printf("File: %s\n", job->path);
+		fflush(stdout);
+		fwrite(job->out, 1, job->outSize, stdout);
+		fwrite(job->err, 1, job->errSize, stderr);
+		if (job->status != EXIT_SUCCESS) {
+			status = job->status;
+		}
+		free(job->out);
+		free(job->err);
+
+		pthread_mutex_lock(&pool.lock);
+		pool.printed = i + 1;
+		pthread_cond_broadcast(&pool.changed);
+		pthread_mutex_unlock(&pool.lock);
+	}
+
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+cleanup:
+	pthread_cond_destroy(&pool.changed);
+	pthread_mutex_destroy(&pool.lock);
+	free(pool.jobs);
+	return status;
+}
+
+// Returns true if argument is a (positive) packet number
+int isPacketNumber(const char *argument) {
+	char *end;
+	long number = strtol(argument, &end, 10);
+	return *argument && !*end && number > 0 && number <= INT_MAX;
+}
+
+//------------------------------------------------------------------- 
+int main(int argc, char **argv) 
+{ 
+	IndexFilter filter;
+	int workers = 1;
+	int option;
+
+	filterInit(&filter);
+	while ((option = getopt(argc, argv, "j:r:t:")) != -1) {
+		switch (option) {
+		case 'r':
+			if (filterParseRequest(&filter, optarg)) {
+				goto usage;
+			}
+			break;
+		case 't':
+			if (filterParseTime(&filter, optarg)) {
+				goto usage;
+			}
+			break;
+		case 'j':
+			workers = atoi(optarg);
+			if (workers <= 0) {
+				// one worker per core
+				workers = sysconf(_SC_NPROCESSORS_ONLN);
+			}
+			break;
+		default:
+			goto usage;
+		}
+	}
+	char **paths = argv + optind;
+	int count = argc - optind;
+
+	//check command line arguments 
+	if (count < 1) {
+		goto usage;
+	}
+	if (count == 2 && isPacketNumber(paths[1])) {
+		filter.packet = atoi(paths[1]);
+		count = 1;
+	}
+
+	if (count == 1) {
+		return dumpFile(paths[0], &filter, stdout, stderr);
+	}
+	if (workers > count) {
+		workers = count;
+	}
+	if (workers > 1) {
+		return dumpParallel(paths, count, workers, &filter);
+	}
+
+	int status = EXIT_SUCCESS;
+	for (int i = 0; i < count; i++) {
+		printf("File: %s\n", paths[i]);
+		fflush(stdout);
+		int result = dumpFile(paths[i], &filter, stdout, stderr);
+		if (result != EXIT_SUCCESS) {
+			status = result;
+		}
+	}
+	return status;
 
-	pcap_close(handle);  //close the pcap file 
-	exit(EXIT_SUCCESS);
-	//---------- Done with Main Packet Processing Loop --------------  
-	return 0; //done
+usage:
+	fprintf(stderr, "Usage: %s [-j workers] [-r bRequest] [-t from:to] <input pcap> [<packet number>]\n"
+	        "       %s [-j workers] [-r bRequest] [-t from:to] <input pcap>...\n", argv[0], argv[0]);
+	exit(EXIT_FAILURE);
 } //end of main() function
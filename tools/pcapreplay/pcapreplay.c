@@ -0,0 +1,333 @@
+/* This file is part of the SDS 200A library project.
+ *
+ * It is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Libsds200a is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsds200a. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * (c) 2014 Simon Schuster, Sebastian Rachuj
+ */
+
+//	pcapreplay
+//
+//	 reissues the control and bulk transfers of a pcap file to a connected
+//	 device, either with the original gaps between them or as fast as
+//	 possible, and reports how far the transfers missed their schedule.
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <libusb.h>
+
+#include "usbpcap.h"
+
+#define VENDOR_ID 0x0da8
+#define PRODUCT_ID 0x0001
+
+// Deadlines are approached with clock_nanosleep() up to this distance and
+// with busy waiting for the rest, since the wake up of a sleep is late by
+// tens of microseconds
+#define SPIN_NS 200000
+// Transfers later than this are listed in the report
+#define LATE_NS 100000
+// How many earlier transfers are searched for the submission of a completion
+#define SEARCH_DEPTH 64
+
+// A transfer of the trace
+typedef struct {
+	int64_t time; // in ns after the first transfer
+	uint64_t irp; // to find the completion
+	int control;
+	USB_SETUP setup;
+	uint8_t endpoint; // of a bulk transfer
+	uint32_t length; // of the data (OUT) or the buffer (IN)
+	const unsigned char *data; // OUT data in the mapping
+	uint32_t dataLength; // captured, may be less than length
+} Transfer;
+
+typedef struct {
+	Transfer *transfers;
+	size_t count;
+	size_t capacity;
+} Schedule;
+
+static Transfer *addTransfer(Schedule *schedule) {
+	if (schedule->count == schedule->capacity) {
+		size_t capacity = schedule->capacity ? 2 * schedule->capacity : 1024;
+		Transfer *grown = realloc(schedule->transfers, capacity * sizeof(Transfer));
+		if (!grown) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		schedule->transfers = grown;
+		schedule->capacity = capacity;
+	}
+	Transfer *transfer = &schedule->transfers[schedule->count++];
+	memset(transfer, 0, sizeof(*transfer));
+	return transfer;
+}
+
+// Returns the recent transfer with the request id irp
+static Transfer *findTransfer(Schedule *schedule, uint64_t irp) {
+	for (size_t i = schedule->count; i > 0 && schedule->count - i < SEARCH_DEPTH; i--) {
+		if (schedule->transfers[i - 1].irp == irp) {
+			return &schedule->transfers[i - 1];
+		}
+	}
+	return NULL;
+}
+
+static int64_t recordTime(const PcapRecord *record) {
+	return ((int64_t) record->ts.tv_sec * 1000000 + record->ts.tv_usec) * 1000;
+}
+
+// Collects the transfers the host submitted. The length of a bulk read is
+// taken from its completion.
+static void loadSchedule(Schedule *schedule, PcapFile *file) {
+	PcapRecord record;
+	int64_t first = -1;
+
+	while (pcapNext(file, &record)) {
+		const USBPCAP_BUFFER_PACKET_HEADER *pkt = recordPacket(&record);
+		const USBPCAP_BUFFER_CONTROL_HEADER *control = recordControl(&record);
+		const USB_SETUP *setup = recordSetup(&record);
+		const unsigned char *payload;
+		uint32_t length;
+		Transfer *transfer;
+
+		if (!pkt) {
+			continue;
+		}
+		if (first == -1) {
+			first = recordTime(&record);
+		}
+
+		if (pkt->transfer == USBPCAP_TRANSFER_CONTROL && control && hostToDevice(pkt->info)) {
+			if (setup) {
+				transfer = addTransfer(schedule);
+				transfer->time = recordTime(&record) - first;
+				transfer->irp = pkt->irpId;
+				transfer->control = 1;
+				transfer->setup = *setup;
+				transfer->length = setup->wLength;
+			} else if (!(transfer = findTransfer(schedule, pkt->irpId)) || !transfer->control) {
+				continue;
+			}
+			payload = recordControlData(&record, &length);
+			if (length) {
+				transfer->data = payload;
+				transfer->dataLength = length;
+			}
+		} else if (pkt->transfer == USBPCAP_TRANSFER_BULK) {
+			payload = recordPayload(&record, &length);
+			if (hostToDevice(pkt->info)) {
+				transfer = addTransfer(schedule);
+				transfer->time = recordTime(&record) - first;
+				transfer->irp = pkt->irpId;
+				transfer->endpoint = pkt->endpoint;
+				if (!getDirection(pkt->endpoint)) {
+					transfer->data = payload;
+					transfer->dataLength = length;
+					transfer->length = length;
+				}
+			} else if (getDirection(pkt->endpoint)) {
+				// A completion without submission is replayed at
+				// its own time
+				if (!(transfer = findTransfer(schedule, pkt->irpId)) || transfer->control) {
+					transfer = addTransfer(schedule);
+					transfer->time = recordTime(&record) - first;
+					transfer->irp = pkt->irpId;
+					transfer->endpoint = pkt->endpoint;
+				}
+				transfer->length = pkt->dataLength;
+			}
+		}
+	}
+}
+
+static int64_t now(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (int64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// Returns at the absolute (CLOCK_MONOTONIC) time deadline
+static void waitUntil(int64_t deadline) {
+	if (deadline - now() > SPIN_NS) {
+		struct timespec wakeup;
+		wakeup.tv_sec = (deadline - SPIN_NS) / 1000000000;
+		wakeup.tv_nsec = (deadline - SPIN_NS) % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL)) {
+			// interrupted
+		}
+	}
+	while (now() < deadline) {
+		// spin
+	}
+}
+
+static int compareTimes(const void *a, const void *b) {
+	int64_t x = *(const int64_t *) a;
+	int64_t y = *(const int64_t *) b;
+	return (x > y) - (x < y);
+}
+
+//------------------------------------------------------------------- 
+int main(int argc, char **argv) 
+{ 
+	int fast = 0;
+	int realtime = 0;
+	unsigned int timeout = 1000;
+	long milliseconds;
+	char *end;
+	int option;
+
+	while ((option = getopt(argc, argv, "fpt:")) != -1) {
+		switch (option) {
+		case 'f':
+			fast = 1;
+			break;
+		case 'p':
+			realtime = 1;
+			break;
+		case 't':
+			milliseconds = strtol(optarg, &end, 10);
+			if (!*optarg || *end || milliseconds < 0 || milliseconds > INT_MAX) {
+				goto usage;
+			}
+			timeout = milliseconds;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1) {
+		goto usage;
+	}
+
+	PcapFile file; 
+	char errbuf[PCAP_ERRBUF_SIZE];
+	if (pcapOpen(&file, argv[optind], errbuf)) { 
+		fprintf(stderr,"Couldn't open pcap file %s: %s\n", argv[optind], errbuf); 
+		return(2); 
+	} 
+	Schedule schedule = { NULL, 0, 0 };
+	loadSchedule(&schedule, &file);
+	if (!schedule.count) {
+		fprintf(stderr, "No transfers in %s\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	libusb_context *usb;
+	libusb_device_handle *handle;
+	if (libusb_init(&usb)) {
+		fprintf(stderr, "Couldn't initialize libusb\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!(handle = libusb_open_device_with_vid_pid(usb, VENDOR_ID, PRODUCT_ID))) {
+		fprintf(stderr, "Couldn't open the device\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Page faults and other processes delay the wake ups by milliseconds
+	if (realtime) {
+		struct sched_param param = { .sched_priority = 50 };
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) || sched_setscheduler(0, SCHED_FIFO, &param)) {
+			perror("Couldn't switch to realtime scheduling");
+		}
+	}
+
+	int64_t *errors = malloc(schedule.count * sizeof(int64_t));
+	static unsigned char buffer[65536];
+	if (!errors) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	size_t failed = 0;
+	size_t late = 0;
+	int64_t start = now();
+
+	for (size_t i = 0; i < schedule.count; i++) {
+		Transfer *transfer = &schedule.transfers[i];
+		int64_t deadline = start + transfer->time;
+		int result;
+
+		if (!fast) {
+			waitUntil(deadline);
+		}
+		errors[i] = now() - deadline;
+		if (errors[i] > LATE_NS) {
+			late++;
+		}
+
+		if (transfer->control) {
+			const USB_SETUP *setup = &transfer->setup;
+			uint32_t captured = 0;
+			if (!(setup->bmRequestType & 0x80) && transfer->data) {
+				// A truncated record is padded with zeros
+				captured = transfer->dataLength < setup->wLength ? transfer->dataLength : setup->wLength;
+				memcpy(buffer, transfer->data, captured);
+			}
+			memset(buffer + captured, 0, setup->wLength - captured);
+			result = libusb_control_transfer(handle, setup->bmRequestType, setup->bRequest,
+			                                 setup->wValue, setup->wIndex, buffer,
+			                                 setup->wLength, timeout);
+		} else {
+			int transferred;
+			uint32_t length = transfer->length < sizeof(buffer) ? transfer->length : sizeof(buffer);
+			if (!getDirection(transfer->endpoint) && transfer->data) {
+				memcpy(buffer, transfer->data, length);
+			}
+			result = libusb_bulk_transfer(handle, transfer->endpoint, buffer, length,
+			                              &transferred, timeout);
+		}
+		if (result < 0) {
+			if (failed < 10) {
+				fprintf(stderr, "Transfer %zu failed: %s\n", i, libusb_error_name(result));
+			}
+			failed++;
+		}
+	}
+	int64_t duration = now() - start;
+	int64_t recorded = schedule.transfers[schedule.count - 1].time;
+
+	printf("transfers: %zu, failed: %zu\n", schedule.count, failed);
+	printf("duration: %.3f ms (recorded: %.3f ms)\n", duration / 1e6, recorded / 1e6);
+	if (!fast) {
+		int64_t sum = 0;
+		for (size_t i = 0; i < schedule.count; i++) {
+			sum += errors[i];
+		}
+		qsort(errors, schedule.count, sizeof(int64_t), compareTimes);
+		printf("timing error: mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+		       sum / 1e3 / schedule.count, errors[schedule.count / 2] / 1e3,
+		       errors[schedule.count * 99 / 100] / 1e3, errors[schedule.count - 1] / 1e3);
+		printf("late by more than %d us: %zu\n", LATE_NS / 1000, late);
+	}
+
+	free(errors);
+	free(schedule.transfers);
+	libusb_close(handle);
+	libusb_exit(usb);
+	pcapClose(&file);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "Usage: %s [-f] [-p] [-t timeout] <input pcap>\n", argv[0]);
+	exit(EXIT_FAILURE);
+}
@@ -22,12 +22,14 @@
 
 #include <stdio.h>
 #include <inttypes.h>
-#include <pcap.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
-#include <stdlib.h>
+#include <unistd.h>
 
-#include "pcap_types.h"
+#include "hexformat.h"
+#include "pcapindex.h"
+#include "usbpcap.h"
 
 void printTableheader(){
 	printf("|------+---------------+----------+--------+--------+---------------------------------------------------|\n"
@@ -39,113 +41,181 @@ void printDelim(){
 	printf("|------+---------------+----------+--------+--------+---------------------------------------------------|\n");
 }
 
-int hostToDevice(unsigned char info) {
-	return !(info & 1);
+int printData(FILE *fd, uint32_t length, const unsigned char *pointer) {
+	printHex(fd, pointer, length, "\n\t\t");
+	// Two digits per byte and a space after each group, the wraps are not
+	// counted
+	return 2 * length + length / 4 - length / 32;
 }
 
-int getEndpoint(unsigned char endpoint) {
-	return endpoint & 0b01111111;
-}
+// State of the bit-diff mode for one bRequest
+typedef struct {
+	unsigned char *last; // the previous payload
+	unsigned char *changed; // the bits that changed in any payload so far
+	uint32_t length;
+} DiffState;
 
-int getDirection(unsigned char endpoint) {
-	return endpoint >> 7;
-}
+DiffState diffStates[256];
 
-const char *endpointToDirection(unsigned char endpoint) {
-	if (getDirection(endpoint)) {
-		// in
-		return "i";
-	} else {
-		// out
-		return "o";
+#define HIGHLIGHT "\033[35m"
+#define NORMAL "\033[0m"
+
+// Prints data in binary, bits set in changed are highlighted. Bytes are
+// separated by a space, groups of 4 bytes by two (like hextobin does).
+void printBits(const unsigned char *data, const unsigned char *changed, uint32_t length) {
+	static char bits[256][9];
+	if (!bits[1][0]) {
+		for (int value = 0; value < 256; value++) {
+			for (int bit = 0; bit < 8; bit++) {
+				bits[value][bit] = value & (0x80 >> bit) ? '1' : '0';
+			}
+		}
+	}
+
+	for (uint32_t i = 0; i < length; i++) {
+		if (!changed || !changed[i]) {
+			fwrite(bits[data[i]], 1, 8, stdout);
+		} else {
+			for (int bit = 0; bit < 8; bit++) {
+				if (changed[i] & (0x80 >> bit)) {
+					printf(HIGHLIGHT "%c" NORMAL, bits[data[i]][bit]);
+				} else {
+					putchar(bits[data[i]][bit]);
+				}
+			}
+		}
+		putchar(' ');
+		if ((i + 1) % 4 == 0) {
+			putchar(' ');
+		}
 	}
 }
 
-struct timeval start = {0, 0};
+// Prints the payload of a control transfer and highlights the bits that
+// differ from the previous payload of the same bRequest, or did so before
+void printDiff(const USB_SETUP *setup, const unsigned char *payload, uint32_t length) {
+	DiffState *state = &diffStates[setup->bRequest];
 
-void normalizeTimeval(struct timeval *recorded, struct timeval *result) {
-	if (!timerisset(&start)) {
-		// This is the first packet
-		start = *recorded;
-		// This packet has an offset of 0
-		timerclear(result);
+	printf("0x%02x C%s 0x%02x 0x%02x '", setup->bRequest,
+	       endpointToDirection(setup->bmRequestType), setup->wValue, setup->wIndex);
+	if (state->last && state->length == length) {
+		for (uint32_t i = 0; i < length; i++) {
+			state->changed[i] |= state->last[i] ^ payload[i];
+		}
+		memcpy(state->last, payload, length);
+		printBits(payload, state->changed, length);
 	} else {
-		// Get the offset
-		timersub(recorded, &start, result);
+		// The first payload or one of another size: start over
+		free(state->last);
+		free(state->changed);
+		state->last = malloc(length ? length : 1);
+		state->changed = calloc(length ? length : 1, 1);
+		if (!state->last || !state->changed) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(state->last, payload, length);
+		state->length = length;
+		printBits(payload, NULL, length);
 	}
+	printf("'\n");
 }
 
-unsigned long timevalToMicroseconds(struct timeval *time) {
-	return time->tv_sec * 1000000 + time->tv_usec;
-}
-
-int printData(FILE *fd, uint32_t length, unsigned char *pointer) {
-	int charsprinted = 0;
-	for(int i=0; i<length; i++) {
-		fprintf(fd, "%02x", pointer[i]);
-		charsprinted +=2;
-		if(i != 0 && ((i + 1) % 4) == 0) {
-			if ((i + 1) % 32 == 0) {
-				fprintf(fd, "\n\t\t");
-			} else {
-				fprintf(fd, " ");
-				charsprinted++;
-			}
-		}
+// Completes the row of a control transfer with its payload
+void printPayload(const USB_SETUP *setup, const unsigned char *payload, uint32_t length, int bitdiff) {
+	if (bitdiff) {
+		printDiff(setup, payload, length);
+	} else {
+		printf(" '");
+		int dataprinted = printData(stdout, length, payload);
+		printf("'");
+		for(int k=0; k< 47-dataprinted; k++)
+			printf(" ");
+		printf(" |\n");
+		printDelim();
 	}
-	return charsprinted;
 }
 
 //------------------------------------------------------------------- 
 int main(int argc, char **argv) 
 { 
  
-	//temporary packet buffers 
-	struct pcap_pkthdr header; // The header that pcap gives us 
-	const u_char *packet; // The actual packet 
-	int packettodump = -1;
+	PcapRecord record; // The current packet, a view into the mapped file
+	PcapIndex index;
+	IndexFilter filter;
+	size_t packet = INDEX_BEGIN;
+	int option;
+	int valid = 1;
+	int bitdiff = 0;
 	
 	//check command line arguments 
-	if (!((argc == 2) || ((argc == 3) && (packettodump = atoi(argv[2])) > 0))) { 
-  		fprintf(stderr, "Usage: %s <input pcap> <packet number>\n", argv[0]); 
+	filterInit(&filter);
+	while ((option = getopt(argc, argv, "br:t:")) != -1) {
+		switch (option) {
+		case 'b':
+			bitdiff = 1;
+			break;
+		case 'r':
+			valid = valid && !filterParseRequest(&filter, optarg);
+			break;
+		case 't':
+			valid = valid && !filterParseTime(&filter, optarg);
+			break;
+		default:
+			valid = 0;
+		}
+	}
+	char *path = argv[optind];
+	if (!valid || !((argc - optind == 1) || ((argc - optind == 2) && (filter.packet = atoi(argv[optind + 1])) > 0))) { 
+  		fprintf(stderr, "Usage: %s [-b] [-r bRequest] [-t from:to] <input pcap> [<packet number>]\n", argv[0]); 
 		exit(EXIT_FAILURE); 
 	} 
 	
 	//-------- Begin Main Packet Processing ------------------- 
 	//loop through each pcap file in command line args 
 	unsigned int pkt_counter=0;	// packet counter 
+	struct timeval start;
 	timerclear(&start); // reset timervalues
  
 	//----------------- 
 	//open the pcap file 
-	pcap_t *handle; 
-	char errbuf[PCAP_ERRBUF_SIZE]; //not sure what to do with this, oh well 
-	handle = pcap_open_offline(argv[1], errbuf);		//call pcap library function 
+	PcapFile file; 
+	char errbuf[PCAP_ERRBUF_SIZE];
  
-	if (handle == NULL) { 
-		fprintf(stderr,"Couldn't open pcap file %s: %s\n", argv[1], errbuf); 
+	if (pcapOpen(&file, path, errbuf)) { 
+		fprintf(stderr,"Couldn't open pcap file %s: %s\n", path, errbuf); 
 		return(2); 
 	} 
+
+	// Selected packets are found with the index instead of reading all
+	int indexed = !filterAll(&filter);
+	if (indexed && indexOpen(&index, &file, path)) {
+		fprintf(stderr, "Couldn't index pcap file %s\n", path);
+		exit(EXIT_FAILURE);
+	}
  
 	//----------------- 
 	//begin processing the packets in this particular file, one at a time 
 	int printdata = 0;
+	USB_SETUP pending; // the setup packet of the current control transfer
 
-	printTableheader();
+	if (bitdiff) {
+		// The output is written in large blocks
+		setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+	} else {
+		printTableheader();
+	}
  
-	while (packet = pcap_next(handle,&header)) { 
-		if (pkt_counter != packettodump && packettodump != -1) {
-			pkt_counter++;
-			continue;
-		}
+	while (indexNext(indexed ? &index : NULL, &file, &filter, &packet, &record)) { 
+		pkt_counter = packet;
 
-		if (header.len < sizeof(USBPCAP_BUFFER_PACKET_HEADER)) {
+		// header contains information about the packet (e.g. timestamp) 
+		const USBPCAP_BUFFER_PACKET_HEADER *pkt = recordPacket(&record);
+		if (!pkt) {
 			fprintf(stderr, "Packet %d smaller than usb-packet header\n", pkt_counter);
 			exit(EXIT_FAILURE);
 		}
 
-		// header contains information about the packet (e.g. timestamp) 
-		USBPCAP_BUFFER_PACKET_HEADER *pkt = (USBPCAP_BUFFER_PACKET_HEADER *)packet; //cast a pointer to the packet data 
 
 		// endpoint (offset 17) is the endpoint number used on the USB bus
 		// (the MSB describes transfer direction)
@@ -156,7 +226,11 @@ int main(int argc, char **argv)
 		uint64_t requestid = pkt->irpId;
 		unsigned char info = pkt->info;
 		struct timeval normalized;
-		normalizeTimeval(&header.ts, &normalized);
+		const USBPCAP_BUFFER_CONTROL_HEADER *controlheader;
+		const USB_SETUP *setupdata;
+		const unsigned char *payload;
+		uint32_t length;
+		normalizeTimeval(&start, &record.ts, &normalized);
 
 #if 0
 		if (hostToDevice(info)) {
@@ -186,22 +260,27 @@ int main(int argc, char **argv)
 
 		switch (pkt->transfer) {
 		case USBPCAP_TRANSFER_CONTROL:
-			if (header.len < sizeof(USBPCAP_BUFFER_CONTROL_HEADER)) {
+			controlheader = recordControl(&record);
+			if (!controlheader) {
 				fprintf(stderr, "Packet %d is a control packet but too small for the controlheader\n", pkt_counter);
 				exit(EXIT_FAILURE);
 			}
-			USBPCAP_BUFFER_CONTROL_HEADER *controlheader = (USBPCAP_BUFFER_CONTROL_HEADER *) pkt;
+			payload = recordControlData(&record, &length);
 
 			switch (controlheader->stage) {
 			case USBPCAP_CONTROL_STAGE_SETUP:
-				if(header.len < sizeof(USBPCAP_BUFFER_CONTROL_HEADER) + sizeof(USB_SETUP)) {
+				setupdata = recordSetup(&record);
+				if (!setupdata) {
 					fprintf(stderr, "Packet %d is a setup packet but does not carry the setup header\n", pkt_counter);
 					exit(EXIT_FAILURE);
 				}
 
-				USB_SETUP *setupdata = (USB_SETUP *) (((char *) pkt) + sizeof(USBPCAP_BUFFER_CONTROL_HEADER));
 				//printf("\tSetupdata:\n\t\tbmRequesttype:\t%02x\n\t\tbRequest:\t%02x\n\t\twValue:\t\t%04x\n\t\twIndex:\t\t%04x\n\t\twLength:\t%04x\n", setupdata->bmRequestType, setupdata->bRequest, setupdata->wValue, setupdata->wIndex, setupdata->wLength);
-				if(setupdata->bRequest != 0xc0){
+				pending = *setupdata;
+				if (bitdiff) {
+					// The data stage that follows is compared
+					printdata = setupdata->bRequest != 0xc0 || filter.request == 0xc0;
+				} else if(setupdata->bRequest != 0xc0){
 					printf("| C%s   |", endpointToDirection(pkt->endpoint));
 					printf(" 0x%02x          |", setupdata->bmRequestType);
 					printf(" 0x%02x     |", setupdata->bRequest);
@@ -210,10 +289,9 @@ int main(int argc, char **argv)
 					printdata = 1;
 				}
 
-				if (header.len > sizeof(USBPCAP_BUFFER_CONTROL_HEADER) + sizeof(USB_SETUP)) {
-					fprintf(stderr, "Spare data in setup packet %d\n", pkt_counter);
-				} else {
-					//printf("\tData: <\n");
+				if (printdata && length) {
+					printPayload(&pending, payload, length, bitdiff);
+					printdata = 0;
 				}
 				break;
 			case USBPCAP_CONTROL_STAGE_DATA:
@@ -222,14 +300,8 @@ int main(int argc, char **argv)
 				printf("\tLength: %d\n", pkt->dataLength);
 				printf("\tData:\t");
 #endif
-				if(printdata){
-					printf(" '");
-					int dataprinted = printData(stdout, pkt->dataLength, ((char *) pkt) + sizeof(USBPCAP_BUFFER_CONTROL_HEADER));
-					printf("'");
-					for(int k=0; k< 47-dataprinted; k++)
-						printf(" ");
-					printf(" |\n");
-					printDelim();
+				if (printdata) {
+					printPayload(&pending, payload, length, bitdiff);
 				}
 				printdata = 0;
 				break;
@@ -245,14 +317,14 @@ int main(int argc, char **argv)
 				printData(stdout, pkt->dataLength, ((char *) pkt) + sizeof(USBPCAP_BUFFER_CONTROL_HEADER));
 				printf("\n");
 #endif
-				if(printdata) {
+				if(printdata && !bitdiff) {
 					printf("  ");
 					printf(" ");
 					for(int k=0; k< 47; k++)
 						printf(" ");
 					printf(" |\n");
-					printdata = 0;
 				}
+				printdata = 0;
 				break;
 			default:
 				fprintf(stderr, "Unknown control stage received\n");
@@ -281,17 +353,12 @@ int main(int argc, char **argv)
 			break;
 		}
  
-		pkt_counter++; //increment number of packets seen 
-
-	if (packettodump != -1) {
-		// the was only this one packet to dump
-		pcap_close(handle);  //close the pcap file 
-		exit(EXIT_SUCCESS);
-	}
- 
 	} //end for loop through each command line argument 
 
-	pcap_close(handle);  //close the pcap file 
+	if (indexed) {
+		indexClose(&index);
+	}
+	pcapClose(&file);  //close the pcap file 
 	exit(EXIT_SUCCESS);
 	//---------- Done with Main Packet Processing Loop --------------  
 	return 0; //done